@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,9 +11,54 @@
 #include <grp.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
 #define BUFFER_SIZE 4096
 #define MAX_REDUNDANCY 10
+#define DIRENT_BUFFER_SIZE (256 * 1024)
+#define INGEST_BUFFER_SIZE (4 * 1024 * 1024)
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+#define VERIFY_SEGMENT_SIZE (64 * 1024 * 1024)
+#define MAX_WORKERS 64
+#define REFLINK_MIN_SIZE (1024 * 1024)
+
+static inline uint32_t load_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t load_le64(const uint8_t *p) {
+    return (uint64_t)load_le32(p) | ((uint64_t)load_le32(p + 4) << 32);
+}
+
+static inline void store_le32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static inline void store_le64(uint8_t *p, uint64_t value) {
+    store_le32(p, (uint32_t)value);
+    store_le32(p + 4, (uint32_t)(value >> 32));
+}
 
+static inline void store_be32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
 
 // Узел дерева Хаффмана
 typedef struct HuffmanNode {
@@ -21,12 +67,6 @@ typedef struct HuffmanNode {
     struct HuffmanNode *left, *right;
 } HuffmanNode;
 
-// Очередь с приоритетом для построения дерева Хаффмана
-typedef struct PriorityQueue {
-    int size;
-    HuffmanNode **nodes;
-} PriorityQueue;
-
 // Создание нового узла
 HuffmanNode *create_node(char symbol, int frequency) {
     HuffmanNode *node = (HuffmanNode *)malloc(sizeof(HuffmanNode));
@@ -36,94 +76,7 @@ HuffmanNode *create_node(char symbol, int frequency) {
     return node;
 }
 
-// Создание очереди с приоритетом
-PriorityQueue *create_queue(int capacity) {
-    PriorityQueue *queue = (PriorityQueue *)malloc(sizeof(PriorityQueue));
-    queue->size = 0;
-    queue->nodes = (HuffmanNode **)malloc(capacity * sizeof(HuffmanNode *));
-    return queue;
-}
-
-// Добавление узла в очередь
-void enqueue(PriorityQueue *queue, HuffmanNode *node) {
-    int i = queue->size++;
-    while (i > 0 && queue->nodes[(i - 1) / 2]->frequency > node->frequency) {
-        queue->nodes[i] = queue->nodes[(i - 1) / 2];
-        i = (i - 1) / 2;
-    }
-    queue->nodes[i] = node;
-}
-
-// Извлечение узла с минимальной частотой
-HuffmanNode *dequeue(PriorityQueue *queue) {
-    HuffmanNode *min_node = queue->nodes[0];
-    queue->nodes[0] = queue->nodes[--queue->size];
-    int i = 0;
-    while (1) {
-        int left = 2 * i + 1;
-        int right = 2 * i + 2;
-        int smallest = i;
-        if (left < queue->size && queue->nodes[left]->frequency < queue->nodes[smallest]->frequency)
-            smallest = left;
-        if (right < queue->size && queue->nodes[right]->frequency < queue->nodes[smallest]->frequency)
-            smallest = right;
-        if (smallest == i) break;
-        HuffmanNode *temp = queue->nodes[i];
-        queue->nodes[i] = queue->nodes[smallest];
-        queue->nodes[smallest] = temp;
-        i = smallest;
-    }
-    return min_node;
-}
-
-// Построение дерева Хаффмана
-HuffmanNode *build_huffman_tree(int *frequencies) {
-    PriorityQueue *queue = create_queue(256);
-    for (int i = 0; i < 256; i++) {
-        if (frequencies[i] > 0) {
-            enqueue(queue, create_node((char)i, frequencies[i]));
-        }
-    }
-    while (queue->size > 1) {
-        HuffmanNode *left = dequeue(queue);
-        HuffmanNode *right = dequeue(queue);
-        HuffmanNode *parent = create_node('\0', left->frequency + right->frequency);
-        parent->left = left;
-        parent->right = right;
-        enqueue(queue, parent);
-    }
-    HuffmanNode *root = dequeue(queue);
-    free(queue->nodes);
-    free(queue);
-    return root;
-}
-
-// Генерация кодов Хаффмана
-void generate_codes(HuffmanNode *root, char *code, int depth, char **codes) {
-    if (root->left == NULL && root->right == NULL) {
-        code[depth] = '\0';
-        codes[(unsigned char)root->symbol] = strdup(code);
-        return;
-    }
-    code[depth] = '0';
-    generate_codes(root->left, code, depth + 1, codes);
-    code[depth] = '1';
-    generate_codes(root->right, code, depth + 1, codes);
-}
-
-// Сериализация дерева Хаффмана
-void serialize_tree(HuffmanNode *root, FILE *output) {
-    if (root == NULL) {
-        fputc('0', output);
-        return;
-    }
-    fputc('1', output);
-    fputc(root->symbol, output);
-    serialize_tree(root->left, output);
-    serialize_tree(root->right, output);
-}
-
-// Десериализация дерева Хаффмана
+// Десериализация дерева Хаффмана старого формата
 HuffmanNode *deserialize_tree(FILE *input) {
     int flag = fgetc(input); // Читаем флаг (1 или 0)
     if (flag == EOF) {
@@ -148,754 +101,7351 @@ HuffmanNode *deserialize_tree(FILE *input) {
     return node;
 }
 
-// Сжатие файла
-void compress_file(const char *input_file, const char *output_file) {
-    FILE *input = fopen(input_file, "rb");
-    if (!input) {
-        perror("Ошибка открытия входного файла");
-        exit(EXIT_FAILURE);
+// Табличный декодер Хаффмана: первый уровень разрешает HUFFMAN_TABLE_BITS
+// бит за один поиск (и сразу два символа, если оба кода в них помещаются),
+// более длинные коды уходят во вторую таблицу, а совсем длинные (дерево не
+// ограничено по глубине) дочитываются по дереву
+#define HUFFMAN_TABLE_BITS 11
+#define HUFFMAN_IO_BLOCK (1024 * 1024)
+
+enum { HUFFMAN_INVALID, HUFFMAN_LEAF, HUFFMAN_SUBTABLE, HUFFMAN_NODE };
+
+typedef struct {
+    uint8_t kind;
+    uint8_t length;     // сколько бит съедает запись на своем уровне
+    uint8_t symbols;    // сколько символов дает лист: 1 или 2
+    uint8_t bits;       // ширина индекса подтаблицы
+    uint8_t symbol[2];
+    uint32_t index;     // начало подтаблицы или номер узла для дочитывания
+} HuffmanEntry;
+
+typedef struct {
+    const HuffmanNode *root;
+    HuffmanEntry *entries;  // первый уровень, за ним подтаблицы
+    size_t count, capacity;
+    const HuffmanNode **nodes;
+    size_t node_count, node_capacity;
+} HuffmanDecoder;
+
+// Читатель битов от старшего к младшему: биты лежат в старших разрядах bits
+typedef struct {
+    FILE *input;
+    uint8_t *data;
+    size_t pos, end;
+    uint64_t bits;
+    int count;
+} BitReader;
+
+void free_huffman_tree(HuffmanNode *node) {
+    if (node) {
+        free_huffman_tree(node->left);
+        free_huffman_tree(node->right);
+        free(node);
     }
+}
 
-    // Подсчет частот символов
-    int frequencies[256] = {0};
-    char ch;
-    while (fread(&ch, sizeof(char), 1, input) == 1) {
-        frequencies[(unsigned char)ch]++;
+static int huffman_depth(const HuffmanNode *node) {
+    if (!node || (!node->left && !node->right)) {
+        return 0;
     }
-    fseek(input, 0, SEEK_SET);
+    int left = huffman_depth(node->left), right = huffman_depth(node->right);
+    return 1 + (left > right ? left : right);
+}
 
-    // Построение дерева Хаффмана
-    HuffmanNode *root = build_huffman_tree(frequencies);
+static size_t huffman_table_alloc(HuffmanDecoder *decoder, int bits) {
+    size_t start = decoder->count, size = (size_t)1 << bits;
+    if (decoder->count + size > decoder->capacity) {
+        decoder->capacity = (decoder->count + size) * 2;
+        decoder->entries = realloc(decoder->entries, decoder->capacity * sizeof(HuffmanEntry));
+    }
+    memset(decoder->entries + start, 0, size * sizeof(HuffmanEntry));
+    decoder->count += size;
+    return start;
+}
 
-    // Генерация кодов
-    char *codes[256] = {NULL};
-    char code[256];
-    generate_codes(root, code, 0, codes);
+// Раскладывает поддерево node в таблицу table шириной table_bits; code и
+// depth - путь от корня поддерева. level 0 - первый уровень, 1 - подтаблица.
+static void huffman_fill(HuffmanDecoder *decoder, size_t table, int table_bits, int level,
+                         const HuffmanNode *node, uint32_t code, int depth) {
+    if (!node) {
+        return;
+    }
+    if (!node->left && !node->right) {
+        size_t first = table + ((size_t)code << (table_bits - depth));
+        for (size_t i = 0; i < (size_t)1 << (table_bits - depth); i++) {
+            HuffmanEntry *entry = &decoder->entries[first + i];
+            entry->kind = HUFFMAN_LEAF;
+            entry->length = depth;
+            entry->symbols = 1;
+            entry->symbol[0] = (uint8_t)node->symbol;
+        }
+        return;
+    }
+    if (depth == table_bits) {
+        if (level == 0) {
+            int depth_left = huffman_depth(node);
+            int bits = depth_left < HUFFMAN_TABLE_BITS ? depth_left : HUFFMAN_TABLE_BITS;
+            size_t sub = huffman_table_alloc(decoder, bits);
+            HuffmanEntry *entry = &decoder->entries[table + code];
+            entry->kind = HUFFMAN_SUBTABLE;
+            entry->length = table_bits;
+            entry->bits = bits;
+            entry->index = sub;
+            huffman_fill(decoder, sub, bits, 1, node, 0, 0);
+        } else {
+            if (decoder->node_count == decoder->node_capacity) {
+                decoder->node_capacity = decoder->node_capacity ? decoder->node_capacity * 2 : 64;
+                decoder->nodes = realloc(decoder->nodes, decoder->node_capacity * sizeof(HuffmanNode *));
+            }
+            HuffmanEntry *entry = &decoder->entries[table + code];
+            entry->kind = HUFFMAN_NODE;
+            entry->length = table_bits;
+            entry->index = decoder->node_count;
+            decoder->nodes[decoder->node_count++] = node;
+        }
+        return;
+    }
+    huffman_fill(decoder, table, table_bits, level, node->left, code << 1, depth + 1);
+    huffman_fill(decoder, table, table_bits, level, node->right, (code << 1) | 1, depth + 1);
+}
 
-    // Запись сжатых данных
-    if (access(output_file, F_OK) == 0) {
-        printf("Файл %s уже существует. Перезаписать? [y/N] ", input_file);
-        int c = getchar();
-        // Очищаем буфер ввода
-        while (getchar() != '\n');
-        if (c != 'y' && c != 'Y') {
-            return; // Пропускаем файл, если пользователь не хочет перезаписывать
+// Корень должен быть внутренним узлом: дерево из одного листа не кодирует бит
+static void build_huffman_decoder(HuffmanDecoder *decoder, const HuffmanNode *root) {
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->root = root;
+    huffman_table_alloc(decoder, HUFFMAN_TABLE_BITS);
+    huffman_fill(decoder, 0, HUFFMAN_TABLE_BITS, 0, root, 0, 0);
+
+    // Склеиваем пары: если за коротким кодом в тех же битах индекса целиком
+    // помещается второй лист первого уровня, запись выдает оба символа
+    const size_t size = (size_t)1 << HUFFMAN_TABLE_BITS, mask = size - 1;
+    HuffmanEntry *single = malloc(size * sizeof(HuffmanEntry));
+    memcpy(single, decoder->entries, size * sizeof(HuffmanEntry));
+    for (size_t i = 0; i < size; i++) {
+        const HuffmanEntry *first = &single[i];
+        if (first->kind != HUFFMAN_LEAF) {
+            continue;
+        }
+        const HuffmanEntry *second = &single[(i << first->length) & mask];
+        if (second->kind == HUFFMAN_LEAF && first->length + second->length <= HUFFMAN_TABLE_BITS) {
+            decoder->entries[i].length += second->length;
+            decoder->entries[i].symbols = 2;
+            decoder->entries[i].symbol[1] = second->symbol[0];
         }
     }
-    FILE *output = fopen(output_file, "wb");
-    if (!output) {
-        perror("Ошибка создания выходного файла");
-        fclose(input);
-        exit(EXIT_FAILURE);
+    free(single);
+}
+
+static void free_huffman_decoder(HuffmanDecoder *decoder) {
+    free(decoder->entries);
+    free(decoder->nodes);
+}
+
+static inline uint64_t load_be64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+// Следующий блок входа: остаток текущего переносится в начало
+static BitReader __attribute__((noinline)) bit_reader_next_block(BitReader reader) {
+    memmove(reader.data, reader.data + reader.pos, reader.end - reader.pos);
+    reader.end -= reader.pos;
+    reader.pos = 0;
+    size_t got = fread(reader.data + reader.end, 1, HUFFMAN_IO_BLOCK - reader.end, reader.input);
+    reader.end += got;
+    if (got == 0) {
+        reader.input = NULL;
+    }
+    return reader;
+}
+
+// Дополняет буфер до 56+ бит, пока есть вход. Читатель передается по
+// значению, чтобы в горячем цикле его поля жили в регистрах.
+static inline BitReader bit_reader_refill(BitReader reader) {
+    if (reader.end - reader.pos < 8 && reader.input) {
+        reader = bit_reader_next_block(reader);
+    }
+    if (reader.end - reader.pos >= 8) {
+        reader.bits |= load_be64(reader.data + reader.pos) >> reader.count;
+        reader.pos += (63 - reader.count) >> 3;
+        reader.count |= 56;
+        return reader;
     }
+    while (reader.count <= 56 && reader.pos < reader.end) {
+        reader.bits |= (uint64_t)reader.data[reader.pos++] << (56 - reader.count);
+        reader.count += 8;
+    }
+    return reader;
+}
 
-    // Сериализация дерева Хаффмана
-    serialize_tree(root, output);
+// Декодирует не больше limit символов в out (место на limit + 1 байт), пока
+// не кончится вход. Последние символы и биты (меньше двух индексов первого
+// уровня) проходят по дереву: символ выдается только если его код целиком
+// уместился. В produced - число выданных символов, состояние читателя
+// сохраняется для следующего вызова. Возвращает 0 или -1 на поврежденных данных.
+static int huffman_decode(const HuffmanDecoder *decoder, BitReader *state, uint8_t *out, size_t limit,
+                          size_t *produced) {
+    BitReader reader = *state;
+    size_t out_len = 0;
+    const HuffmanEntry *table = decoder->entries;
+    int status = 0;
+
+    for (;;) {
+        // Короткие коды снимаем подряд, пока в буфере есть полный индекс
+        // первого уровня; за одну загрузку выходит не больше 128 символов
+        if (limit - out_len < 256) {
+            break;
+        }
+        if (reader.count < 2 * HUFFMAN_TABLE_BITS) {
+            reader = bit_reader_refill(reader);
+            if (reader.count < 2 * HUFFMAN_TABLE_BITS) {
+                break;
+            }
+        }
+        const HuffmanEntry *entry = &table[reader.bits >> (64 - HUFFMAN_TABLE_BITS)];
+        while (reader.count >= HUFFMAN_TABLE_BITS && entry->kind == HUFFMAN_LEAF) {
+            memcpy(out + out_len, entry->symbol, 2);
+            out_len += entry->symbols;
+            reader.bits <<= entry->length;
+            reader.count -= entry->length;
+            entry = &table[reader.bits >> (64 - HUFFMAN_TABLE_BITS)];
+        }
+        if (reader.count < 2 * HUFFMAN_TABLE_BITS) {
+            continue;
+        }
+
+        // Длинный код: в буфере хватает бит на оба уровня
+        if (entry->kind == HUFFMAN_SUBTABLE) {
+            reader.bits <<= HUFFMAN_TABLE_BITS;
+            reader.count -= HUFFMAN_TABLE_BITS;
+            entry = &table[entry->index + (reader.bits >> (64 - entry->bits))];
+        }
+        if (entry->kind == HUFFMAN_INVALID) {
+            status = -1;
+            break;
+        }
+        reader.bits <<= entry->length;
+        reader.count -= entry->length;
+        if (entry->kind == HUFFMAN_LEAF) {
+            out[out_len++] = entry->symbol[0];
+            continue;
+        }
+        const HuffmanNode *node = decoder->nodes[entry->index];
+        while (node && (node->left || node->right)) {
+            if (reader.count == 0) {
+                reader = bit_reader_refill(reader);
+                if (reader.count == 0) {
+                    break;
+                }
+            }
+            node = (reader.bits >> 63) ? node->right : node->left;
+            reader.bits <<= 1;
+            reader.count -= 1;
+        }
+        if (!node) {
+            status = -1;
+            break;
+        }
+        if (node->left || node->right) {
+            reader.count = 0;  // вход кончился посреди кода
+            break;
+        }
+        out[out_len++] = (uint8_t)node->symbol;
+    }
 
-    // Кодирование данных
-    unsigned char buffer = 0;
-    int bit_count = 0;
-    while (fread(&ch, sizeof(char), 1, input) == 1) {
-        char *huffman_code = codes[(unsigned char)ch];
-        for (int i = 0; huffman_code[i]; i++) {
-            buffer <<= 1;
-            if (huffman_code[i] == '1') buffer |= 1;
-            bit_count++;
-            if (bit_count == 8) {
-                fwrite(&buffer, sizeof(char), 1, output);
-                buffer = 0;
-                bit_count = 0;
+    // Хвост
+    const HuffmanNode *node = decoder->root;
+    while (status == 0 && out_len < limit) {
+        if (reader.count == 0) {
+            reader = bit_reader_refill(reader);
+            if (reader.count == 0) {
+                break;
             }
         }
+        node = (reader.bits >> 63) ? node->right : node->left;
+        reader.bits <<= 1;
+        reader.count -= 1;
+        if (!node) {
+            status = -1;
+        } else if (!node->left && !node->right) {
+            out[out_len++] = (uint8_t)node->symbol;
+            node = decoder->root;
+        }
     }
-    if (bit_count > 0) {
-        buffer <<= (8 - bit_count);
-        fwrite(&buffer, sizeof(char), 1, output);
+    *state = reader;
+    *produced = out_len;
+    return status;
+}
+
+// Потоковый вариант для форматов без блоков: вход читается блоками,
+// выход пишется по HUFFMAN_IO_BLOCK
+static int huffman_decode_stream(const HuffmanDecoder *decoder, FILE *input, FILE *output,
+                                 uint64_t limit, uint64_t *produced) {
+    BitReader reader = {input, malloc(HUFFMAN_IO_BLOCK), 0, 0, 0, 0};
+    uint8_t *out = malloc(HUFFMAN_IO_BLOCK + 1);
+    int status = 0;
+    *produced = 0;
+    while (status == 0 && *produced < limit) {
+        size_t chunk = limit - *produced < HUFFMAN_IO_BLOCK ? limit - *produced : HUFFMAN_IO_BLOCK;
+        size_t got;
+        status = huffman_decode(decoder, &reader, out, chunk, &got);
+        fwrite(out, 1, got, output);
+        *produced += got;
+        if (got < chunk) {
+            break;
+        }
     }
+    free(out);
+    free(reader.data);
+    return status;
+}
 
-    fclose(input);
-    fclose(output);
+// Формат -p: HUFFMAN_BLOCK_MAGIC (le32) и размер блока (le32), затем
+// независимые блоки: байт типа, для кодированного - длины кодов 256 символов
+// по 4 бита и канонические коды от старшего бита к младшему (длина кода не
+// больше HUFFMAN_MAX_BITS), для хранимого - сами данные, для повтора - один
+// байт, которым заполнен весь блок, для LZ - см. lz_pack_block. За блоками
+// индекс: смещение (le64), сжатый и исходный размер (le32) каждого блока, и
+// хвост: смещение индекса (le64), число блоков (le32), HUFFMAN_BLOCK_MAGIC.
+//
+// Читаются и прежние форматы: потоковый канонический (HUFFMAN_MAGIC,
+// исходный размер le64, длины кодов, один поток бит) и самый старый - с
+// деревом в прямом обходе.
+#define HUFFMAN_MAGIC 0x31484F4F
+#define HUFFMAN_BLOCK_MAGIC 0x32484F4F
+#define HUFFMAN_MAX_BITS 15
+#define HUFFMAN_MAX_SYMBOLS 288
+#define HUFFMAN_HEADER_SIZE (4 + 8 + 128)
+#define HUFFMAN_BLOCK_SIZE (1024 * 1024)
+#define HUFFMAN_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define HUFFMAN_BLOCK_BOUND(size) (LZ_HEADER_SIZE + 2 * (size_t)(size) + 8)
+#define HUFFMAN_INDEX_ENTRY_SIZE 16
+#define HUFFMAN_TRAILER_SIZE 16
+
+enum { HUFFMAN_BLOCK_CODED, HUFFMAN_BLOCK_STORED, HUFFMAN_BLOCK_RUN, HUFFMAN_BLOCK_LZ, HUFFMAN_BLOCK_RANS };
 
-    printf("Файл успешно сжат: %s -> %s\n", input_file, output_file);
+typedef struct {
+    uint64_t offset;
+    uint32_t packed_size;
+    uint32_t raw_size;
+} HuffmanBlockIndex;
+
+// Частоты байтов: четыре гистограммы, чтобы соседние одинаковые байты не
+// ждали друг друга на инкременте одного счетчика
+static void huffman_count(const uint8_t *data, size_t length, uint64_t *frequencies) {
+    uint32_t counts[4][256] = {{0}};
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        counts[0][data[i]]++;
+        counts[1][data[i + 1]]++;
+        counts[2][data[i + 2]]++;
+        counts[3][data[i + 3]]++;
+    }
+    for (; i < length; i++) {
+        counts[0][data[i]]++;
+    }
+    for (int s = 0; s < 256; s++) {
+        frequencies[s] += (uint64_t)counts[0][s] + counts[1][s] + counts[2][s] + counts[3][s];
+    }
 }
 
-// Распаковка файла
-void decompress_file(const char *input_file, const char *output_file) {
-    FILE *input = fopen(input_file, "rb");
-    if (!input) {
-        perror("Ошибка открытия входного файла");
-        exit(EXIT_FAILURE);
+// Длины кодов Хаффмана для алфавита из count_symbols символов (не больше
+// HUFFMAN_MAX_SYMBOLS), ограниченные max_bits. Символы без частоты получают
+// длину 0, единственный символ - длину 1.
+void huffman_code_lengths(const uint64_t *frequencies, int count_symbols, uint8_t *lengths, int max_bits) {
+    int symbols[HUFFMAN_MAX_SYMBOLS], n = 0;
+    memset(lengths, 0, count_symbols);
+    for (int s = 0; s < count_symbols; s++) {
+        if (frequencies[s] > 0) {
+            // Вставкой держим символы по возрастанию частоты
+            int i = n++;
+            while (i > 0 && frequencies[symbols[i - 1]] > frequencies[s]) {
+                symbols[i] = symbols[i - 1];
+                i--;
+            }
+            symbols[i] = s;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    if (n == 1) {
+        lengths[symbols[0]] = 1;
+        return;
     }
 
-    // Десериализация дерева Хаффмана
-    HuffmanNode *root = deserialize_tree(input);
-    if (!root) {
-        perror("Ошибка десериализации дерева Хаффмана");
-        fclose(input);
-        exit(EXIT_FAILURE);
+    // Две очереди: листья по возрастанию частоты и внутренние узлы в порядке
+    // создания (их веса тоже не убывают), поэтому куча не нужна
+    uint64_t weight[2 * HUFFMAN_MAX_SYMBOLS];
+    int parent[2 * HUFFMAN_MAX_SYMBOLS], depth[2 * HUFFMAN_MAX_SYMBOLS];
+    for (int i = 0; i < n; i++) {
+        weight[i] = frequencies[symbols[i]];
+    }
+    int leaf = 0, node = n;
+    for (int next = n; next < 2 * n - 1; next++) {
+        int pick[2];
+        for (int k = 0; k < 2; k++) {
+            pick[k] = (leaf < n && (node >= next || weight[leaf] <= weight[node])) ? leaf++ : node++;
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = next;
+    }
+    depth[2 * n - 2] = 0;
+    for (int i = 2 * n - 3; i >= 0; i--) {
+        depth[i] = depth[parent[i]] + 1;
     }
 
-    // Открытие выходного файла
-    if (access(output_file, F_OK) == 0) {
-        printf("Файл %s уже существует. Перезаписать? [y/N] ", input_file);
-        int c = getchar();
-        // Очищаем буфер ввода
-        while (getchar() != '\n');
-        if (c != 'y' && c != 'Y') {
-            return; // Пропускаем файл, если пользователь не хочет перезаписывать
+    // Длинные коды прижимаем к max_bits и восстанавливаем неравенство Крафта,
+    // расщепляя самый длинный из более коротких кодов
+    int count[HUFFMAN_MAX_BITS + 2] = {0};
+    for (int i = 0; i < n; i++) {
+        count[depth[i] < max_bits ? depth[i] : max_bits]++;
+    }
+    uint32_t kraft = 0;
+    for (int length = 1; length <= max_bits; length++) {
+        kraft += (uint32_t)count[length] << (max_bits - length);
+    }
+    while (kraft > 1u << max_bits) {
+        count[max_bits]--;
+        for (int length = max_bits - 1; length > 0; length--) {
+            if (count[length] > 0) {
+                count[length]--;
+                count[length + 1] += 2;
+                break;
+            }
         }
+        kraft--;
     }
 
-    
-    FILE *output = fopen(output_file, "wb");
-    if (!output) {
-        perror("Ошибка создания выходного файла");
-        fclose(input);
-        exit(EXIT_FAILURE);
+    // Самые редкие символы получают самые длинные коды
+    int i = 0;
+    for (int length = max_bits; length > 0; length--) {
+        for (int k = 0; k < count[length]; k++) {
+            lengths[symbols[i++]] = length;
+        }
     }
+}
 
-    // Декодирование данных
-    HuffmanNode *current = root;
-    unsigned char buffer;
-    int bit_count = 0;
-    while (fread(&buffer, sizeof(char), 1, input) == 1) {
-        for (int i = 7; i >= 0; i--) {
-            int bit = (buffer >> i) & 1;
-            if (bit == 0) {
-                current = current->left;
-            } else {
-                current = current->right;
-            }
-            if (current->left == NULL && current->right == NULL) {
-                fputc(current->symbol, output);
-                current = root;
+// Канонические коды алфавита из count_symbols символов: внутри одной длины -
+// по возрастанию символа. Возвращает -1, если длины нарушают неравенство Крафта.
+int huffman_canonical_codes(const uint8_t *lengths, int count_symbols, uint16_t *codes) {
+    int count[HUFFMAN_MAX_BITS + 1] = {0};
+    for (int s = 0; s < count_symbols; s++) {
+        if (lengths[s] > HUFFMAN_MAX_BITS) {
+            return -1;
+        }
+        count[lengths[s]]++;
+    }
+    uint32_t kraft = 0;
+    for (int length = 1; length <= HUFFMAN_MAX_BITS; length++) {
+        kraft += (uint32_t)count[length] << (HUFFMAN_MAX_BITS - length);
+    }
+    if (kraft > 1u << HUFFMAN_MAX_BITS) {
+        return -1;
+    }
+    uint32_t next[HUFFMAN_MAX_BITS + 1], code = 0;
+    count[0] = 0;
+    for (int length = 1; length <= HUFFMAN_MAX_BITS; length++) {
+        code = (code + count[length - 1]) << 1;
+        next[length] = code;
+    }
+    for (int s = 0; s < count_symbols; s++) {
+        codes[s] = lengths[s] ? next[lengths[s]]++ : 0;
+    }
+    return 0;
+}
+
+// Дерево канонического кода: по нему строятся таблицы декодера
+static HuffmanNode *huffman_tree_from_lengths(const uint8_t *lengths, const uint16_t *codes) {
+    HuffmanNode *root = create_node(0, 0);
+    for (int s = 0; s < 256; s++) {
+        HuffmanNode *node = root;
+        for (int bit = lengths[s] - 1; bit >= 0; bit--) {
+            HuffmanNode **child = ((codes[s] >> bit) & 1) ? &node->right : &node->left;
+            if (!*child) {
+                *child = create_node(bit == 0 ? (char)s : 0, 0);
             }
+            node = *child;
         }
     }
+    return root;
+}
 
-    fclose(input);
-    fclose(output);
+// Писатель битов от старшего к младшему: в bits копятся младшие count бит,
+// наружу уходят по 32 бита
+typedef struct {
+    uint64_t bits;
+    int count;
+    uint8_t *out;
+    size_t length;
+} BitWriter;
+
+static inline void bit_writer_put(BitWriter *writer, uint32_t code, int length) {
+    writer->bits = (writer->bits << length) | code;
+    writer->count += length;
+}
 
-    printf("Файл успешно распакован: %s -> %s\n", input_file, output_file);
+static inline void bit_writer_flush32(BitWriter *writer) {
+    if (writer->count >= 32) {
+        writer->count -= 32;
+        store_be32(writer->out + writer->length, (uint32_t)(writer->bits >> writer->count));
+        writer->length += 4;
+    }
+}
+
+// Дописывает неполные байты, последний дополняется нулями
+static void bit_writer_finish(BitWriter *writer) {
+    while (writer->count > 0) {
+        int take = writer->count < 8 ? writer->count : 8;
+        writer->out[writer->length++] = (uint8_t)((writer->bits >> (writer->count - take)) << (8 - take));
+        writer->count -= take;
+    }
+}
+
+// Кодирует блок; в out должно быть место на 2 байта на входной байт.
+// Два кода по HUFFMAN_MAX_BITS на шаг, в аккумуляторе остается меньше 32 бит.
+static void huffman_encode_block(BitWriter *writer, const uint8_t *data, size_t length,
+                                 const uint8_t *lengths, const uint16_t *codes) {
+    size_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        bit_writer_put(writer, codes[data[i]], lengths[data[i]]);
+        bit_writer_put(writer, codes[data[i + 1]], lengths[data[i + 1]]);
+        bit_writer_flush32(writer);
+    }
+    if (i < length) {
+        bit_writer_put(writer, codes[data[i]], lengths[data[i]]);
+        bit_writer_flush32(writer);
+    }
 }
 
+// Длины кодов упакованы по 4 бита, четный символ - в младшем полубайте.
+// Возвращает число символов с ненулевой длиной.
+static int huffman_read_lengths(const uint8_t *packed, uint8_t *lengths) {
+    int symbols = 0;
+    for (int s = 0; s < 256; s += 2) {
+        lengths[s] = packed[s / 2] & 0x0F;
+        lengths[s + 1] = packed[s / 2] >> 4;
+        symbols += (lengths[s] > 0) + (lengths[s + 1] > 0);
+    }
+    return symbols;
+}
 
+// LZ77 перед Хаффманом (блок HUFFMAN_BLOCK_LZ). Совпадения ищутся хеш-цепочками
+// по 4 байтам в окне до LZ_WINDOW внутри блока, результат - поток литералов и пар
+// (длина, расстояние), закодированный двумя каноническими кодами: литералы
+// с длинами (256 + LZ_LENGTH_SYMBOLS символов) и расстояния. Длина - 1 + (длина
+// совпадения - LZ_MIN_MATCH) и расстояние записываются корзиной и
+// дополнительными битами как в deflate: значения 1..4 - корзины 0..3, дальше
+// по две корзины на степень двойки. Блок: байт типа, длины кодов обоих
+// алфавитов по 4 бита, биты от старшего к младшему. Конца блока нет: сколько
+// байт распаковать, известно из размера блока.
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (65536 + LZ_MIN_MATCH - 1)
+#define LZ_WINDOW_BITS 20
+#define LZ_WINDOW (1 << LZ_WINDOW_BITS)
+#define LZ_HASH_BITS 16
+#define LZ_LENGTH_SYMBOLS 32
+#define LZ_LITLEN_SYMBOLS (256 + LZ_LENGTH_SYMBOLS)
+#define LZ_DIST_SYMBOLS (2 * LZ_WINDOW_BITS)
+#define LZ_HEADER_SIZE (1 + (LZ_LITLEN_SYMBOLS + LZ_DIST_SYMBOLS) / 2)
+#define LZ_MAX_LEVEL 9
+#define LZ_DEFAULT_LEVEL 6
+
+// Параметры уровня (как в zlib): сколько кандидатов смотреть в цепочке;
+// при совпадении не короче good ленивый поиск смотрит вчетверо меньше;
+// ленивый разбор - только для совпадений короче lazy (0 - жадный разбор);
+// совпадение не короче nice принимается сразу; позиции внутри совпадения
+// длиннее insert не добавляются в хеш; окно - 2^window_bits байт. Большое
+// окно находит дальние повторы, но длинные цепочки в нем дороги.
 typedef struct {
-    uint32_t crc;
-    off_t offset;
-    off_t size;
-} FileCopyMeta;
+    int window_bits;
+    int chain;
+    int good;
+    int lazy;
+    int nice;
+    int insert;
+} LzLevel;
+
+static const LzLevel lz_levels[LZ_MAX_LEVEL + 1] = {
+    {0, 0, 0, 0, 0, 0},  // 0 - только Хаффман, без LZ
+    {16, 4, 4, 0, 16, 16},
+    {16, 8, 4, 0, 32, 32},
+    {16, 16, 8, 0, 32, 32},
+    {16, 16, 4, 4, 16, LZ_MAX_MATCH},
+    {17, 32, 8, 16, 32, LZ_MAX_MATCH},
+    {18, 128, 8, 16, 128, LZ_MAX_MATCH},
+    {18, 256, 8, 32, 128, LZ_MAX_MATCH},
+    {20, 512, 32, 128, 258, LZ_MAX_MATCH},
+    {20, 1024, 32, 258, 1024, LZ_MAX_MATCH},
+};
+
+static inline int lz_bucket(uint32_t value) {
+    if (value <= 4) {
+        return value - 1;
+    }
+    uint32_t x = value - 1;
+    int n = 31 - __builtin_clz(x);
+    return 2 * n + ((x >> (n - 1)) & 1);
+}
+
+static inline int lz_bucket_extra(int bucket) {
+    return bucket < 4 ? 0 : bucket / 2 - 1;
+}
+
+static inline uint32_t lz_bucket_base(int bucket) {
+    return bucket < 4 ? (uint32_t)(bucket + 1) : ((uint32_t)(2 | (bucket & 1)) << (bucket / 2 - 1)) + 1;
+}
 
 typedef struct {
-    char name[256];
-    mode_t mode;
-    uid_t uid;
-    gid_t gid;
-    time_t atime;
-    time_t mtime;
-    int copies;
-    FileCopyMeta *copy_meta;
-} FileMeta;
+    const uint8_t *data;
+    size_t length;
+    int32_t *head;   // последняя позиция с этим хешем или -1
+    int32_t *prev;   // предыдущая позиция с тем же хешем, по модулю окна
+    size_t inserted; // позиции до этой уже в хеше
+    size_t window;
+    uint32_t literal_cost; // средняя цена литерала, 1/16 бита
+    LzLevel level;
+} LzMatcher;
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
 
-static uint32_t crc32_table[256];
+// Добавляет в хеш позиции до end (последние LZ_MIN_MATCH - 1 байт не хешируются)
+static inline void lz_insert_until(LzMatcher *matcher, size_t end) {
+    size_t last = matcher->length >= LZ_MIN_MATCH ? matcher->length - LZ_MIN_MATCH + 1 : 0;
+    if (end > last) {
+        end = last;
+    }
+    for (size_t pos = matcher->inserted; pos < end; pos++) {
+        uint32_t hash = lz_hash(matcher->data + pos);
+        matcher->prev[pos & (matcher->window - 1)] = matcher->head[hash];
+        matcher->head[hash] = pos;
+    }
+    if (end > matcher->inserted) {
+        matcher->inserted = end;
+    }
+}
 
-// Инициализация таблицы CRC32
-void init_crc32_table() {
-    uint32_t polynomial = 0xEDB88320;
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t crc = i;
-        for (int j = 8; j > 0; j--) {
-            crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+static inline size_t lz_match_length(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t length = 0;
+    while (length + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return length + (__builtin_ctzll(x ^ y) >> 3);
+#else
+            return length + (__builtin_clzll(x ^ y) >> 3);
+#endif
         }
-        crc32_table[i] = crc;
+        length += 8;
     }
+    while (length < limit && a[length] == b[length]) {
+        length++;
+    }
+    return length;
 }
 
+// Совпадение должно быть дешевле литералов: пара стоит ~10 бит кодов плюс
+// дополнительные биты расстояния, литерал - literal_cost/16 бит (средняя
+// длина кода Хаффмана блока). Короткое совпадение далеко обычно дороже.
+static inline int lz_worth(const LzMatcher *matcher, size_t length, size_t distance) {
+    return length * matcher->literal_cost > (10 + (uint32_t)(31 - __builtin_clz((uint32_t)distance))) * 16;
+}
 
-uint32_t calculate_crc32_buffer(const void *data, size_t length) {
-    uint32_t crc = 0xFFFFFFFF;
-    const uint8_t *bytes = (const uint8_t *)data;
-    
-    for (size_t i = 0; i < length; i++) {
-        uint8_t table_index = (crc ^ bytes[i]) & 0xFF;
-        crc = (crc >> 8) ^ crc32_table[table_index];
+// Самое длинное выгодное совпадение для позиции pos (все позиции до нее уже
+// в хеше), в цепочке смотрится не больше chain кандидатов. Возвращает длину
+// (0 - не нашлось) и расстояние в distance.
+static size_t lz_find(const LzMatcher *matcher, size_t pos, int chain, uint32_t *distance) {
+    size_t limit = matcher->length - pos;
+    if (limit > LZ_MAX_MATCH) {
+        limit = LZ_MAX_MATCH;
     }
-    
-    return crc ^ 0xFFFFFFFF;
+    if (limit < LZ_MIN_MATCH) {
+        return 0;
+    }
+    const uint8_t *current = matcher->data + pos;
+    size_t best = LZ_MIN_MATCH - 1;
+    int32_t candidate = matcher->head[lz_hash(current)];
+    for (; candidate >= 0 && chain > 0; chain--) {
+        size_t gap = pos - candidate;
+        if (gap >= matcher->window) {
+            break;
+        }
+        const uint8_t *match = matcher->data + candidate;
+        if (match[best] == current[best]) {
+            size_t length = lz_match_length(current, match, limit);
+            if (length > best && lz_worth(matcher, length, gap)) {
+                best = length;
+                *distance = gap;
+                if (length >= (size_t)matcher->level.nice || length == limit) {
+                    break;
+                }
+            }
+        }
+        candidate = matcher->prev[candidate & (matcher->window - 1)];
+    }
+    return best >= LZ_MIN_MATCH ? best : 0;
 }
 
-// Расчет CRC32 для файла (потоковое чтение)
-uint32_t calculate_crc32_file(FILE *file) {
-    uint32_t crc = 0xFFFFFFFF;
-    uint8_t buffer[BUFFER_SIZE];
-    size_t bytes_read;
+// Кодирует блок в out (место на HUFFMAN_BLOCK_BOUND(length)); literal_cost -
+// средняя цена литерала в 1/16 бита. Возвращает размер.
+static size_t lz_pack_block(const uint8_t *data, size_t length, uint8_t *out, int level, uint32_t literal_cost) {
+    LzMatcher matcher = {data, length, malloc(sizeof(int32_t) << LZ_HASH_BITS), NULL, 0,
+                         (size_t)1 << lz_levels[level].window_bits, literal_cost, lz_levels[level]};
+    matcher.prev = malloc(sizeof(int32_t) * (length < matcher.window ? length + 1 : matcher.window));
+    memset(matcher.head, 0xFF, sizeof(int32_t) << LZ_HASH_BITS);
+
+    // Проход разбора: литерал - байт, совпадение - два слова: флаг с длиной
+    // и расстояние. Частоты символов копятся сразу.
+    uint32_t *tokens = malloc(sizeof(uint32_t) * (length + 1));
+    size_t token_count = 0;
+    uint64_t litlen_frequencies[LZ_LITLEN_SYMBOLS] = {0}, dist_frequencies[LZ_DIST_SYMBOLS] = {0};
+    size_t pos = 0;
+    while (pos < length) {
+        lz_insert_until(&matcher, pos);
+        uint32_t distance = 0;
+        size_t match = lz_find(&matcher, pos, matcher.level.chain, &distance);
+        // Ленивый разбор: если со следующей позиции совпадение длиннее,
+        // текущий байт уходит литералом
+        while (match > 0 && match < (size_t)matcher.level.lazy) {
+            lz_insert_until(&matcher, pos + 1);
+            uint32_t next_distance = 0;
+            int chain = match >= (size_t)matcher.level.good ? matcher.level.chain >> 2 : matcher.level.chain;
+            size_t next = lz_find(&matcher, pos + 1, chain, &next_distance);
+            if (next <= match) {
+                break;
+            }
+            tokens[token_count++] = data[pos];
+            litlen_frequencies[data[pos]]++;
+            pos++;
+            match = next;
+            distance = next_distance;
+        }
+        if (match == 0) {
+            tokens[token_count++] = data[pos];
+            litlen_frequencies[data[pos]]++;
+            pos++;
+            continue;
+        }
+        tokens[token_count++] = 0x80000000u | match;
+        tokens[token_count++] = distance;
+        litlen_frequencies[256 + lz_bucket(match - LZ_MIN_MATCH + 1)]++;
+        dist_frequencies[lz_bucket(distance)]++;
+        if (match > (size_t)matcher.level.insert) {
+            matcher.inserted = pos + match;
+        }
+        pos += match;
+    }
+    free(matcher.head);
+    free(matcher.prev);
+
+    uint8_t litlen_lengths[LZ_LITLEN_SYMBOLS], dist_lengths[LZ_DIST_SYMBOLS];
+    uint16_t litlen_codes[LZ_LITLEN_SYMBOLS], dist_codes[LZ_DIST_SYMBOLS];
+    huffman_code_lengths(litlen_frequencies, LZ_LITLEN_SYMBOLS, litlen_lengths, HUFFMAN_MAX_BITS);
+    huffman_code_lengths(dist_frequencies, LZ_DIST_SYMBOLS, dist_lengths, HUFFMAN_MAX_BITS);
+    huffman_canonical_codes(litlen_lengths, LZ_LITLEN_SYMBOLS, litlen_codes);
+    huffman_canonical_codes(dist_lengths, LZ_DIST_SYMBOLS, dist_codes);
+
+    out[0] = HUFFMAN_BLOCK_LZ;
+    for (int s = 0; s < LZ_LITLEN_SYMBOLS + LZ_DIST_SYMBOLS; s += 2) {
+        const uint8_t *lengths = s < LZ_LITLEN_SYMBOLS ? litlen_lengths + s : dist_lengths + s - LZ_LITLEN_SYMBOLS;
+        out[1 + s / 2] = lengths[0] | (lengths[1] << 4);
+    }
+    BitWriter writer = {0, 0, out + LZ_HEADER_SIZE, 0};
+    for (size_t t = 0; t < token_count; t++) {
+        uint32_t token = tokens[t];
+        if (token < 256) {
+            bit_writer_put(&writer, litlen_codes[token], litlen_lengths[token]);
+            bit_writer_flush32(&writer);
+            continue;
+        }
+        uint32_t value = (token & 0x7FFFFFFFu) - LZ_MIN_MATCH + 1;
+        int bucket = lz_bucket(value);
+        bit_writer_put(&writer, litlen_codes[256 + bucket], litlen_lengths[256 + bucket]);
+        bit_writer_flush32(&writer);
+        bit_writer_put(&writer, value - lz_bucket_base(bucket), lz_bucket_extra(bucket));
+        bit_writer_flush32(&writer);
+        value = tokens[++t];
+        bucket = lz_bucket(value);
+        bit_writer_put(&writer, dist_codes[bucket], dist_lengths[bucket]);
+        bit_writer_flush32(&writer);
+        bit_writer_put(&writer, value - lz_bucket_base(bucket), lz_bucket_extra(bucket));
+        bit_writer_flush32(&writer);
+    }
+    bit_writer_finish(&writer);
+    free(tokens);
+    return LZ_HEADER_SIZE + writer.length;
+}
 
-    fseek(file, 0, SEEK_SET);
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        crc = calculate_crc32_buffer(buffer, bytes_read);
+// Одноуровневая таблица канонического кода: индекс - следующие bits бит,
+// значение - символ << 4 | длина кода, 0 - такого кода нет
+static int lz_build_table(const uint8_t *lengths, int count, uint16_t *table, int *bits) {
+    uint16_t codes[HUFFMAN_MAX_SYMBOLS];
+    if (huffman_canonical_codes(lengths, count, codes) != 0) {
+        return -1;
     }
-    
-    return crc;
+    *bits = 1;
+    for (int s = 0; s < count; s++) {
+        if (lengths[s] > *bits) {
+            *bits = lengths[s];
+        }
+    }
+    memset(table, 0, sizeof(uint16_t) << *bits);
+    for (int s = 0; s < count; s++) {
+        if (lengths[s] > 0) {
+            int shift = *bits - lengths[s];
+            for (uint32_t i = 0; i < 1u << shift; i++) {
+                table[((uint32_t)codes[s] << shift) | i] = (s << 4) | lengths[s];
+            }
+        }
+    }
+    return 0;
+}
+
+// Символ по таблице; -1, если код неизвестен или вход кончился
+static inline int lz_decode_symbol(BitReader *reader, const uint16_t *table, int bits) {
+    uint16_t entry = table[reader->bits >> (64 - bits)];
+    int length = entry & 15;
+    if (length == 0 || length > reader->count) {
+        return -1;
+    }
+    reader->bits <<= length;
+    reader->count -= length;
+    return entry >> 4;
 }
 
+static inline int lz_read_bits(BitReader *reader, int count, uint32_t *value) {
+    if (count > reader->count) {
+        return -1;
+    }
+    *value = count ? (uint32_t)(reader->bits >> (64 - count)) : 0;
+    reader->bits <<= count;
+    reader->count -= count;
+    return 0;
+}
 
-// Глубокое копирование метаданных
-FileMeta copy_metadata(const FileMeta *src) {
-    FileMeta dst;
-    memcpy(&dst, src, sizeof(FileMeta));
-    dst.copy_meta = malloc(src->copies * sizeof(FileCopyMeta));
-    memcpy(dst.copy_meta, src->copy_meta, src->copies * sizeof(FileCopyMeta));
-    return dst;
+// Распаковывает блок HUFFMAN_BLOCK_LZ ровно в raw_size байт. 0 или -1.
+static int lz_unpack_block(uint8_t *data, size_t length, uint8_t *out, size_t raw_size) {
+    if (length < LZ_HEADER_SIZE) {
+        return -1;
+    }
+    uint8_t lengths[LZ_LITLEN_SYMBOLS + LZ_DIST_SYMBOLS];
+    for (int s = 0; s < LZ_LITLEN_SYMBOLS + LZ_DIST_SYMBOLS; s += 2) {
+        lengths[s] = data[1 + s / 2] & 0x0F;
+        lengths[s + 1] = data[1 + s / 2] >> 4;
+    }
+    uint16_t *litlen_table = malloc(sizeof(uint16_t) << HUFFMAN_MAX_BITS);
+    uint16_t *dist_table = malloc(sizeof(uint16_t) << HUFFMAN_MAX_BITS);
+    int litlen_bits, dist_bits;
+    int status = lz_build_table(lengths, LZ_LITLEN_SYMBOLS, litlen_table, &litlen_bits) == 0 &&
+                 lz_build_table(lengths + LZ_LITLEN_SYMBOLS, LZ_DIST_SYMBOLS, dist_table, &dist_bits) == 0
+                     ? 0 : -1;
+
+    BitReader reader = {NULL, data + LZ_HEADER_SIZE, 0, length - LZ_HEADER_SIZE, 0, 0};
+    size_t produced = 0;
+    while (status == 0 && produced < raw_size) {
+        // Самый длинный шаг - код длины, ее биты, код расстояния и его биты,
+        // до 63 бит: буфер дополняется перед длиной и перед расстоянием
+        if (reader.count < 32) {
+            reader = bit_reader_refill(reader);
+        }
+        int symbol = lz_decode_symbol(&reader, litlen_table, litlen_bits);
+        if (symbol < 256) {
+            if (symbol < 0) {
+                status = -1;
+                break;
+            }
+            out[produced++] = symbol;
+            continue;
+        }
+        uint32_t extra, distance_extra;
+        int bucket = symbol - 256;
+        if (lz_read_bits(&reader, lz_bucket_extra(bucket), &extra) != 0) {
+            status = -1;
+            break;
+        }
+        size_t match = lz_bucket_base(bucket) + extra + LZ_MIN_MATCH - 1;
+        if (reader.count < 33) {
+            reader = bit_reader_refill(reader);
+        }
+        int dist_bucket = lz_decode_symbol(&reader, dist_table, dist_bits);
+        if (dist_bucket < 0 || lz_read_bits(&reader, lz_bucket_extra(dist_bucket), &distance_extra) != 0) {
+            status = -1;
+            break;
+        }
+        size_t distance = lz_bucket_base(dist_bucket) + distance_extra;
+        if (distance > produced || match > raw_size - produced) {
+            status = -1;
+            break;
+        }
+        // Перекрывающееся совпадение копируется кусками, каждый следующий
+        // кусок вдвое длиннее: скопированное продолжает период
+        uint8_t *target = out + produced;
+        const uint8_t *source = target - distance;
+        size_t left = match;
+        while (left > 0) {
+            size_t chunk = (size_t)(target - source) < left ? (size_t)(target - source) : left;
+            memcpy(target, source, chunk);
+            target += chunk;
+            left -= chunk;
+        }
+        produced += match;
+    }
+    free(litlen_table);
+    free(dist_table);
+    return status;
 }
 
-// Освобождение памяти метаданных
-void free_metadata(FileMeta *meta, int count) {
-    for (int i = 0; i < count; i++) {
-        if (meta[i].copy_meta) {
-            free(meta[i].copy_meta);
+// rANS (блок HUFFMAN_BLOCK_RANS) - арифметическое кодирование байтов блока
+// с частотами, нормированными к 2^RANS_SCALE_BITS. RANS_STATES состояний
+// кодируют символы по очереди (символ i - состоянием i % RANS_STATES), так что
+// при распаковке их цепочки зависимостей идут параллельно. Состояние - 32
+// бита, нормализация - по 16 бит. Блок: байт типа, битовая карта символов
+// (32 байта), нормированная частота - 1 каждого символа из карты (байт до 127,
+// иначе два: 0x80 | старшие биты и младший байт), конечные состояния
+// кодировщика (le32), слова (le16) в порядке чтения.
+#define RANS_SCALE_BITS 12
+#define RANS_SCALE (1u << RANS_SCALE_BITS)
+#define RANS_L (1u << 16)
+#define RANS_STATES 4
+
+enum { ENTROPY_HUFFMAN, ENTROPY_RANS };
+
+// Нормирует частоты к сумме RANS_SCALE, у каждого встреченного символа
+// частота не меньше 1
+static void rans_normalize(const uint64_t *frequencies, uint64_t total, uint32_t *normalized) {
+    uint32_t sum = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; s++) {
+        normalized[s] = 0;
+        if (frequencies[s] > 0) {
+            normalized[s] = frequencies[s] * RANS_SCALE / total;
+            if (normalized[s] == 0) {
+                normalized[s] = 1;
+            }
+            sum += normalized[s];
+        }
+        if (frequencies[s] > frequencies[largest]) {
+            largest = s;
+        }
+    }
+    // Остаток округления достается самому частому символу; если символов
+    // с частотой 1 так много, что сумма перевалила, отнимаем у самых больших
+    if (sum <= RANS_SCALE) {
+        normalized[largest] += RANS_SCALE - sum;
+        return;
+    }
+    while (sum > RANS_SCALE) {
+        int s = 0;
+        for (int t = 1; t < 256; t++) {
+            if (normalized[t] > normalized[s]) {
+                s = t;
+            }
+        }
+        uint32_t take = sum - RANS_SCALE < normalized[s] - 1 ? sum - RANS_SCALE : normalized[s] - 1;
+        normalized[s] -= take;
+        sum -= take;
+    }
+}
+
+// Кодирует блок в out, если он выходит меньше limit байт (в out есть место
+// на limit). Возвращает размер или 0.
+static size_t rans_pack_block(const uint8_t *data, size_t length, const uint64_t *frequencies, uint8_t *out,
+                              size_t limit) {
+    uint32_t normalized[256], start[256], cumulative = 0;
+    rans_normalize(frequencies, length, normalized);
+    size_t header = 1 + 32;
+    for (int s = 0; s < 256; s++) {
+        start[s] = cumulative;
+        cumulative += normalized[s];
+        header += normalized[s] == 0 ? 0 : normalized[s] - 1 < 0x80 ? 1 : 2;
+    }
+    header += 4 * RANS_STATES;
+    if (header >= limit) {
+        return 0;
+    }
+
+    // Слова пишутся с конца буфера к началу: кодирование идет от последнего
+    // символа к первому, распаковка читает их в обратном порядке
+    size_t capacity = 2 * length + 2;
+    uint8_t *words = malloc(capacity);
+    size_t position = capacity;
+    uint32_t state[RANS_STATES];
+    for (int k = 0; k < RANS_STATES; k++) {
+        state[k] = RANS_L;
+    }
+    for (size_t i = length; i-- > 0;) {
+        uint32_t *x = &state[i % RANS_STATES];
+        uint32_t frequency = normalized[data[i]];
+        uint32_t x_max = ((RANS_L >> RANS_SCALE_BITS) << 16) * frequency;
+        if (*x >= x_max) {
+            position -= 2;
+            words[position] = (uint8_t)*x;
+            words[position + 1] = (uint8_t)(*x >> 8);
+            *x >>= 16;
+        }
+        *x = ((*x / frequency) << RANS_SCALE_BITS) + (*x % frequency) + start[data[i]];
+    }
+    size_t size = header + (capacity - position);
+    if (size >= limit) {
+        free(words);
+        return 0;
+    }
+
+    out[0] = HUFFMAN_BLOCK_RANS;
+    memset(out + 1, 0, 32);
+    uint8_t *p = out + 33;
+    for (int s = 0; s < 256; s++) {
+        if (normalized[s] == 0) {
+            continue;
+        }
+        out[1 + s / 8] |= 1 << (s % 8);
+        uint32_t value = normalized[s] - 1;
+        if (value < 0x80) {
+            *p++ = value;
+        } else {
+            *p++ = 0x80 | (value >> 8);
+            *p++ = (uint8_t)value;
+        }
+    }
+    for (int k = 0; k < RANS_STATES; k++) {
+        store_le32(p, state[k]);
+        p += 4;
+    }
+    memcpy(p, words + position, capacity - position);
+    free(words);
+    return size;
+}
+
+// Распаковывает блок HUFFMAN_BLOCK_RANS ровно в raw_size байт. 0 или -1.
+static int rans_unpack_block(const uint8_t *data, size_t length, uint8_t *out, size_t raw_size) {
+    if (length < 33) {
+        return -1;
+    }
+    // Слот (младшие RANS_SCALE_BITS бит состояния) -> символ, частота - 1 и
+    // смещение слота от начала символа: по 8 и 12 бит в одном слове
+    uint32_t *slots = malloc(RANS_SCALE * sizeof(uint32_t));
+    const uint8_t *p = data + 33, *end = data + length;
+    uint32_t cumulative = 0;
+    int status = 0;
+    for (int s = 0; s < 256 && status == 0; s++) {
+        if (!(data[1 + s / 8] & (1 << (s % 8)))) {
+            continue;
+        }
+        if (p >= end || ((*p & 0x80) && p + 1 >= end)) {
+            status = -1;
+            break;
+        }
+        uint32_t frequency = (*p & 0x80) ? (((uint32_t)(p[0] & 0x7F) << 8) | p[1]) + 1 : (uint32_t)p[0] + 1;
+        p += (*p & 0x80) ? 2 : 1;
+        if (frequency > RANS_SCALE - cumulative) {
+            status = -1;
+            break;
+        }
+        for (uint32_t k = 0; k < frequency; k++) {
+            slots[cumulative + k] = s | ((frequency - 1) << 8) | (k << 20);
+        }
+        cumulative += frequency;
+    }
+    if (status != 0 || cumulative != RANS_SCALE || (size_t)(end - p) < 4 * RANS_STATES) {
+        free(slots);
+        return -1;
+    }
+    uint32_t state[RANS_STATES];
+    for (int k = 0; k < RANS_STATES; k++) {
+        state[k] = load_le32(p);
+        p += 4;
+        if (state[k] < RANS_L) {
+            status = -1;
+        }
+    }
+
+    // Основной цикл - по RANS_STATES символов, пока слов заведомо хватает
+    // на всю группу; хвост и конец входа - с проверкой каждого слова
+    size_t i = 0;
+    while (status == 0 && i + RANS_STATES <= raw_size && end - p >= 2 * RANS_STATES) {
+        for (int k = 0; k < RANS_STATES; k++) {
+            uint32_t x = state[k];
+            uint32_t slot = slots[x & (RANS_SCALE - 1)];
+            out[i + k] = (uint8_t)slot;
+            x = (((slot >> 8) & 0xFFF) + 1) * (x >> RANS_SCALE_BITS) + (slot >> 20);
+            if (x < RANS_L) {
+                x = (x << 16) | p[0] | ((uint32_t)p[1] << 8);
+                p += 2;
+            }
+            state[k] = x;
+        }
+        i += RANS_STATES;
+    }
+    for (; status == 0 && i < raw_size; i++) {
+        uint32_t *x = &state[i % RANS_STATES];
+        uint32_t slot = slots[*x & (RANS_SCALE - 1)];
+        out[i] = (uint8_t)slot;
+        *x = (((slot >> 8) & 0xFFF) + 1) * (*x >> RANS_SCALE_BITS) + (slot >> 20);
+        if (*x < RANS_L) {
+            if (end - p < 2) {
+                status = -1;
+                break;
+            }
+            *x = (*x << 16) | p[0] | ((uint32_t)p[1] << 8);
+            p += 2;
+        }
+    }
+    // Распаковка возвращает состояния к начальным и съедает все слова
+    for (int k = 0; k < RANS_STATES && status == 0; k++) {
+        if (state[k] != RANS_L) {
+            status = -1;
+        }
+    }
+    if (p != end) {
+        status = -1;
+    }
+    free(slots);
+    return status;
+}
+
+// Кодирует блок в out: на уровне 0 - байт типа, длины кодов и биты (или блок
+// rANS при entropy == ENTROPY_RANS), на уровнях 1..LZ_MAX_LEVEL - блок LZ, если
+// он меньше. Блок, который не сжимается, хранится как есть, блок из одного
+// повторяющегося байта - два байта. В out нужно HUFFMAN_BLOCK_BOUND(length) байт.
+static size_t huffman_pack_block(const uint8_t *data, size_t length, uint8_t *out, int level, int entropy) {
+    uint64_t frequencies[256] = {0};
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    huffman_count(data, length, frequencies);
+    if (length > 0 && frequencies[data[0]] == length) {
+        out[0] = HUFFMAN_BLOCK_RUN;
+        out[1] = data[0];
+        return 2;
+    }
+    huffman_code_lengths(frequencies, 256, lengths, HUFFMAN_MAX_BITS);
+
+    // LZ остается, если он не длиннее блока одного Хаффмана: размер того
+    // известен заранее по частотам, средняя цена литерала - тоже. Блок rANS
+    // кодируется сразу, тогда LZ пишется в отдельный буфер и сравнивается с ним
+    uint64_t bits = 0;
+    for (int s = 0; s < 256; s++) {
+        bits += frequencies[s] * lengths[s];
+    }
+    size_t coded = 129 + (bits + 7) / 8, ranged = 0;
+    if (entropy == ENTROPY_RANS) {
+        ranged = rans_pack_block(data, length, frequencies, out, 1 + length);
+        coded = ranged > 0 ? ranged : 1 + length;
+    }
+    if (level > 0) {
+        uint8_t *target = ranged > 0 ? malloc(HUFFMAN_BLOCK_BOUND(length)) : out;
+        size_t packed = lz_pack_block(data, length, target, level, (uint32_t)(bits * 16 / length));
+        int keep = packed <= coded && packed < 1 + length;
+        if (target != out) {
+            if (keep) {
+                memcpy(out, target, packed);
+            }
+            free(target);
+        }
+        if (keep) {
+            return packed;
+        }
+    }
+    if (ranged > 0) {
+        return ranged;
+    }
+    if (entropy == ENTROPY_RANS) {
+        out[0] = HUFFMAN_BLOCK_STORED;
+        memcpy(out + 1, data, length);
+        return 1 + length;
+    }
+    huffman_canonical_codes(lengths, 256, codes);
+
+    out[0] = HUFFMAN_BLOCK_CODED;
+    for (int s = 0; s < 256; s += 2) {
+        out[1 + s / 2] = lengths[s] | (lengths[s + 1] << 4);
+    }
+    BitWriter writer = {0, 0, out + 129, 0};
+    huffman_encode_block(&writer, data, length, lengths, codes);
+    bit_writer_finish(&writer);
+    if (129 + writer.length < 1 + length) {
+        return 129 + writer.length;
+    }
+    out[0] = HUFFMAN_BLOCK_STORED;
+    memcpy(out + 1, data, length);
+    return 1 + length;
+}
+
+// Распаковывает блок ровно в raw_size байт (в out место на raw_size + 1).
+// Возвращает 0 или -1 на поврежденном блоке.
+static int huffman_unpack_block(uint8_t *data, size_t length, uint8_t *out, size_t raw_size) {
+    if (length >= 1 && data[0] == HUFFMAN_BLOCK_STORED) {
+        if (length - 1 != raw_size) {
+            return -1;
+        }
+        memcpy(out, data + 1, raw_size);
+        return 0;
+    }
+    if (length == 2 && data[0] == HUFFMAN_BLOCK_RUN) {
+        memset(out, data[1], raw_size);
+        return 0;
+    }
+    if (length >= 1 && data[0] == HUFFMAN_BLOCK_LZ) {
+        return lz_unpack_block(data, length, out, raw_size);
+    }
+    if (length >= 1 && data[0] == HUFFMAN_BLOCK_RANS) {
+        return rans_unpack_block(data, length, out, raw_size);
+    }
+    uint8_t lengths[256];
+    uint16_t codes[256];
+    if (length < 129 || data[0] != HUFFMAN_BLOCK_CODED || huffman_read_lengths(data + 1, lengths) == 0 ||
+        huffman_canonical_codes(lengths, 256, codes) != 0) {
+        return -1;
+    }
+    HuffmanNode *root = huffman_tree_from_lengths(lengths, codes);
+    HuffmanDecoder decoder;
+    build_huffman_decoder(&decoder, root);
+    BitReader reader = {NULL, data + 129, 0, length - 129, 0, 0};
+    size_t produced;
+    int status = huffman_decode(&decoder, &reader, out, raw_size, &produced);
+    free_huffman_decoder(&decoder);
+    free_huffman_tree(root);
+    return status == 0 && produced == raw_size ? 0 : -1;
+}
+
+// Слот конвейера: блок на входе и результат его обработки
+typedef struct {
+    long block;        // номер блока в слоте, -1 - слот свободен
+    int ready;
+    int status;
+    uint8_t *in, *out;
+    size_t in_length, out_length;
+} CodecSlot;
+
+// Общее состояние блочного сжатия и распаковки. Потоки берут блоки по
+// порядку в свободные слоты (слот = номер блока по модулю их числа), главный
+// поток отдает готовые слоты в том же порядке и освобождает их, поэтому в
+// памяти не больше slot_count блоков.
+typedef struct {
+    int unpack;
+    int level;                        // упаковка: уровень huffman_pack_block
+    int entropy;                      // упаковка: ENTROPY_HUFFMAN или ENTROPY_RANS
+    FILE *input;                      // упаковка: вход читается под замком по порядку
+    int fd;                           // распаковка: блоки читаются pread
+    const HuffmanBlockIndex *index;
+    size_t block_size;
+    long next_block;
+    long end_block;                   // упаковка: LONG_MAX, пока вход не кончился
+    int slot_count;
+    CodecSlot *slots;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} CodecJob;
+
+static void *codec_worker(void *arg) {
+    CodecJob *job = (CodecJob *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        long b;
+        CodecSlot *slot;
+        for (;;) {
+            b = job->next_block;
+            if (b >= job->end_block) {
+                pthread_mutex_unlock(&job->lock);
+                return NULL;
+            }
+            slot = &job->slots[b % job->slot_count];
+            if (slot->block < 0) {
+                break;
+            }
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        job->next_block++;
+        slot->block = b;
+        slot->ready = 0;
+        if (!job->unpack) {
+            slot->in_length = fread(slot->in, 1, job->block_size, job->input);
+            if (slot->in_length == 0) {
+                job->end_block = b;
+                slot->block = -1;
+                pthread_cond_broadcast(&job->changed);
+                pthread_mutex_unlock(&job->lock);
+                return NULL;
+            }
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        if (job->unpack) {
+            const HuffmanBlockIndex *entry = &job->index[b];
+            slot->in_length = entry->packed_size;
+            slot->out_length = entry->raw_size;
+            slot->status = pread(job->fd, slot->in, entry->packed_size, entry->offset) == (ssize_t)entry->packed_size
+                               ? huffman_unpack_block(slot->in, slot->in_length, slot->out, slot->out_length)
+                               : -1;
+        } else {
+            slot->out_length = huffman_pack_block(slot->in, slot->in_length, slot->out, job->level,
+                                                  job->entropy);
+            slot->status = 0;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        slot->ready = 1;
+        pthread_cond_broadcast(&job->changed);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+static void codec_job_start(CodecJob *job, int workers, pthread_t *threads) {
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    job->slot_count = 2 * workers;
+    job->slots = calloc(job->slot_count, sizeof(CodecSlot));
+    for (int i = 0; i < job->slot_count; i++) {
+        job->slots[i].block = -1;
+        job->slots[i].in = malloc(HUFFMAN_BLOCK_BOUND(job->block_size));
+        job->slots[i].out = malloc(HUFFMAN_BLOCK_BOUND(job->block_size));
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->changed, NULL);
+    for (int w = 0; w < workers; w++) {
+        pthread_create(&threads[w], NULL, codec_worker, job);
+    }
+}
+
+// Ждет готовности блока b; NULL - блоков больше нет
+static CodecSlot *codec_job_wait(CodecJob *job, long b) {
+    CodecSlot *slot = &job->slots[b % job->slot_count];
+    pthread_mutex_lock(&job->lock);
+    while (b < job->end_block && !(slot->block == b && slot->ready)) {
+        pthread_cond_wait(&job->changed, &job->lock);
+    }
+    if (!(slot->block == b && slot->ready)) {
+        slot = NULL;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return slot;
+}
+
+static void codec_job_release(CodecJob *job, CodecSlot *slot) {
+    pthread_mutex_lock(&job->lock);
+    slot->block = -1;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Останавливает раздачу новых блоков и дожидается потоков
+static void codec_job_finish(CodecJob *job, int workers, pthread_t *threads) {
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    pthread_mutex_lock(&job->lock);
+    if (job->end_block > job->next_block) {
+        job->end_block = job->next_block;
+    }
+    // Слоты, которые никто не заберет, освобождаем, чтобы потоки не ждали
+    for (int i = 0; i < job->slot_count; i++) {
+        job->slots[i].block = -1;
+    }
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+    for (int w = 0; w < workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    for (int i = 0; i < job->slot_count; i++) {
+        free(job->slots[i].in);
+        free(job->slots[i].out);
+    }
+    free(job->slots);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->changed);
+}
+
+// Сжатие файла: независимые блоки по HUFFMAN_BLOCK_SIZE на пуле потоков
+void compress_file(const char *input_file, const char *output_file, int workers, int level, int entropy) {
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        perror("Ошибка открытия входного файла");
+        exit(EXIT_FAILURE);
+    }
+
+    // Запись сжатых данных
+    if (access(output_file, F_OK) == 0) {
+        printf("Файл %s уже существует. Перезаписать? [y/N] ", output_file);
+        int c = getchar();
+        // Очищаем буфер ввода (до конца строки или EOF)
+        for (int ch = c; ch != '\n' && ch != EOF; ch = getchar());
+        if (c != 'y' && c != 'Y') {
+            return; // Пропускаем файл, если пользователь не хочет перезаписывать
+        }
+    }
+    FILE *output = fopen(output_file, "wb");
+    if (!output) {
+        perror("Ошибка создания выходного файла");
+        fclose(input);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t header[8];
+    store_le32(header, HUFFMAN_BLOCK_MAGIC);
+    store_le32(header + 4, HUFFMAN_BLOCK_SIZE);
+    fwrite(header, 1, sizeof(header), output);
+
+    // Блоки пишутся по порядку по мере готовности, индекс копится в памяти
+    CodecJob job = {0};
+    job.input = input;
+    job.level = level;
+    job.entropy = entropy;
+    job.block_size = HUFFMAN_BLOCK_SIZE;
+    job.end_block = LONG_MAX;
+    pthread_t threads[MAX_WORKERS];
+    codec_job_start(&job, workers, threads);
+    HuffmanBlockIndex *index = NULL;
+    long block_count = 0, capacity = 0;
+    uint64_t offset = sizeof(header), original_size = 0;
+    CodecSlot *slot;
+    while ((slot = codec_job_wait(&job, block_count)) != NULL) {
+        if (block_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            index = realloc(index, capacity * sizeof(HuffmanBlockIndex));
+        }
+        index[block_count].offset = offset;
+        index[block_count].packed_size = slot->out_length;
+        index[block_count].raw_size = slot->in_length;
+        fwrite(slot->out, 1, slot->out_length, output);
+        offset += slot->out_length;
+        original_size += slot->in_length;
+        block_count++;
+        codec_job_release(&job, slot);
+    }
+    codec_job_finish(&job, workers, threads);
+
+    // Индекс блоков и хвост со ссылкой на него
+    uint8_t entry[HUFFMAN_INDEX_ENTRY_SIZE];
+    for (long b = 0; b < block_count; b++) {
+        store_le64(entry, index[b].offset);
+        store_le32(entry + 8, index[b].packed_size);
+        store_le32(entry + 12, index[b].raw_size);
+        fwrite(entry, 1, sizeof(entry), output);
+    }
+    uint8_t trailer[HUFFMAN_TRAILER_SIZE];
+    store_le64(trailer, offset);
+    store_le32(trailer + 8, block_count);
+    store_le32(trailer + 12, HUFFMAN_BLOCK_MAGIC);
+    fwrite(trailer, 1, sizeof(trailer), output);
+    free(index);
+
+    fclose(input);
+    fclose(output);
+
+    printf("Файл успешно сжат: %s -> %s (%ld блоков, %llu -> %llu байт)\n", input_file, output_file,
+           block_count, (unsigned long long)original_size, (unsigned long long)offset);
+}
+
+// Индекс блочного формата по хвосту файла. Проверяет, что блоки лежат
+// между заголовком и индексом и не больше размера блока. 0 или -1.
+static int read_block_index(FILE *input, size_t *block_size, HuffmanBlockIndex **index, long *block_count) {
+    uint8_t header[8], trailer[HUFFMAN_TRAILER_SIZE];
+    struct stat st;
+    if (fstat(fileno(input), &st) != 0 || st.st_size < (off_t)(sizeof(header) + sizeof(trailer)) ||
+        pread(fileno(input), header, sizeof(header), 0) != sizeof(header) ||
+        pread(fileno(input), trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+        load_le32(trailer + 12) != HUFFMAN_BLOCK_MAGIC) {
+        return -1;
+    }
+    uint64_t index_offset = load_le64(trailer);
+    uint32_t count = load_le32(trailer + 8);
+    *block_size = load_le32(header + 4);
+    if (*block_size == 0 || *block_size > HUFFMAN_MAX_BLOCK_SIZE || index_offset < sizeof(header) ||
+        index_offset + (uint64_t)count * HUFFMAN_INDEX_ENTRY_SIZE + sizeof(trailer) != (uint64_t)st.st_size) {
+        return -1;
+    }
+    uint8_t *raw = malloc((size_t)count * HUFFMAN_INDEX_ENTRY_SIZE + 1);
+    *index = malloc(((size_t)count + 1) * sizeof(HuffmanBlockIndex));
+    *block_count = count;
+    int status = pread(fileno(input), raw, (size_t)count * HUFFMAN_INDEX_ENTRY_SIZE, index_offset) ==
+                 (ssize_t)((size_t)count * HUFFMAN_INDEX_ENTRY_SIZE) ? 0 : -1;
+    for (uint32_t b = 0; b < count && status == 0; b++) {
+        HuffmanBlockIndex *entry = &(*index)[b];
+        entry->offset = load_le64(raw + b * HUFFMAN_INDEX_ENTRY_SIZE);
+        entry->packed_size = load_le32(raw + b * HUFFMAN_INDEX_ENTRY_SIZE + 8);
+        entry->raw_size = load_le32(raw + b * HUFFMAN_INDEX_ENTRY_SIZE + 12);
+        if (entry->offset < sizeof(header) || entry->offset + entry->packed_size > index_offset ||
+            entry->raw_size > *block_size || entry->packed_size > HUFFMAN_BLOCK_BOUND(*block_size)) {
+            status = -1;
+        }
+    }
+    free(raw);
+    if (status != 0) {
+        free(*index);
+        *index = NULL;
+    }
+    return status;
+}
+
+// Распаковка блоков, покрывающих [range_offset, range_offset + range_length),
+// на пуле потоков; range_length < 0 - до конца. 0 или -1.
+static int unpack_blocks(FILE *input, FILE *output, size_t block_size, const HuffmanBlockIndex *index,
+                         long block_count, int workers, long long range_offset, long long range_length) {
+    // Начало каждого блока в исходных данных
+    uint64_t total = 0;
+    long first = 0;
+    while (first < block_count && total + index[first].raw_size <= (uint64_t)range_offset) {
+        total += index[first++].raw_size;
+    }
+    uint64_t skip = range_offset - total;
+    uint64_t left = range_length < 0 ? UINT64_MAX : (uint64_t)range_length;
+
+    CodecJob job = {0};
+    job.unpack = 1;
+    job.fd = fileno(input);
+    job.index = index;
+    job.block_size = block_size;
+    job.next_block = first;
+    job.end_block = block_count;
+    pthread_t threads[MAX_WORKERS];
+    codec_job_start(&job, workers, threads);
+    int status = 0;
+    CodecSlot *slot;
+    for (long b = first; left > 0 && (slot = codec_job_wait(&job, b)) != NULL; b++) {
+        if (slot->status != 0) {
+            printf("Ошибка: поврежден блок %ld\n", b);
+            status = -1;
+            codec_job_release(&job, slot);
+            break;
+        }
+        uint64_t length = slot->out_length - skip < left ? slot->out_length - skip : left;
+        fwrite(slot->out + skip, 1, length, output);
+        left -= length;
+        skip = 0;
+        codec_job_release(&job, slot);
+    }
+    codec_job_finish(&job, workers, threads);
+    return status;
+}
+
+// Распаковка файла; range_length >= 0 - только этот диапазон байт исходного
+// файла (для блочного формата)
+void decompress_file(const char *input_file, const char *output_file, int workers,
+                     long long range_offset, long long range_length) {
+    FILE *input = fopen(input_file, "rb");
+    if (!input) {
+        perror("Ошибка открытия входного файла");
+        exit(EXIT_FAILURE);
+    }
+
+    // Блочный формат - по индексу в конце файла. Канонический потоковый:
+    // дерево строится по длинам кодов из заголовка. Иначе - старый формат с
+    // сериализованным деревом, размер неизвестен.
+    uint8_t header[HUFFMAN_HEADER_SIZE];
+    uint64_t original_size = UINT64_MAX;
+    HuffmanNode *root = NULL;
+    HuffmanBlockIndex *index = NULL;
+    long block_count = 0;
+    size_t block_size = 0;
+    size_t got = fread(header, 1, sizeof(header), input);
+    if (got >= 4 && load_le32(header) == HUFFMAN_BLOCK_MAGIC) {
+        if (read_block_index(input, &block_size, &index, &block_count) != 0) {
+            printf("Ошибка: поврежден индекс блоков в %s\n", input_file);
+            fclose(input);
+            exit(EXIT_FAILURE);
+        }
+    } else if (range_length >= 0) {
+        printf("Ошибка: диапазон можно распаковать только из блочного формата\n");
+        fclose(input);
+        exit(EXIT_FAILURE);
+    } else if (got == sizeof(header) && load_le32(header) == HUFFMAN_MAGIC) {
+        uint8_t lengths[256];
+        uint16_t codes[256];
+        original_size = load_le64(header + 4);
+        int symbols = huffman_read_lengths(header + 12, lengths);
+        if (huffman_canonical_codes(lengths, 256, codes) != 0 || (symbols == 0 && original_size > 0)) {
+            printf("Ошибка: неверные длины кодов Хаффмана в %s\n", input_file);
+            fclose(input);
+            exit(EXIT_FAILURE);
+        }
+        root = huffman_tree_from_lengths(lengths, codes);
+    } else {
+        fseek(input, 0, SEEK_SET);
+        root = deserialize_tree(input);
+        if (!root) {
+            perror("Ошибка десериализации дерева Хаффмана");
+            fclose(input);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Открытие выходного файла
+    if (access(output_file, F_OK) == 0) {
+        printf("Файл %s уже существует. Перезаписать? [y/N] ", output_file);
+        int c = getchar();
+        // Очищаем буфер ввода (до конца строки или EOF)
+        for (int ch = c; ch != '\n' && ch != EOF; ch = getchar());
+        if (c != 'y' && c != 'Y') {
+            return; // Пропускаем файл, если пользователь не хочет перезаписывать
+        }
+    }
+
+    
+    FILE *output = fopen(output_file, "wb");
+    if (!output) {
+        perror("Ошибка создания выходного файла");
+        fclose(input);
+        exit(EXIT_FAILURE);
+    }
+
+    // Декодирование данных. Дерево из одного листа не кодирует ни одного бита.
+    int status = 0;
+    uint64_t produced = 0;
+    if (index) {
+        status = unpack_blocks(input, output, block_size, index, block_count, workers, range_offset, range_length);
+        free(index);
+    } else {
+        if (root->left || root->right) {
+            HuffmanDecoder decoder;
+            build_huffman_decoder(&decoder, root);
+            status = huffman_decode_stream(&decoder, input, output, original_size, &produced);
+            free_huffman_decoder(&decoder);
+        }
+        free_huffman_tree(root);
+    }
+
+    fclose(input);
+    fclose(output);
+    if (status != 0 || (original_size != UINT64_MAX && produced != original_size)) {
+        printf("Ошибка: поврежденные сжатые данные в %s\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Файл успешно распакован: %s -> %s\n", input_file, output_file);
+}
+
+
+typedef struct {
+    uint32_t crc;
+    off_t offset;
+    off_t size;
+} FileCopyMeta;
+
+// Запись метаданных в формате v1: на диск пишется до copy_meta
+typedef struct {
+    char name[256];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t atime;
+    time_t mtime;
+    int copies;
+    FileCopyMeta *copy_meta;
+} FileMeta;
+
+// Таблицы для slicing-by-16: crc32_table[0] - классическая побайтовая таблица,
+// crc32_table[k] - сдвиг значения еще на k байт
+static uint32_t crc32_table[16][256];
+
+// Ядро CRC32 работает с "сырым" состоянием, без начальной и конечной инверсии
+typedef uint32_t (*Crc32Kernel)(uint32_t crc, const uint8_t *data, size_t length);
+
+// Побайтовый вариант, эталон для остальных ядер
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t table_index = (crc ^ data[i]) & 0xFF;
+        crc = (crc >> 8) ^ crc32_table[0][table_index];
+    }
+    return crc;
+}
+
+// Переносимый вариант: 16 байт за шаг
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length >= 16) {
+        uint32_t a = load_le32(data) ^ crc;
+        uint32_t b = load_le32(data + 4);
+        uint32_t c = load_le32(data + 8);
+        uint32_t d = load_le32(data + 12);
+        crc = crc32_table[15][a & 0xFF] ^ crc32_table[14][(a >> 8) & 0xFF] ^
+              crc32_table[13][(a >> 16) & 0xFF] ^ crc32_table[12][a >> 24] ^
+              crc32_table[11][b & 0xFF] ^ crc32_table[10][(b >> 8) & 0xFF] ^
+              crc32_table[9][(b >> 16) & 0xFF] ^ crc32_table[8][b >> 24] ^
+              crc32_table[7][c & 0xFF] ^ crc32_table[6][(c >> 8) & 0xFF] ^
+              crc32_table[5][(c >> 16) & 0xFF] ^ crc32_table[4][c >> 24] ^
+              crc32_table[3][d & 0xFF] ^ crc32_table[2][(d >> 8) & 0xFF] ^
+              crc32_table[1][(d >> 16) & 0xFF] ^ crc32_table[0][d >> 24];
+        data += 16;
+        length -= 16;
+    }
+    return crc32_bytewise(crc, data, length);
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// Свертка блоками по 64 байта через PCLMULQDQ с редукцией Барретта
+// (Intel, "Fast CRC Computation Using PCLMULQDQ"). Константы - для
+// отраженного полинома 0xEDB88320. length >= 64 и кратно 16.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t *data, size_t length) {
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    data += 64;
+    length -= 64;
+
+    // Четыре независимых потока свертки
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        data += 64;
+        length -= 64;
+    }
+
+    // Сведение четырех потоков в один 128-битный
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Оставшиеся блоки по 16 байт
+    while (length >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        length -= 16;
+    }
+
+    // 128 -> 64 бита
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Редукция Барретта до 32 бит
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t length) {
+    if (length >= 64) {
+        size_t chunk = length & ~(size_t)15;
+        crc = crc32_pclmul_fold(crc, data, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+    return crc32_slice16(crc, data, length);
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+// Инструкции CRC32 из ARMv8 считают тот же отраженный полином 0xEDB88320
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length > 0 && ((uintptr_t)data & 7)) {
+        crc = __crc32b(crc, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32d(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = __crc32b(crc, *data++);
+        length--;
+    }
+    return crc;
+}
+#endif
+
+// Доступные ядра в порядке предпочтения; выбирается первое, которое
+// поддерживает процессор
+typedef struct {
+    const char *name;
+    Crc32Kernel kernel;
+    int (*supported)(void);
+} Crc32Engine;
+
+static int cpu_always(void) {
+    return 1;
+}
+
+#if defined(__x86_64__)
+static int cpu_has_pclmul(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+#if defined(__aarch64__)
+static int cpu_has_armv8_crc(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static const Crc32Engine crc32_engines[] = {
+#if defined(__x86_64__)
+    {"pclmul", crc32_pclmul, cpu_has_pclmul},
+#endif
+#if defined(__aarch64__)
+    {"armv8-crc", crc32_armv8, cpu_has_armv8_crc},
+#endif
+    {"slice16", crc32_slice16, cpu_always},
+    {"bytewise", crc32_bytewise, cpu_always},
+};
+
+static const Crc32Engine *crc32_engine = &crc32_engines[sizeof(crc32_engines) / sizeof(crc32_engines[0]) - 1];
+
+// Инициализация таблиц CRC32 и выбор самого быстрого ядра
+void init_crc32_table() {
+    uint32_t polynomial = 0xEDB88320;
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 8; j > 0; j--) {
+            crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+        }
+        crc32_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 16; k++) {
+            uint32_t prev = crc32_table[k - 1][i];
+            crc32_table[k][i] = (prev >> 8) ^ crc32_table[0][prev & 0xFF];
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(crc32_engines) / sizeof(crc32_engines[0]); i++) {
+        if (crc32_engines[i].supported()) {
+            crc32_engine = &crc32_engines[i];
+            break;
+        }
+    }
+}
+
+// Продолжение CRC32 по следующему фрагменту данных. crc - результат
+// предыдущего вызова (0 для начала), как в zlib crc32()
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    return crc32_engine->kernel(crc ^ 0xFFFFFFFF, (const uint8_t *)data, length) ^ 0xFFFFFFFF;
+}
+
+uint32_t calculate_crc32_buffer(const void *data, size_t length) {
+    return crc32_update(0, data, length);
+}
+
+// Расчет CRC32 для файла (потоковое чтение)
+uint32_t calculate_crc32_file(FILE *file) {
+    uint32_t crc = 0;
+    uint8_t buffer[BUFFER_SIZE];
+    size_t bytes_read;
+
+    fseek(file, 0, SEEK_SET);
+    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
+        crc = crc32_update(crc, buffer, bytes_read);
+    }
+    
+    return crc;
+}
+
+// Умножение многочленов по модулю полинома CRC32 (отраженная запись)
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * length) по модулю полинома CRC32
+static uint32_t crc32_shift(off_t length) {
+    uint32_t power = (uint32_t)1 << 30; // x^1
+    uint32_t result = (uint32_t)1 << 31; // x^0
+    uint64_t bits = (uint64_t)length * 8;
+    while (bits) {
+        if (bits & 1) {
+            result = crc32_multmodp(power, result);
+        }
+        power = crc32_multmodp(power, power);
+        bits >>= 1;
+    }
+    return result;
+}
+
+// CRC32 склейки двух фрагментов по их CRC, как zlib crc32_combine()
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, off_t length2) {
+    return crc32_multmodp(crc32_shift(length2), crc1) ^ crc2;
+}
+
+// CRC блоков: копия длиннее CRC_BLOCK_SIZE кроме CRC целиком имеет таблицу
+// CRC своих блоков по CRC_BLOCK_SIZE байт (последний короче), так что
+// поврежденное место находится с точностью до блока. CRC копии - склейка
+// CRC ее блоков.
+#define CRC_BLOCK_SIZE (64 * 1024)
+
+static uint32_t crc_block_shift; // x^(8 * CRC_BLOCK_SIZE)
+
+void init_block_crcs(void) {
+    crc_block_shift = crc32_shift(CRC_BLOCK_SIZE);
+}
+
+static inline uint32_t crc_block_count(off_t size) {
+    return (size + CRC_BLOCK_SIZE - 1) / CRC_BLOCK_SIZE;
+}
+
+// CRC данных, продолженный блоком длины length с CRC block_crc
+static inline uint32_t crc32_append_block(uint32_t crc, uint32_t block_crc, off_t length) {
+    return length == CRC_BLOCK_SIZE ? crc32_multmodp(crc_block_shift, crc) ^ block_crc
+                                    : crc32_combine(crc, block_crc, length);
+}
+
+// CRC копии по таблице CRC ее блоков
+static uint32_t crc_of_blocks(const uint32_t *table, off_t size) {
+    uint32_t crc = 0, blocks = crc_block_count(size);
+    for (uint32_t b = 0; b < blocks; b++) {
+        crc = crc32_append_block(crc, table[b], b + 1 < blocks ? CRC_BLOCK_SIZE : size - (off_t)b * CRC_BLOCK_SIZE);
+    }
+    return crc;
+}
+
+// CRC данных, которые приходят кусками любой длины, и таблица CRC их
+// блоков (растет по мере записи)
+typedef struct {
+    uint32_t crc;        // CRC всех закрытых блоков
+    uint32_t block_crc;  // CRC начатого блока
+    size_t filled;       // байт в начатом блоке
+    uint32_t *table;
+    uint32_t blocks;
+    uint32_t capacity;
+} BlockCrcs;
+
+static void block_crcs_close(BlockCrcs *crcs) {
+    if (crcs->blocks == crcs->capacity) {
+        crcs->capacity = crcs->capacity ? crcs->capacity * 2 : 64;
+        crcs->table = realloc(crcs->table, crcs->capacity * sizeof(uint32_t));
+    }
+    crcs->table[crcs->blocks++] = crcs->block_crc;
+    crcs->crc = crc32_append_block(crcs->crc, crcs->block_crc, crcs->filled);
+    crcs->block_crc = 0;
+    crcs->filled = 0;
+}
+
+static void block_crcs_update(BlockCrcs *crcs, const void *data, size_t length) {
+    const uint8_t *p = data;
+    while (length > 0) {
+        size_t take = CRC_BLOCK_SIZE - crcs->filled < length ? CRC_BLOCK_SIZE - crcs->filled : length;
+        crcs->block_crc = crc32_update(crcs->block_crc, p, take);
+        crcs->filled += take;
+        p += take;
+        length -= take;
+        if (crcs->filled == CRC_BLOCK_SIZE) {
+            block_crcs_close(crcs);
+        }
+    }
+}
+
+// Закрытие последнего блока. Возвращает CRC всех данных
+static uint32_t block_crcs_finish(BlockCrcs *crcs) {
+    if (crcs->filled > 0) {
+        block_crcs_close(crcs);
+    }
+    return crcs->crc;
+}
+
+// Тест ядер CRC32: все доступные ядра должны дать одинаковый результат
+void test_crc32(const char *input_file) {
+    int fd = open(input_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Ошибка открытия входного файла");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *data = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (read(fd, data, st.st_size) != st.st_size) {
+        perror("Ошибка чтения входного файла");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    printf("Выбрано ядро: %s\n", crc32_engine->name);
+    uint32_t reference = crc32_bytewise(0xFFFFFFFF, data, st.st_size) ^ 0xFFFFFFFF;
+    for (size_t i = 0; i < sizeof(crc32_engines) / sizeof(crc32_engines[0]); i++) {
+        if (!crc32_engines[i].supported()) {
+            printf("  %-10s не поддерживается процессором\n", crc32_engines[i].name);
+            continue;
+        }
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        uint32_t crc = crc32_engines[i].kernel(0xFFFFFFFF, data, st.st_size) ^ 0xFFFFFFFF;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("  %-10s CRC32=%08x %s, %.0f МБ/с\n", crc32_engines[i].name, crc,
+               crc == reference ? "OK" : "ОШИБКА", seconds > 0 ? st.st_size / seconds / 1e6 : 0.0);
+    }
+    free(data);
+}
+
+
+// SHA-256 (FIPS 180-4) - ключ кусков при дедупликации. Ядро сжатия блоков
+// выбирается как у CRC32: SHA-NI, если процессор его поддерживает, иначе
+// переносимое.
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Ядро сжатия: count блоков по 64 байта в состояние state
+typedef void (*Sha256Kernel)(uint32_t *state, const uint8_t *data, size_t count);
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_generic(uint32_t *state, const uint8_t *data, size_t count) {
+    for (; count > 0; count--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 |
+                   data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+            uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// SHA-NI: состояние в двух регистрах (ABEF и CDGH), по 4 раунда на
+// инструкцию sha256rnds2 x2, расписание сообщений - sha256msg1/msg2
+__attribute__((target("sha,sse4.1")))
+static void sha256_shani(uint32_t *state, const uint8_t *data, size_t count) {
+    const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);            // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);      // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);   // CDGH
+
+    for (; count > 0; count--, data += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i msg[4];
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), shuffle);
+        }
+        for (int r = 0; r < 16; r++) {
+            __m128i m = msg[r & 3];
+            __m128i k = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)&sha256_k[4 * r]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, k);
+            if (r >= 3 && r < 15) {
+                // Слова W следующей четверки раундов
+                __m128i next = _mm_add_epi32(msg[(r + 1) & 3], _mm_alignr_epi8(m, msg[(r + 3) & 3], 4));
+                msg[(r + 1) & 3] = _mm_sha256msg2_epu32(next, m);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(k, 0x0E));
+            if (r >= 1 && r < 13) {
+                msg[(r + 3) & 3] = _mm_sha256msg1_epu32(msg[(r + 3) & 3], m);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);         // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);      // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);   // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);      // HGFE
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+static int cpu_has_sha(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static Sha256Kernel sha256_kernel = sha256_generic;
+
+void init_sha256(void) {
+#if defined(__x86_64__)
+    if (cpu_has_sha()) {
+        sha256_kernel = sha256_shani;
+    }
+#endif
+}
+
+// SHA-256 буфера целиком
+void sha256(const void *data, size_t length, uint8_t *digest) {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const uint8_t *p = data;
+    sha256_kernel(state, p, length / 64);
+    uint8_t tail[128] = {0};
+    size_t rest = length % 64;
+    memcpy(tail, p + length - rest, rest);
+    tail[rest] = 0x80;
+    size_t tail_length = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_length - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    sha256_kernel(state, tail, tail_length / 64);
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, state[i]);
+    }
+}
+
+// Нарезка на куски по содержимому (FastCDC): gear-хеш (hash << 1) + gear[b]
+// зависит от последних 64 байт, граница - там, где его старшие биты нулевые.
+// До CHUNK_NORMAL_SIZE маска строже, после - мягче, так что размеры кусков
+// собираются около среднего. Вставка или удаление байт сдвигает только
+// соседние границы, остальные куски файла остаются теми же.
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_NORMAL_SIZE (64 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
+#define CHUNK_MASK_STRICT (~0ULL << (64 - 18))
+#define CHUNK_MASK_LOOSE (~0ULL << (64 - 14))
+#define CHUNK_DIGEST_SIZE 32
+
+// Таблица gear - фиксированная псевдослучайная (splitmix64 от постоянного
+// зерна): от нее зависят границы, а значит, совпадение кусков между архивами
+static uint64_t gear_table[256];
+
+void init_gear_table(void) {
+    uint64_t seed = 0x6F6F6F2D63646331ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+// Длина первого куска data; если length < CHUNK_MAX_SIZE, данные считаются
+// концом файла
+static size_t chunk_cut(const uint8_t *data, size_t length) {
+    if (length <= CHUNK_MIN_SIZE) {
+        return length;
+    }
+    size_t limit = length < CHUNK_MAX_SIZE ? length : CHUNK_MAX_SIZE;
+    size_t normal = limit < CHUNK_NORMAL_SIZE ? limit : CHUNK_NORMAL_SIZE;
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+        if (!(hash & CHUNK_MASK_STRICT)) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear_table[data[i]];
+        if (!(hash & CHUNK_MASK_LOOSE)) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+// Коды Рида-Соломона для -b k+m: образ записи режется на k шардов данных,
+// к ним считаются m шардов четности, и по любым k целым шардам
+// восстанавливается весь образ. Арифметика в GF(2^8) с многочленом 0x11D.
+// Матрица кода систематическая: единичная для шардов данных, для четности -
+// матрица Коши 1 / (x_p + y_d), x_p = k + p, y_d = d. Любая квадратная
+// подматрица матрицы Коши обратима, поэтому подходит любой набор из k шардов.
+// Основная операция - dst ^= c * src по области: SSSE3/AVX2 умножают через
+// PSHUFB по таблицам произведений на младшую и старшую тетраду байта.
+#define ERASURE_SEGMENT_SIZE (256 * 1024)
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+static uint8_t gf_nibble_table[256][32];  // c * x и c * (x << 4) для x < 16
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    return gf_mul_table[a][b];
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+typedef void (*GfMulAddKernel)(uint8_t factor, const uint8_t *src, uint8_t *dst, size_t length);
+
+static void gf_mul_add_scalar(uint8_t factor, const uint8_t *src, uint8_t *dst, size_t length) {
+    const uint8_t *row = gf_mul_table[factor];
+    for (size_t i = 0; i < length; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t factor, const uint8_t *src, uint8_t *dst, size_t length) {
+    const __m128i low = _mm_loadu_si128((const __m128i *)gf_nibble_table[factor]);
+    const __m128i high = _mm_loadu_si128((const __m128i *)(gf_nibble_table[factor] + 16));
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(x, mask)),
+                                         _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, product));
+    }
+    gf_mul_add_scalar(factor, src + i, dst + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t factor, const uint8_t *src, uint8_t *dst, size_t length) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nibble_table[factor]));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(gf_nibble_table[factor] + 16)));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(x, mask)),
+                                           _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, product));
+    }
+    gf_mul_add_scalar(factor, src + i, dst + i, length - i);
+}
+
+static int cpu_has_ssse3(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int cpu_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+typedef struct {
+    const char *name;
+    GfMulAddKernel kernel;
+    int (*supported)(void);
+} GfEngine;
+
+static const GfEngine gf_engines[] = {
+#if defined(__x86_64__)
+    {"avx2", gf_mul_add_avx2, cpu_has_avx2},
+    {"ssse3", gf_mul_add_ssse3, cpu_has_ssse3},
+#endif
+    {"scalar", gf_mul_add_scalar, cpu_always},
+};
+
+static const GfEngine *gf_engine = &gf_engines[sizeof(gf_engines) / sizeof(gf_engines[0]) - 1];
+
+// Таблицы GF(2^8) и выбор самого быстрого ядра
+void init_erasure(void) {
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11D;
+        }
+    }
+    for (int a = 1; a < 256; a++) {
+        for (int b = 1; b < 256; b++) {
+            gf_mul_table[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        for (int v = 0; v < 16; v++) {
+            gf_nibble_table[c][v] = gf_mul(c, v);
+            gf_nibble_table[c][16 + v] = gf_mul(c, v << 4);
+        }
+    }
+    for (size_t i = 0; i < sizeof(gf_engines) / sizeof(gf_engines[0]); i++) {
+        if (gf_engines[i].supported()) {
+            gf_engine = &gf_engines[i];
+            break;
+        }
+    }
+}
+
+// Строка shard матрицы кода k+m: k коэффициентов при шардах данных
+static void erasure_row(int k, int shard, uint8_t *row) {
+    for (int d = 0; d < k; d++) {
+        row[d] = shard < k ? (shard == d) : gf_inv((uint8_t)(shard ^ d));
+    }
+}
+
+// Шарды четности parity[0..m-1] по шардам данных data[0..k-1], length байт
+static void erasure_encode(int k, int m, uint8_t *const *data, uint8_t *const *parity, size_t length) {
+    uint8_t row[MAX_REDUNDANCY];
+    for (int p = 0; p < m; p++) {
+        erasure_row(k, k + p, row);
+        memset(parity[p], 0, length);
+        for (int d = 0; d < k; d++) {
+            gf_engine->kernel(row[d], data[d], parity[p], length);
+        }
+    }
+}
+
+// Обратная матрица к строкам shards[0..k-1] матрицы кода (k x k, по
+// строкам): шард данных d = сумма inverse[d * k + r] * шард shards[r].
+// 0 - успех, -1 - матрица вырождена (одинаковые шарды)
+static int erasure_invert(int k, const int *shards, uint8_t *inverse) {
+    uint8_t matrix[MAX_REDUNDANCY * MAX_REDUNDANCY];
+    for (int r = 0; r < k; r++) {
+        erasure_row(k, shards[r], matrix + r * k);
+        for (int d = 0; d < k; d++) {
+            inverse[r * k + d] = r == d;
+        }
+    }
+    // Гаусс-Жордан: вычитание в GF(2^8) - XOR
+    for (int col = 0; col < k; col++) {
+        int pivot = col;
+        while (pivot < k && matrix[pivot * k + col] == 0) {
+            pivot++;
+        }
+        if (pivot == k) {
+            return -1;
+        }
+        for (int d = 0; d < k; d++) {
+            uint8_t t = matrix[col * k + d];
+            matrix[col * k + d] = matrix[pivot * k + d];
+            matrix[pivot * k + d] = t;
+            t = inverse[col * k + d];
+            inverse[col * k + d] = inverse[pivot * k + d];
+            inverse[pivot * k + d] = t;
+        }
+        uint8_t scale = gf_inv(matrix[col * k + col]);
+        for (int d = 0; d < k; d++) {
+            matrix[col * k + d] = gf_mul(matrix[col * k + d], scale);
+            inverse[col * k + d] = gf_mul(inverse[col * k + d], scale);
+        }
+        for (int r = 0; r < k; r++) {
+            uint8_t factor = matrix[r * k + col];
+            if (r == col || factor == 0) {
+                continue;
+            }
+            for (int d = 0; d < k; d++) {
+                matrix[r * k + d] ^= gf_mul(factor, matrix[col * k + d]);
+                inverse[r * k + d] ^= gf_mul(factor, inverse[col * k + d]);
+            }
+        }
+    }
+    return 0;
+}
+
+// Каталог метаданных архива. Записи - плотный массив без имен и копий;
+// имена лежат подряд в одном пуле строк, копии всех записей - в одном
+// массиве, запись хранит индекс своей первой копии. Каталог на миллион
+// записей - три выделения памяти. Ссылки файлов, разбитых на куски, на
+// записи кусков и таблицы CRC блоков лежат так же каждые в одном массиве.
+typedef struct {
+    size_t name;          // смещение имени в пуле
+    uint32_t first_copy;  // индекс первой копии
+    uint16_t copies;
+    uint16_t flags;       // ENTRY_DELETED, ENTRY_COMPRESSED, ENTRY_CHUNK, ENTRY_CHUNKED, ENTRY_ERASURE,
+                          // ENTRY_BLOCK_CRCS
+    uint8_t codec;        // CODEC_*, для сжатой записи
+    uint8_t data_shards;  // k для ENTRY_ERASURE: копии - k шардов данных и за ними шарды четности
+    off_t image_size;     // длина образа до разбиения на шарды (ENTRY_ERASURE)
+    off_t raw_size;       // размер до сжатия (сжатая запись) или файла (ENTRY_CHUNKED)
+    uint32_t first_chunk; // индекс первой ссылки на кусок
+    uint32_t chunks;      // число кусков файла
+    uint32_t first_block; // индекс первого CRC блока (ENTRY_BLOCK_CRCS)
+    uint32_t blocks;      // блоков в копии
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t atime;
+    time_t mtime;
+} CatalogEntry;
+
+typedef struct {
+    CatalogEntry *entries;
+    int count;
+    int capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    FileCopyMeta *copies;
+    size_t copy_count;
+    size_t copy_capacity;
+    uint32_t *chunk_refs;   // номера записей кусков
+    size_t ref_count;
+    size_t ref_capacity;
+    uint32_t *block_crcs;   // таблицы CRC блоков копий
+    size_t block_count;
+    size_t block_capacity;
+} Catalog;
+
+#define ENTRY_DELETED 0x01
+#define ENTRY_COMPRESSED 0x02
+#define ENTRY_CHUNK 0x04    // кусок дедупликации: имя - SHA-256 содержимого
+#define ENTRY_CHUNKED 0x08  // файл из кусков: копий нет, есть список кусков
+#define ENTRY_ERASURE 0x10  // копии - шарды кода Рида-Соломона, а не реплики
+#define ENTRY_BLOCK_CRCS 0x20  // у копий есть таблицы CRC блоков: одна на все реплики или по одной на шард
+
+// Сжатие записей архива. Файл сжимается один раз, все реплики хранят один и
+// тот же сжатый образ, CRC и размер копии относятся к нему. Образ CODEC_HUFFMAN -
+// блоки по HUFFMAN_BLOCK_SIZE байт исходного файла (последний короче), каждый -
+// длина (le32) и блок в формате huffman_pack_block уровня 0. Образ CODEC_LZ -
+// то же, уровень больше 0 (сам уровень для распаковки не нужен). Образ
+// CODEC_RANS - блоки уровня 0, закодированные rANS.
+#define CODEC_STORED 0
+#define CODEC_HUFFMAN 1
+#define CODEC_LZ 2
+#define CODEC_RANS 3
+
+static inline const char *entry_name(const Catalog *catalog, int i) {
+    return catalog->names + catalog->entries[i].name;
+}
+
+static inline FileCopyMeta *entry_copies(const Catalog *catalog, int i) {
+    return catalog->copies + catalog->entries[i].first_copy;
+}
+
+static inline uint32_t *entry_chunks(const Catalog *catalog, int i) {
+    return catalog->chunk_refs + catalog->entries[i].first_chunk;
+}
+
+// Таблица CRC блоков копии j записи i или NULL. Реплики - один и тот же
+// образ, таблица у них общая; у каждого шарда кода k+m - своя.
+static inline uint32_t *entry_block_crcs(const Catalog *catalog, int i, int j) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    if (!(entry->flags & ENTRY_BLOCK_CRCS)) {
+        return NULL;
+    }
+    return catalog->block_crcs + entry->first_block + (entry->flags & ENTRY_ERASURE ? (size_t)j * entry->blocks : 0);
+}
+
+// SHA-256 куска хранится в пуле имен вместо имени (CHUNK_DIGEST_SIZE байт)
+static inline const uint8_t *chunk_digest(const Catalog *catalog, int i) {
+    return (const uint8_t *)catalog->names + catalog->entries[i].name;
+}
+
+// Запись куска - служебная: у нее нет имени файла, она не выводится и не
+// извлекается сама по себе
+static inline int is_chunk(const Catalog *catalog, int i) {
+    return catalog->entries[i].flags & ENTRY_CHUNK;
+}
+
+// Удаленная запись (надгробие): реплики указывают на освобожденное место
+static inline int is_tombstone(const Catalog *catalog, int i) {
+    return catalog->entries[i].flags & ENTRY_DELETED;
+}
+
+static size_t grow_capacity(size_t capacity, size_t needed) {
+    if (capacity == 0) {
+        capacity = 64;
+    }
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// Увеличение массива каталога; нехватка памяти фатальна
+static void *catalog_realloc(void *array, size_t size) {
+    void *grown = realloc(array, size);
+    if (!grown) {
+        perror("Ошибка выделения памяти");
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
+// Запас места еще под entries записей, names байт имен и copies копий
+void catalog_reserve(Catalog *catalog, int entries, size_t names, size_t copies) {
+    if ((size_t)catalog->count + entries > (size_t)catalog->capacity) {
+        catalog->capacity = grow_capacity(catalog->capacity, (size_t)catalog->count + entries);
+        catalog->entries = catalog_realloc(catalog->entries, catalog->capacity * sizeof(CatalogEntry));
+    }
+    if (catalog->names_size + names > catalog->names_capacity) {
+        catalog->names_capacity = grow_capacity(catalog->names_capacity, catalog->names_size + names);
+        catalog->names = catalog_realloc(catalog->names, catalog->names_capacity);
+    }
+    if (catalog->copy_count + copies > catalog->copy_capacity) {
+        catalog->copy_capacity = grow_capacity(catalog->copy_capacity, catalog->copy_count + copies);
+        catalog->copies = catalog_realloc(catalog->copies, catalog->copy_capacity * sizeof(FileCopyMeta));
+    }
+}
+
+// Новая запись с обнуленными полями и копиями. Возвращает ее номер;
+// указатели, полученные из каталога раньше, после этого недействительны.
+int catalog_add(Catalog *catalog, const char *name, size_t name_length, int copies) {
+    catalog_reserve(catalog, 1, name_length + 1, copies);
+    CatalogEntry *entry = &catalog->entries[catalog->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = catalog->names_size;
+    memcpy(catalog->names + catalog->names_size, name, name_length);
+    catalog->names[catalog->names_size + name_length] = '\0';
+    catalog->names_size += name_length + 1;
+    entry->first_copy = catalog->copy_count;
+    entry->copies = copies;
+    entry->first_chunk = catalog->ref_count;
+    entry->first_block = catalog->block_count;
+    if (copies > 0)
+        memset(catalog->copies + catalog->copy_count, 0, copies * sizeof(FileCopyMeta));
+    catalog->copy_count += copies;
+    return catalog->count++;
+}
+
+// Ссылка на кусок в конец списка записи n; список n должен быть последним
+// в массиве ссылок (записи кусков, добавленные после n, ссылок не имеют)
+void catalog_add_chunk_ref(Catalog *catalog, int n, uint32_t chunk) {
+    if (catalog->ref_count == catalog->ref_capacity) {
+        catalog->ref_capacity = grow_capacity(catalog->ref_capacity, catalog->ref_count + 1);
+        catalog->chunk_refs = catalog_realloc(catalog->chunk_refs, catalog->ref_capacity * sizeof(uint32_t));
+    }
+    catalog->chunk_refs[catalog->ref_count++] = chunk;
+    catalog->entries[n].chunks++;
+}
+
+// Таблицы CRC блоков записи n (одна или по одной на шард, по blocks CRC)
+// в конец массива, их надо заполнить. Копия из одного блока таблицы не
+// получает: ей хватает CRC копии, тогда результат NULL.
+uint32_t *catalog_add_block_crcs(Catalog *catalog, int n, uint32_t blocks) {
+    CatalogEntry *entry = &catalog->entries[n];
+    if (blocks < 2) {
+        entry->flags &= ~ENTRY_BLOCK_CRCS;
+        return NULL;
+    }
+    size_t count = (size_t)blocks * (entry->flags & ENTRY_ERASURE ? entry->copies : 1);
+    if (catalog->block_count + count > catalog->block_capacity) {
+        catalog->block_capacity = grow_capacity(catalog->block_capacity, catalog->block_count + count);
+        catalog->block_crcs = catalog_realloc(catalog->block_crcs, catalog->block_capacity * sizeof(uint32_t));
+    }
+    entry->flags |= ENTRY_BLOCK_CRCS;
+    entry->first_block = catalog->block_count;
+    entry->blocks = blocks;
+    catalog->block_count += count;
+    return catalog->block_crcs + entry->first_block;
+}
+
+// Отбрасывание записей начиная с номера count (вместе с их именами, копиями,
+// ссылками и таблицами CRC блоков)
+void catalog_truncate(Catalog *catalog, int count) {
+    if (count < catalog->count) {
+        catalog->names_size = catalog->entries[count].name;
+        catalog->copy_count = catalog->entries[count].first_copy;
+        catalog->ref_count = catalog->entries[count].first_chunk;
+        catalog->block_count = catalog->entries[count].first_block;
+        catalog->count = count;
+    }
+}
+
+// Удаление надгробий: записи и копии сдвигаются к началу, ссылки на куски
+// перенумеровываются, пул имен, массивы ссылок и CRC блоков не сжимаются
+void catalog_drop_tombstones(Catalog *catalog) {
+    int kept = 0;
+    size_t copy_count = 0;
+    uint32_t *renumber = malloc((catalog->count > 0 ? catalog->count : 1) * sizeof(uint32_t));
+    for (int i = 0; i < catalog->count; i++) {
+        renumber[i] = kept;
+        if (is_tombstone(catalog, i)) {
+            continue;
+        }
+        CatalogEntry entry = catalog->entries[i];
+        memmove(catalog->copies + copy_count, catalog->copies + entry.first_copy, entry.copies * sizeof(FileCopyMeta));
+        entry.first_copy = copy_count;
+        copy_count += entry.copies;
+        catalog->entries[kept++] = entry;
+    }
+    // Живые файлы ссылаются только на живые куски
+    for (int i = 0; i < kept; i++) {
+        uint32_t *refs = entry_chunks(catalog, i);
+        for (uint32_t k = 0; k < catalog->entries[i].chunks; k++) {
+            refs[k] = renumber[refs[k]];
+        }
+    }
+    free(renumber);
+    catalog->count = kept;
+    catalog->copy_count = copy_count;
+}
+
+void catalog_free(Catalog *catalog) {
+    free(catalog->entries);
+    free(catalog->names);
+    free(catalog->copies);
+    free(catalog->chunk_refs);
+    free(catalog->block_crcs);
+    memset(catalog, 0, sizeof(*catalog));
+}
+
+// Метаданные v1 (и файл -mx/-ma): на каждую запись сырая FileMeta до
+// copy_meta, затем ее FileCopyMeta. Надгробие v1 - стертое имя.
+int read_metadata(FILE *arch, int file_count, Catalog *catalog) {
+    catalog_reserve(catalog, file_count, 0, 0);
+    for (int i = 0; i < file_count; i++) {
+        FileMeta meta;
+        if (fread(&meta, offsetof(FileMeta, copy_meta), 1, arch) != 1 ||
+            meta.copies < 0 || meta.copies > MAX_REDUNDANCY) {
+            return -1;
+        }
+        meta.name[sizeof(meta.name) - 1] = '\0';
+        int n = catalog_add(catalog, meta.name, strlen(meta.name), meta.copies);
+        CatalogEntry *entry = &catalog->entries[n];
+        entry->flags = meta.name[0] == '\0' ? ENTRY_DELETED : 0;
+        entry->mode = meta.mode;
+        entry->uid = meta.uid;
+        entry->gid = meta.gid;
+        entry->atime = meta.atime;
+        entry->mtime = meta.mtime;
+        if (fread(entry_copies(catalog, n), sizeof(FileCopyMeta), meta.copies, arch) != (size_t)meta.copies) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void write_metadata(FILE *arch, const Catalog *catalog) {
+    for (int i = 0; i < catalog->count; i++) {
+        const CatalogEntry *entry = &catalog->entries[i];
+        FileMeta meta;
+        memset(&meta, 0, sizeof(meta));
+        if (!is_tombstone(catalog, i)) {
+            snprintf(meta.name, sizeof(meta.name), "%s", entry_name(catalog, i));
+        }
+        meta.mode = entry->mode;
+        meta.uid = entry->uid;
+        meta.gid = entry->gid;
+        meta.atime = entry->atime;
+        meta.mtime = entry->mtime;
+        meta.copies = entry->copies;
+        fwrite(&meta, offsetof(FileMeta, copy_meta), 1, arch);
+        fwrite(entry_copies(catalog, i), sizeof(FileCopyMeta), entry->copies, arch);
+    }
+}
+
+// Размер записи v1
+long metadata_size(const Catalog *catalog, int i) {
+    return offsetof(FileMeta, copy_meta) + catalog->entries[i].copies * sizeof(FileCopyMeta);
+}
+
+// Формат архива: заголовок, данные реплик, метаданные до конца файла.
+// Читаются v1 (исходный формат) и v2, записывается всегда v2.
+#define ARCHIVE_HEADER_SIZE 12
+#define ARCHIVE_MAGIC 0x324F4F4F // "OOO2"
+#define FOOTER_MAGIC 0x3254454D  // "MET2"
+#define FOOTER_MAGIC_CODECS 0x3354454D  // "MET3": есть сжатые записи
+#define FOOTER_MAGIC_CHUNKS 0x3454454D  // "MET4": есть куски дедупликации
+#define FOOTER_MAGIC_ERASURE 0x3554454D  // "MET5": есть записи с кодом Рида-Соломона
+#define FOOTER_MAGIC_BLOCKS 0x3654454D  // "MET6": есть таблицы CRC блоков
+#define FOOTER_HEAD_SIZE 16
+#define RESTART_INTERVAL 16
+#define COPIES_UNIFORM 0x01
+
+// Фиксация заголовка: сначала на диск уходит все записанное ранее,
+// затем заголовок (v2) с новым смещением метаданных
+void commit_header(FILE *arch, long meta_offset) {
+    uint8_t header[ARCHIVE_HEADER_SIZE];
+    for (int i = 0; i < 8; i++) {
+        header[i] = (uint64_t)meta_offset >> (8 * i);
+    }
+    for (int i = 0; i < 4; i++) {
+        header[8 + i] = (uint32_t)ARCHIVE_MAGIC >> (8 * i);
+    }
+    fflush(arch);
+    fsync(fileno(arch));
+    fseek(arch, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), arch);
+    fflush(arch);
+    fsync(fileno(arch));
+}
+
+// Запись буфера целиком по смещению; ошибка записи архива фатальна
+void pwrite_full(int fd, const void *data, size_t length, off_t offset) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("Ошибка записи архива");
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        offset += written;
+        length -= written;
+    }
+}
+
+// То же для извлекаемого файла: 0 - успех, -1 - ошибка записи
+int pwrite_all(int fd, const void *data, size_t length, off_t offset) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        bytes += written;
+        offset += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Асинхронный ввод-вывод. Очередь владеет depth буферами по IO_BUFFER_SIZE
+// (выровнены на страницу); операция - чтение файла в буфер или запись из
+// буфера, в полете их может быть сразу много, завершения приходят в любом
+// порядке с меткой вызывающего. Движок - io_uring через системные вызовы
+// (буферы зарегистрированы в ядре, READ_FIXED/WRITE_FIXED); если ядро его не
+// дает или задано -io threads - пул потоков с pread/pwrite.
+#define IO_BUFFER_SIZE (256 * 1024)
+#define IO_QUEUE_DEPTH 32
+#define IO_MAX_THREADS 16
+
+// Движок пула потоков вместо io_uring (опция -io threads)
+static int io_force_threads = 0;
+// io_uring: -1 - еще не пробовали, 0 - недоступен, 1 - работает
+static int io_uring_state = -1;
+
+typedef struct {
+    uint64_t tag;
+    ssize_t result;  // байт или -errno
+} IoCompletion;
+
+// Операция в полете
+typedef struct {
+    int fd;
+    int write;
+    int buffer;
+    size_t length;
+    off_t offset;
+    uint64_t tag;
+    ssize_t result;
+} IoSlot;
+
+typedef struct {
+    uint8_t *buffers;
+    int depth;
+    int inflight;        // отправлено и не получено
+    IoSlot *slots;
+    int *free_slots;
+    unsigned entries, free_count;
+    int uring;
+    // io_uring
+    int ring_fd;
+    int fixed;           // буферы зарегистрированы
+    unsigned pending;    // в кольце заявок, но ядру еще не отправлено
+    uint8_t *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    // Пул потоков: кольца номеров операций
+    pthread_t threads[IO_MAX_THREADS];
+    int thread_count;
+    int *requests, *completions;
+    unsigned request_head, request_count, completion_head, completion_count;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t request_ready, completion_ready;
+} IoQueue;
+
+static inline uint8_t *io_buffer(const IoQueue *queue, int b) {
+    return queue->buffers + (size_t)b * IO_BUFFER_SIZE;
+}
+
+// Дочитывание до length байт с уже прочитанных done; возвращает прочитанное
+// (меньше length только в конце файла) или -errno
+static ssize_t io_pread_rest(int fd, uint8_t *data, size_t length, off_t offset, size_t done) {
+    while (done < length) {
+        ssize_t got = pread(fd, data + done, length - done, offset + done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            return done > 0 ? (ssize_t)done : -errno;
+        }
+        if (got == 0) {
+            break;
+        }
+        done += got;
+    }
+    return done;
+}
+
+// Дописывание до length байт с уже записанных done; length или -errno
+static ssize_t io_pwrite_rest(int fd, const uint8_t *data, size_t length, off_t offset, size_t done) {
+    while (done < length) {
+        ssize_t written = pwrite(fd, data + done, length - done, offset + done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return written < 0 ? -errno : -EIO;
+        }
+        done += written;
+    }
+    return done;
+}
+
+static void *io_thread(void *arg) {
+    IoQueue *queue = (IoQueue *)arg;
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (queue->request_count == 0 && !queue->stop) {
+            pthread_cond_wait(&queue->request_ready, &queue->lock);
+        }
+        if (queue->request_count == 0) {
+            break;
+        }
+        IoSlot *slot = &queue->slots[queue->requests[queue->request_head]];
+        queue->request_head = (queue->request_head + 1) % queue->entries;
+        queue->request_count--;
+        pthread_mutex_unlock(&queue->lock);
+
+        uint8_t *data = io_buffer(queue, slot->buffer);
+        if (slot->write) {
+            slot->result = io_pwrite_rest(slot->fd, data, slot->length, slot->offset, 0);
+        } else {
+            slot->result = io_pread_rest(slot->fd, data, slot->length, slot->offset, 0);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->completions[(queue->completion_head + queue->completion_count) % queue->entries] =
+            (int)(slot - queue->slots);
+        queue->completion_count++;
+        pthread_cond_signal(&queue->completion_ready);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static void io_uring_stop(IoQueue *queue) {
+    if (queue->sqes && queue->sqes != MAP_FAILED) {
+        munmap(queue->sqes, queue->sqes_size);
+    }
+    if (queue->cq_ring && queue->cq_ring != MAP_FAILED && queue->cq_ring != queue->sq_ring) {
+        munmap(queue->cq_ring, queue->cq_ring_size);
+    }
+    if (queue->sq_ring && queue->sq_ring != MAP_FAILED) {
+        munmap(queue->sq_ring, queue->sq_ring_size);
+    }
+    close(queue->ring_fd);
+}
+
+// Кольцо на entries операций и регистрация буферов. 0 - успех
+static int io_uring_start(IoQueue *queue) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    queue->ring_fd = syscall(__NR_io_uring_setup, queue->entries, &params);
+    if (queue->ring_fd < 0) {
+        return -1;
+    }
+    queue->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    queue->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && queue->cq_ring_size > queue->sq_ring_size) {
+        queue->sq_ring_size = queue->cq_ring_size;
+    }
+    queue->sq_ring = mmap(NULL, queue->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          queue->ring_fd, IORING_OFF_SQ_RING);
+    queue->cq_ring = single ? queue->sq_ring
+                            : mmap(NULL, queue->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   queue->ring_fd, IORING_OFF_CQ_RING);
+    queue->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    queue->sqes = mmap(NULL, queue->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, queue->ring_fd,
+                       IORING_OFF_SQES);
+    if (queue->sq_ring == MAP_FAILED || queue->cq_ring == MAP_FAILED || queue->sqes == MAP_FAILED) {
+        io_uring_stop(queue);
+        return -1;
+    }
+    queue->sq_head = (unsigned *)(queue->sq_ring + params.sq_off.head);
+    queue->sq_tail = (unsigned *)(queue->sq_ring + params.sq_off.tail);
+    queue->sq_mask = (unsigned *)(queue->sq_ring + params.sq_off.ring_mask);
+    queue->sq_array = (unsigned *)(queue->sq_ring + params.sq_off.array);
+    queue->cq_head = (unsigned *)(queue->cq_ring + params.cq_off.head);
+    queue->cq_tail = (unsigned *)(queue->cq_ring + params.cq_off.tail);
+    queue->cq_mask = (unsigned *)(queue->cq_ring + params.cq_off.ring_mask);
+    queue->cqes = (struct io_uring_cqe *)(queue->cq_ring + params.cq_off.cqes);
+
+    // Буферы регистрируются один раз: ядро не пинит страницы на каждую
+    // операцию. Не вышло (лимит memlock) - обычные READ/WRITE
+    struct iovec iov[IO_QUEUE_DEPTH];
+    for (int b = 0; b < queue->depth; b++) {
+        iov[b].iov_base = io_buffer(queue, b);
+        iov[b].iov_len = IO_BUFFER_SIZE;
+    }
+    queue->fixed = syscall(__NR_io_uring_register, queue->ring_fd, IORING_REGISTER_BUFFERS, iov, queue->depth) == 0;
+    return 0;
+}
+#endif
+
+// Очередь глубиной depth (не больше IO_QUEUE_DEPTH) буферов. Операций в
+// полете - до depth * (1 + MAX_REDUNDANCY): чтение и запись во все реплики
+void io_queue_init(IoQueue *queue, int depth) {
+    memset(queue, 0, sizeof(*queue));
+    queue->depth = depth;
+    queue->entries = depth * (1 + MAX_REDUNDANCY);
+    if (posix_memalign((void **)&queue->buffers, 4096, (size_t)depth * IO_BUFFER_SIZE) != 0) {
+        perror("Ошибка выделения памяти");
+        exit(EXIT_FAILURE);
+    }
+    queue->slots = calloc(queue->entries, sizeof(IoSlot));
+    queue->free_slots = malloc(queue->entries * sizeof(int));
+    for (unsigned s = 0; s < queue->entries; s++) {
+        queue->free_slots[s] = queue->entries - 1 - s;
+    }
+    queue->free_count = queue->entries;
+#ifdef HAVE_IO_URING
+    if (!io_force_threads && io_uring_state != 0) {
+        queue->uring = io_uring_start(queue) == 0;
+        io_uring_state = queue->uring;
+    }
+#endif
+    if (!queue->uring) {
+        queue->requests = malloc(queue->entries * sizeof(int));
+        queue->completions = malloc(queue->entries * sizeof(int));
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->request_ready, NULL);
+        pthread_cond_init(&queue->completion_ready, NULL);
+        queue->thread_count = depth < IO_MAX_THREADS ? depth : IO_MAX_THREADS;
+        for (int t = 0; t < queue->thread_count; t++) {
+            pthread_create(&queue->threads[t], NULL, io_thread, queue);
+        }
+    }
+}
+
+void io_queue_free(IoQueue *queue) {
+#ifdef HAVE_IO_URING
+    if (queue->uring) {
+        io_uring_stop(queue);
+    }
+#endif
+    if (!queue->uring) {
+        pthread_mutex_lock(&queue->lock);
+        queue->stop = 1;
+        pthread_cond_broadcast(&queue->request_ready);
+        pthread_mutex_unlock(&queue->lock);
+        for (int t = 0; t < queue->thread_count; t++) {
+            pthread_join(queue->threads[t], NULL);
+        }
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->request_ready);
+        pthread_cond_destroy(&queue->completion_ready);
+        free(queue->requests);
+        free(queue->completions);
+    }
+    free(queue->slots);
+    free(queue->free_slots);
+    free(queue->buffers);
+}
+
+// Название движка для отчетов
+static const char *io_engine_name(void) {
+    return !io_force_threads && io_uring_state == 1 ? "io_uring" : "потоки pread/pwrite";
+}
+
+// Постановка чтения (write = 0) в буфер b или записи из него: length байт
+// по смещению offset файла fd. Ядру io_uring заявки уходят пачкой в io_queue_wait
+void io_queue_submit(IoQueue *queue, int fd, int write, int b, size_t length, off_t offset, uint64_t tag) {
+    int s = queue->free_slots[--queue->free_count];
+    IoSlot *slot = &queue->slots[s];
+    slot->fd = fd;
+    slot->write = write;
+    slot->buffer = b;
+    slot->length = length;
+    slot->offset = offset;
+    slot->tag = tag;
+    queue->inflight++;
+#ifdef HAVE_IO_URING
+    if (queue->uring) {
+        unsigned tail = *queue->sq_tail, index = tail & *queue->sq_mask;
+        struct io_uring_sqe *sqe = &queue->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        if (queue->fixed) {
+            sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = b;
+        } else {
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)io_buffer(queue, b);
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = s;
+        queue->sq_array[index] = index;
+        __atomic_store_n(queue->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queue->pending++;
+        return;
+    }
+#endif
+    pthread_mutex_lock(&queue->lock);
+    queue->requests[(queue->request_head + queue->request_count) % queue->entries] = s;
+    queue->request_count++;
+    pthread_cond_signal(&queue->request_ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Ожидание любой завершенной операции (вызывающий следит, что в полете
+// хоть одна). Результат - число байт (чтение короче заказанного только в
+// конце файла, запись всегда дописывается до конца) или -errno.
+void io_queue_wait(IoQueue *queue, IoCompletion *completion) {
+    int s;
+#ifdef HAVE_IO_URING
+    if (queue->uring) {
+        for (;;) {
+            unsigned head = *queue->cq_head;
+            if (head != __atomic_load_n(queue->cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cq_mask];
+                s = (int)cqe->user_data;
+                queue->slots[s].result = cqe->res;
+                __atomic_store_n(queue->cq_head, head + 1, __ATOMIC_RELEASE);
+                break;
+            }
+            int submitted = syscall(__NR_io_uring_enter, queue->ring_fd, queue->pending, 1, IORING_ENTER_GETEVENTS,
+                                    NULL, 0);
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring");
+                exit(EXIT_FAILURE);
+            }
+            if (submitted > 0) {
+                queue->pending -= submitted;
+            }
+        }
+        // Короткие операции (сигнал, предел ядра) доделываются синхронно
+        IoSlot *slot = &queue->slots[s];
+        uint8_t *data = io_buffer(queue, slot->buffer);
+        if (slot->write && slot->result >= 0 && (size_t)slot->result < slot->length) {
+            slot->result = io_pwrite_rest(slot->fd, data, slot->length, slot->offset, slot->result);
+        } else if (slot->result > 0 && (size_t)slot->result < slot->length) {
+            slot->result = io_pread_rest(slot->fd, data, slot->length, slot->offset, slot->result);
+        }
+    } else
+#endif
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->completion_count == 0) {
+            pthread_cond_wait(&queue->completion_ready, &queue->lock);
+        }
+        s = queue->completions[queue->completion_head];
+        queue->completion_head = (queue->completion_head + 1) % queue->entries;
+        queue->completion_count--;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    completion->tag = queue->slots[s].tag;
+    completion->result = queue->slots[s].result;
+    queue->free_slots[queue->free_count++] = s;
+    queue->inflight--;
+}
+
+// Ядро или ФС не умеют reflink / copy_file_range для этих файлов -
+// дальше не пытаемся
+static int reflink_disabled = 0;
+static int copy_file_range_disabled = 0;
+
+// Копирование через copy_file_range; возвращает число скопированных байт
+static off_t copy_file_range_loop(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t length) {
+    off_t done = 0;
+    while (!copy_file_range_disabled && done < length) {
+        loff_t src = in_off + done, dst = out_off + done;
+        size_t chunk = length - done > (off_t)1 << 30 ? (size_t)1 << 30 : (size_t)(length - done);
+        ssize_t copied = copy_file_range(in_fd, &src, out_fd, &dst, chunk, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied < 0) {
+            if (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP) {
+                copy_file_range_disabled = 1;
+            }
+            break;
+        }
+        if (copied == 0) {
+            break;
+        }
+        done += copied;
+    }
+    return done;
+}
+
+// Копирование диапазона силами ядра: выровненная по блокам середина через
+// reflink (FICLONERANGE на XFS/Btrfs - только метаданные), остальное через
+// copy_file_range. Возвращает длину скопированного с начала диапазона;
+// если меньше length, остаток копирует вызывающий.
+off_t kernel_copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t length) {
+    off_t head = length, body = 0;
+#ifdef FICLONERANGE
+    struct stat st;
+    off_t block = (fstat(out_fd, &st) == 0 && st.st_blksize > 0) ? st.st_blksize : 4096;
+    if (!reflink_disabled && in_off % block == out_off % block) {
+        head = (block - in_off % block) % block;
+        if (head > length) {
+            head = length;
+        }
+        body = (length - head) / block * block;
+        if (body > 0) {
+            struct file_clone_range range = {
+                .src_fd = in_fd,
+                .src_offset = in_off + head,
+                .src_length = body,
+                .dest_offset = out_off + head,
+            };
+            if (ioctl(out_fd, FICLONERANGE, &range) != 0) {
+                if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY) {
+                    reflink_disabled = 1;
+                }
+                head = length;
+                body = 0;
+            }
+        }
+    }
+#endif
+    off_t done = copy_file_range_loop(in_fd, in_off, out_fd, out_off, head);
+    if (done < head) {
+        return done;
+    }
+    done += body;
+    return done + copy_file_range_loop(in_fd, in_off + done, out_fd, out_off + done, length - done);
+}
+
+// Копирование диапазона между файлами: сначала силами ядра, остаток -
+// через pread/pwrite и buffer размером VERIFY_BUFFER_SIZE
+int copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off, off_t length, uint8_t *buffer) {
+    off_t done = kernel_copy_range(in_fd, in_off, out_fd, out_off, length);
+    while (done < length) {
+        size_t chunk = length - done > VERIFY_BUFFER_SIZE ? VERIFY_BUFFER_SIZE : (size_t)(length - done);
+        ssize_t bytes_read = pread(in_fd, buffer, chunk, in_off + done);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        pwrite_full(out_fd, buffer, bytes_read, out_off + done);
+        done += bytes_read;
+    }
+    return 0;
+}
+
+// Зазор между копиями (шардами) одной записи: одна испорченная область
+// диска до этой длины задевает не больше одной копии. Для маленьких копий
+// зазор равен их размеру, но не меньше REPLICA_MIN_DISTANCE, иначе пачка из
+// крошечных файлов раздувается добивкой полос до мегабайтов.
+#define REPLICA_DISTANCE (4 * 1024 * 1024)
+#define REPLICA_MIN_DISTANCE (64 * 1024)
+
+static off_t replica_distance(off_t size) {
+    return size >= REPLICA_DISTANCE ? REPLICA_DISTANCE : size > REPLICA_MIN_DISTANCE ? size : REPLICA_MIN_DISTANCE;
+}
+
+// Диапазон [offset, offset + size) не ближе replica_distance к копиям
+// copies[0..count), кроме copies[skip], пустых и еще не размещенных
+static int copies_apart(off_t offset, off_t size, const FileCopyMeta *copies, int count, int skip) {
+    for (int k = 0; k < count; k++) {
+        off_t distance = replica_distance(size > copies[k].size ? size : copies[k].size);
+        if (k != skip && copies[k].size > 0 && copies[k].offset > 0 &&
+            offset < copies[k].offset + copies[k].size + distance &&
+            copies[k].offset < offset + size + distance) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Наименьшее смещение не ниже start, с которого size байт помещаются до end
+// и лежат не ближе replica_distance к копиям copies[0..count), кроме
+// copies[skip]. Проверяются начало промежутка и места сразу за зазором от
+// каждой копии. Возвращает смещение или -1.
+static off_t apart_offset(off_t start, off_t end, off_t size, const FileCopyMeta *copies, int count, int skip) {
+    off_t best = -1;
+    for (int k = -1; k < count; k++) {
+        off_t candidate = start;
+        if (k >= 0) {
+            if (k == skip || copies[k].size == 0 || copies[k].offset == 0) {
+                continue;
+            }
+            candidate = copies[k].offset + copies[k].size +
+                        replica_distance(size > copies[k].size ? size : copies[k].size);
+            candidate = candidate > start ? candidate : start;
+        }
+        if (candidate + size <= end && (best < 0 || candidate < best) &&
+            copies_apart(candidate, size, copies, count, skip)) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+// Свободный промежуток в области данных архива
+typedef struct {
+    off_t offset;
+    off_t size;
+    int next;       // следующий промежуток в той же корзине размера
+} Extent;
+
+// Карта свободного места. Хранится в конце метаданных (после записей файлов)
+// отсортированной по смещению; в памяти промежутки дополнительно разложены
+// по корзинам размера [2^k, 2^(k+1)) для поиска наилучшего подходящего.
+#define FREE_MAP_MAGIC 0x50414D46 // "FMAP"
+#define FREE_MAP_BUCKETS 64
+
+typedef struct {
+    Extent *extents;
+    int count;
+    int capacity;
+    int buckets[FREE_MAP_BUCKETS];
+} FreeMap;
+
+// Сборка метаданных в памяти перед записью
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+static uint8_t *buffer_grow(ByteBuffer *buffer, size_t length) {
+    if (buffer->size + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->size + length) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    uint8_t *p = buffer->data + buffer->size;
+    buffer->size += length;
+    return p;
+}
+
+void buffer_bytes(ByteBuffer *buffer, const void *data, size_t length) {
+    memcpy(buffer_grow(buffer, length), data, length);
+}
+
+void buffer_u8(ByteBuffer *buffer, uint8_t value) {
+    *buffer_grow(buffer, 1) = value;
+}
+
+// Целые фиксированной ширины - в little-endian
+void buffer_le32(ByteBuffer *buffer, uint32_t value) {
+    uint8_t *p = buffer_grow(buffer, 4);
+    for (int i = 0; i < 4; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+void buffer_le64(ByteBuffer *buffer, uint64_t value) {
+    uint8_t *p = buffer_grow(buffer, 8);
+    for (int i = 0; i < 8; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+// varint: по 7 бит, младшие первыми, старший бит - продолжение
+void buffer_varint(ByteBuffer *buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer_u8(buffer, (uint8_t)value | 0x80);
+        value >>= 7;
+    }
+    buffer_u8(buffer, (uint8_t)value);
+}
+
+// Знаковые разности кодируются zigzag: 0, -1, 1, -2... -> 0, 1, 2, 3...
+static inline uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Разбор метаданных из памяти; выход за границу взводит error, после чего
+// все чтения возвращают 0
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    int error;
+} ByteReader;
+
+const uint8_t *reader_bytes(ByteReader *reader, size_t length) {
+    if (reader->error || (size_t)(reader->end - reader->p) < length) {
+        reader->error = 1;
+        return NULL;
+    }
+    const uint8_t *p = reader->p;
+    reader->p += length;
+    return p;
+}
+
+uint8_t reader_u8(ByteReader *reader) {
+    const uint8_t *p = reader_bytes(reader, 1);
+    return p ? p[0] : 0;
+}
+
+uint32_t reader_le32(ByteReader *reader) {
+    const uint8_t *p = reader_bytes(reader, 4);
+    return p ? load_le32(p) : 0;
+}
+
+uint64_t reader_le64(ByteReader *reader) {
+    const uint8_t *p = reader_bytes(reader, 8);
+    return p ? load_le64(p) : 0;
+}
+
+uint64_t reader_varint(ByteReader *reader) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = reader_u8(reader);
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    reader->error = 1;
+    return 0;
+}
+
+// Чтение целых фиксированной ширины из файла (метаданные v1)
+int get_le32(FILE *file, uint32_t *value) {
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, file) != 4) {
+        return -1;
+    }
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        *value |= (uint32_t)bytes[i] << (8 * i);
+    }
+    return 0;
+}
+
+int get_le64(FILE *file, uint64_t *value) {
+    uint8_t bytes[8];
+    if (fread(bytes, 1, 8, file) != 8) {
+        return -1;
+    }
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        *value |= (uint64_t)bytes[i] << (8 * i);
+    }
+    return 0;
+}
+
+void free_map_add(FreeMap *map, off_t offset, off_t size) {
+    if (size <= 0) {
+        return;
+    }
+    if (map->count == map->capacity) {
+        map->capacity = map->capacity ? map->capacity * 2 : 64;
+        map->extents = realloc(map->extents, map->capacity * sizeof(Extent));
+    }
+    map->extents[map->count].offset = offset;
+    map->extents[map->count].size = size;
+    map->extents[map->count].next = -1;
+    map->count++;
+}
+
+void free_free_map(FreeMap *map) {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = map->capacity = 0;
+}
+
+static int compare_extent_offset(const void *a, const void *b) {
+    off_t x = ((const Extent *)a)->offset, y = ((const Extent *)b)->offset;
+    return (x > y) - (x < y);
+}
+
+static int size_bucket(off_t size) {
+    return 63 - __builtin_clzll((unsigned long long)size);
+}
+
+static void bucket_insert(FreeMap *map, int index) {
+    int bucket = size_bucket(map->extents[index].size);
+    map->extents[index].next = map->buckets[bucket];
+    map->buckets[bucket] = index;
+}
+
+static void bucket_remove(FreeMap *map, int index) {
+    int *link = &map->buckets[size_bucket(map->extents[index].size)];
+    while (*link != index) {
+        link = &map->extents[*link].next;
+    }
+    *link = map->extents[index].next;
+}
+
+// Сортировка по смещению, слияние соседних промежутков, раскладка по корзинам
+void free_map_normalize(FreeMap *map) {
+    // В пустой карте extents == NULL, а qsort требует ненулевой указатель
+    if (map->count > 1) {
+        qsort(map->extents, map->count, sizeof(Extent), compare_extent_offset);
+    }
+    int merged = 0;
+    for (int i = 0; i < map->count; i++) {
+        if (merged > 0 && map->extents[merged - 1].offset + map->extents[merged - 1].size >= map->extents[i].offset) {
+            off_t end = map->extents[i].offset + map->extents[i].size;
+            if (end > map->extents[merged - 1].offset + map->extents[merged - 1].size) {
+                map->extents[merged - 1].size = end - map->extents[merged - 1].offset;
+            }
+        } else {
+            map->extents[merged++] = map->extents[i];
+        }
+    }
+    map->count = merged;
+
+    for (int b = 0; b < FREE_MAP_BUCKETS; b++) {
+        map->buckets[b] = -1;
+    }
+    for (int i = 0; i < map->count; i++) {
+        bucket_insert(map, i);
+    }
+}
+
+// Выделение size байт в наименьшем подходящем промежутке, начало которого
+// не ближе replica_distance к уже размещенным копиям placed[0..placed_count)
+// этой же записи. Место берется с начала промежутка. Возвращает смещение или -1.
+off_t free_map_alloc(FreeMap *map, off_t size, const FileCopyMeta *placed, int placed_count) {
+    if (size <= 0) {
+        return -1;
+    }
+    int best = -1;
+    for (int b = size_bucket(size); b < FREE_MAP_BUCKETS && best < 0; b++) {
+        for (int i = map->buckets[b]; i >= 0; i = map->extents[i].next) {
+            if (map->extents[i].size < size || (best >= 0 && map->extents[i].size >= map->extents[best].size)) {
+                continue;
+            }
+            if (copies_apart(map->extents[i].offset, size, placed, placed_count, -1)) {
+                best = i;
+            }
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+
+    Extent *extent = &map->extents[best];
+    off_t offset = extent->offset;
+    bucket_remove(map, best);
+    extent->offset += size;
+    extent->size -= size;
+    if (extent->size > 0) {
+        bucket_insert(map, best);
+    }
+    return offset;
+}
+
+void encode_free_map(ByteBuffer *out, const FreeMap *map) {
+    uint32_t count = 0;
+    for (int i = 0; i < map->count; i++) {
+        count += map->extents[i].size > 0;
+    }
+    buffer_le32(out, FREE_MAP_MAGIC);
+    buffer_le32(out, count);
+    for (int i = 0; i < map->count; i++) {
+        if (map->extents[i].size > 0) {
+            buffer_le64(out, map->extents[i].offset);
+            buffer_le64(out, map->extents[i].size);
+        }
+    }
+}
+
+void decode_free_map(ByteReader *in, FreeMap *map) {
+    map->count = 0;
+    if (reader_le32(in) == FREE_MAP_MAGIC) {
+        uint32_t count = reader_le32(in);
+        for (uint32_t i = 0; i < count && !in->error; i++) {
+            uint64_t offset = reader_le64(in);
+            uint64_t size = reader_le64(in);
+            if (!in->error) {
+                free_map_add(map, offset, size);
+            }
+        }
+    }
+    free_map_normalize(map);
+}
+
+// Чтение карты сразу после записей файлов (метаданные v1). В архивах без
+// карты там конец файла - карта остается пустой.
+void read_free_map(FILE *arch, FreeMap *map) {
+    uint32_t magic, count;
+    map->count = 0;
+    if (get_le32(arch, &magic) != 0 || magic != FREE_MAP_MAGIC || get_le32(arch, &count) != 0) {
+        free_map_normalize(map);
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t offset, size;
+        if (get_le64(arch, &offset) != 0 || get_le64(arch, &size) != 0) {
+            break;
+        }
+        free_map_add(map, offset, size);
+    }
+    free_map_normalize(map);
+}
+
+// Перенос реплик надгробий в карту свободного места; сами надгробия
+// удаляются из каталога
+void reclaim_tombstones(Catalog *catalog, FreeMap *map) {
+    for (int i = 0; i < catalog->count; i++) {
+        if (is_tombstone(catalog, i)) {
+            const FileCopyMeta *copies = entry_copies(catalog, i);
+            for (int j = 0; j < catalog->entries[i].copies; j++) {
+                free_map_add(map, copies[j].offset, copies[j].size);
+            }
+        }
+    }
+    catalog_drop_tombstones(catalog);
+    free_map_normalize(map);
+}
+
+// Чтение архива через отображение в память (опция -M)
+static int use_mmap = 0;
+
+// Кодек и уровень LZ новых записей -c и -a (опция -z)
+static int archive_codec = CODEC_LZ;
+static int archive_level = LZ_DEFAULT_LEVEL;
+
+// Дедупликация новых записей -c и -a (опция -D)
+static int archive_dedup = 0;
+
+// Упаковка -c и -a мимо кэша страниц (опция -direct)
+static int bulk_direct = 0;
+
+// Код Рида-Соломона вместо реплик новых записей -c и -a (-b k+m): число
+// шардов данных k, 0 - полные реплики
+static int archive_data_shards = 0;
+
+// Архив, открытый на чтение: данные реплик берутся либо прямо из
+// отображения, либо через pread в буфер вызывающего, либо (для длинных
+// диапазонов) через очередь асинхронного чтения, если она задана
+typedef struct {
+    int fd;
+    uint8_t *map;
+    off_t size;
+    IoQueue *queue;
+} ArchiveView;
+
+// Чтение length байт по смещению; возвращает число прочитанных байт или -1
+static ssize_t view_read(ArchiveView *view, void *buffer, size_t length, off_t offset) {
+    if (offset < 0 || offset > view->size) {
+        return -1;
+    }
+    if (view->map) {
+        if ((off_t)length > view->size - offset) {
+            length = view->size - offset;
+        }
+        memcpy(buffer, view->map + offset, length);
+        return length;
+    }
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytes_read = pread(view->fd, (uint8_t *)buffer + done, length - done, offset + done);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        done += bytes_read;
+    }
+    return done;
+}
+
+// Подсказка ядру: диапазон реплики будет прочитан целиком и последовательно
+static void view_advise(ArchiveView *view, off_t offset, off_t length) {
+    if (!view->map || length <= 0) {
+        return;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(off_t)(page - 1);
+    madvise(view->map + start, length + (offset - start), MADV_SEQUENTIAL);
+    madvise(view->map + start, length + (offset - start), MADV_WILLNEED);
+}
+
+typedef void (*ScanConsumer)(void *ctx, const uint8_t *data, size_t length);
+
+// Чтение диапазона архива через очередь: до depth чтений по IO_BUFFER_SIZE
+// в полете, готовые куски отдаются consume строго по порядку
+static int view_scan_queued(ArchiveView *view, off_t offset, off_t length, ScanConsumer consume, void *ctx) {
+    IoQueue *queue = view->queue;
+    off_t start[IO_QUEUE_DEPTH];
+    ssize_t got[IO_QUEUE_DEPTH];
+    int state[IO_QUEUE_DEPTH] = {0};  // 0 - свободен, 1 - читается, 2 - прочитан
+    off_t next = 0, done = 0;
+    int status = 0;
+    for (;;) {
+        for (int b = 0; b < queue->depth && next < length && status == 0; b++) {
+            if (state[b] == 0) {
+                size_t to_read = length - next > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : (size_t)(length - next);
+                io_queue_submit(queue, view->fd, 0, b, to_read, offset + next, b);
+                start[b] = next;
+                state[b] = 1;
+                next += to_read;
+            }
+        }
+        if (queue->inflight == 0) {
+            break;
+        }
+        IoCompletion completion;
+        io_queue_wait(queue, &completion);
+        got[completion.tag] = completion.result;
+        state[completion.tag] = 2;
+        for (int b = 0; b < queue->depth && status == 0; b++) {
+            if (state[b] != 2 || start[b] != done) {
+                continue;
+            }
+            size_t expected = length - done > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : (size_t)(length - done);
+            if (got[b] != (ssize_t)expected) {
+                status = -1;
+                break;
+            }
+            consume(ctx, io_buffer(queue, b), expected);
+            done += expected;
+            state[b] = 0;
+            b = -1;
+        }
+    }
+    return status;
+}
+
+// Диапазон архива по порядку кусками в consume: прямо из отображения,
+// через очередь или через buffer размером VERIFY_BUFFER_SIZE. 0 - успех,
+// -1 - ошибка чтения
+static int view_scan(ArchiveView *view, off_t offset, off_t length, uint8_t *buffer, ScanConsumer consume,
+                     void *ctx) {
+    if (length == 0) {
+        // Пустая копия цела при любом смещении
+        return 0;
+    }
+    if (offset < 0 || length < 0 || offset > view->size || length > view->size - offset) {
+        return -1;
+    }
+    if (view->map) {
+        view_advise(view, offset, length);
+        consume(ctx, view->map + offset, length);
+        return 0;
+    }
+    if (view->queue && length > VERIFY_BUFFER_SIZE) {
+        return view_scan_queued(view, offset, length, consume, ctx);
+    }
+    off_t done = 0;
+    while (done < length) {
+        size_t to_read = length - done > VERIFY_BUFFER_SIZE ? VERIFY_BUFFER_SIZE : (size_t)(length - done);
+        ssize_t bytes_read = view_read(view, buffer, to_read, offset + done);
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        consume(ctx, buffer, bytes_read);
+        done += bytes_read;
+    }
+    return 0;
+}
+
+static void crc_consume(void *ctx, const uint8_t *data, size_t length) {
+    *(uint32_t *)ctx = crc32_update(*(uint32_t *)ctx, data, length);
+}
+
+static void block_crcs_consume(void *ctx, const uint8_t *data, size_t length) {
+    block_crcs_update((BlockCrcs *)ctx, data, length);
+}
+
+// CRC32 диапазона архива. 0 - успех, -1 - ошибка чтения
+int view_crc32(ArchiveView *view, off_t offset, off_t length, uint8_t *buffer, uint32_t *crc_out) {
+    uint32_t crc = 0;
+    if (view_scan(view, offset, length, buffer, crc_consume, &crc) != 0) {
+        return -1;
+    }
+    *crc_out = crc;
+    return 0;
+}
+
+// Копирование диапазона архива в out_fd через очередь: чтения и записи идут
+// вперемешку на всю ее глубину, порядок не важен - буфер пишется по тому же
+// смещению, с которого прочитан. 0 - успех, -1 - ошибка чтения или записи
+static int view_copy_queued(ArchiveView *view, off_t offset, off_t length, int out_fd, off_t out_offset) {
+    IoQueue *queue = view->queue;
+    off_t start[IO_QUEUE_DEPTH];
+    int state[IO_QUEUE_DEPTH] = {0};  // 0 - свободен, 1 - читается, 2 - пишется
+    off_t next = 0;
+    int status = 0;
+    for (;;) {
+        for (int b = 0; b < queue->depth && next < length && status == 0; b++) {
+            if (state[b] == 0) {
+                size_t to_read = length - next > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : (size_t)(length - next);
+                io_queue_submit(queue, view->fd, 0, b, to_read, offset + next, b);
+                start[b] = next;
+                state[b] = 1;
+                next += to_read;
+            }
+        }
+        if (queue->inflight == 0) {
+            break;
+        }
+        IoCompletion completion;
+        io_queue_wait(queue, &completion);
+        int b = completion.tag;
+        size_t expected = length - start[b] > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : (size_t)(length - start[b]);
+        if (completion.result != (ssize_t)expected) {
+            status = -1;
+            state[b] = 0;
+        } else if (state[b] == 1 && status == 0) {
+            io_queue_submit(queue, out_fd, 1, b, expected, out_offset + start[b], b);
+            state[b] = 2;
+        } else {
+            state[b] = 0;
+        }
+    }
+    return status;
+}
+
+// Запись диапазона архива в файл out_fd по смещению out_offset. Сначала
+// пробуем копирование силами ядра, остаток пишем из отображения, через
+// очередь или через buffer
+int view_copy_out(ArchiveView *view, off_t offset, off_t length, int out_fd, off_t out_offset, uint8_t *buffer) {
+    if (length == 0) {
+        return 0;
+    }
+    if (offset < 0 || length < 0 || offset > view->size || length > view->size - offset) {
+        return -1;
+    }
+    off_t done = kernel_copy_range(view->fd, offset, out_fd, out_offset, length);
+    if (done < length && view->queue && !view->map && length - done > VERIFY_BUFFER_SIZE) {
+        return view_copy_queued(view, offset + done, length - done, out_fd, out_offset + done);
+    }
+    while (done < length) {
+        const uint8_t *data;
+        size_t chunk = length - done > VERIFY_BUFFER_SIZE ? VERIFY_BUFFER_SIZE : (size_t)(length - done);
+        if (view->map) {
+            data = view->map + offset + done;
+        } else {
+            ssize_t bytes_read = view_read(view, buffer, chunk, offset + done);
+            if (bytes_read <= 0) {
+                return -1;
+            }
+            chunk = bytes_read;
+            data = buffer;
+        }
+        ssize_t written = pwrite(out_fd, data, chunk, out_offset + done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+// Распаковка сжатого образа из архива в файл out_fd по смещению out_offset.
+// Блоки нулей не пишутся, файл получается разреженным. 0 - успех, -1 -
+// ошибка чтения или записи или поврежденный образ.
+int view_unpack_out(ArchiveView *view, off_t offset, off_t length, off_t raw_size, int out_fd, off_t out_offset) {
+    if (offset < 0 || length < 0 || offset > view->size || length > view->size - offset) {
+        return -1;
+    }
+    uint8_t *packed = malloc(HUFFMAN_BLOCK_BOUND(HUFFMAN_BLOCK_SIZE));
+    uint8_t *block = malloc(HUFFMAN_BLOCK_SIZE + 1);
+    off_t position = offset, end = offset + length, done = 0;
+    int status = 0;
+    while (status == 0 && done < raw_size) {
+        uint8_t head[4];
+        size_t raw = raw_size - done > HUFFMAN_BLOCK_SIZE ? HUFFMAN_BLOCK_SIZE : (size_t)(raw_size - done);
+        if (end - position < 4 || view_read(view, head, 4, position) != 4) {
+            status = -1;
+            break;
+        }
+        uint32_t packed_size = load_le32(head);
+        position += 4;
+        if (packed_size > HUFFMAN_BLOCK_BOUND(HUFFMAN_BLOCK_SIZE) || packed_size > end - position ||
+            view_read(view, packed, packed_size, position) != (ssize_t)packed_size) {
+            status = -1;
+            break;
+        }
+        position += packed_size;
+        if (packed_size == 2 && packed[0] == HUFFMAN_BLOCK_RUN && packed[1] == 0) {
+            done += raw;
+            continue;
+        }
+        if (huffman_unpack_block(packed, packed_size, block, raw) != 0) {
+            status = -1;
+            break;
+        }
+        for (size_t written_total = 0; written_total < raw;) {
+            ssize_t written = pwrite(out_fd, block + written_total, raw - written_total,
+                                     out_offset + done + written_total);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                status = -1;
+                break;
+            }
+            written_total += written;
+        }
+        done += raw;
+    }
+    if (status == 0 && (position != end || ftruncate(out_fd, out_offset + raw_size) != 0)) {
+        status = -1;
+    }
+    free(packed);
+    free(block);
+    return status;
+}
+
+void close_archive_view(ArchiveView *view) {
+    if (view->map) {
+        munmap(view->map, view->size);
+        view->map = NULL;
+    }
+    if (view->fd >= 0) {
+        close(view->fd);
+        view->fd = -1;
+    }
+}
+
+// Заголовок архива (первые ARCHIVE_HEADER_SIZE байт).
+// v1: смещение метаданных (long) и число файлов (int) в порядке байт
+//     машины; метаданные - сырые FileMeta до copy_meta и FileCopyMeta.
+// v2: смещение метаданных (le64) и ARCHIVE_MAGIC; число файлов - в начале
+//     метаданных.
+typedef struct {
+    int version;
+    long meta_offset;
+    int file_count;
+} ArchiveHeader;
+
+int read_archive_header(ArchiveView *view, ArchiveHeader *header) {
+    uint8_t raw[ARCHIVE_HEADER_SIZE];
+    if (view_read(view, raw, sizeof(raw), 0) != sizeof(raw)) {
+        return -1;
+    }
+    if (load_le32(raw + 8) == ARCHIVE_MAGIC) {
+        uint8_t head[FOOTER_HEAD_SIZE];
+        uint64_t meta_offset = load_le64(raw);
+        if (meta_offset < ARCHIVE_HEADER_SIZE || meta_offset + FOOTER_HEAD_SIZE > (uint64_t)view->size ||
+            view_read(view, head, sizeof(head), meta_offset) != sizeof(head) ||
+            (load_le32(head) != FOOTER_MAGIC && load_le32(head) != FOOTER_MAGIC_CODECS &&
+             load_le32(head) != FOOTER_MAGIC_CHUNKS && load_le32(head) != FOOTER_MAGIC_ERASURE &&
+             load_le32(head) != FOOTER_MAGIC_BLOCKS) ||
+            load_le32(head + 4) > INT_MAX || load_le32(head + 8) == 0 ||
+            load_le32(head + 4) > (uint64_t)view->size - meta_offset - FOOTER_HEAD_SIZE) {
+            // Запись занимает хотя бы байт: больше записей в метаданных не поместится
+            return -1;
+        }
+        header->version = 2;
+        header->meta_offset = meta_offset;
+        header->file_count = load_le32(head + 4);
+        return 0;
+    }
+
+    long meta_offset;
+    int count;
+    memcpy(&meta_offset, raw, sizeof(long));
+    memcpy(&count, raw + sizeof(long), sizeof(int));
+    if (meta_offset < ARCHIVE_HEADER_SIZE || meta_offset > view->size || count < 0 ||
+        (uint64_t)count > (uint64_t)(view->size - meta_offset) / offsetof(FileMeta, copy_meta)) {
+        return -1;
+    }
+    header->version = 1;
+    header->meta_offset = meta_offset;
+    header->file_count = count;
+    return 0;
+}
+
+// Открытие архива на чтение, только заголовок. При use_mmap весь архив
+// отображается в память. Возвращает 0 или -1 при ошибке.
+int open_archive_header(const char *archive_name, ArchiveView *view, ArchiveHeader *header) {
+    struct stat st;
+    view->map = NULL;
+    view->queue = NULL;
+    view->fd = open(archive_name, O_RDONLY);
+    if (view->fd < 0 || fstat(view->fd, &st) != 0) {
+        perror("Ошибка открытия архива");
+        return -1;
+    }
+    view->size = st.st_size;
+
+    if (use_mmap && view->size > 0 && (uint64_t)view->size <= SIZE_MAX) {
+        void *map = mmap(NULL, view->size, PROT_READ, MAP_SHARED, view->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Ошибка отображения архива, чтение через pread");
+        } else {
+            view->map = map;
+        }
+    }
+
+    if (read_archive_header(view, header) != 0) {
+        printf("Ошибка чтения заголовка архива!\n");
+        close_archive_view(view);
+        return -1;
+    }
+    return 0;
+}
+
+// Метаданные v2:
+//   "MET2" ("MET3", если есть сжатые записи, "MET4" - куски), число записей,
+//   интервал перезапуска, 0   (le32 каждое)
+//   записи
+//   карта свободного места (FMAP)
+//   индекс имен (NIDX)
+// Запись: байт флагов (ENTRY_DELETED пишется на месте при удалении), имя
+// с общим с предыдущей записью префиксом (varint длина префикса, varint
+// длина остатка, остаток), mode, uid, gid, разности atime и mtime с
+// предыдущей записью, у сжатой записи (ENTRY_COMPRESSED) - кодек и размер
+// до сжатия, у файла из кусков (ENTRY_CHUNKED) - размер файла и число
+// кусков, у записи с кодом Рида-Соломона (ENTRY_ERASURE) - число шардов
+// данных и длина образа, число копий << 1 | COPIES_UNIFORM, затем копии: CRC (le32) и
+// размер - один раз, если у всех копий они совпадают, и разность смещения
+// с концом предыдущей копии, затем номера записей кусков (первый - varint,
+// остальные - zigzag разности с предыдущим + 1), затем у записи с
+// ENTRY_BLOCK_CRCS таблицы CRC блоков (le32, число блоков следует из размера
+// копии): одна у реплик, по одной на шард у кода k+m. Запись куска (ENTRY_CHUNK)
+// вместо имени и атрибутов хранит SHA-256 содержимого (32 байта), дальше -
+// как у файла. Каждые RESTART_INTERVAL записей все разности начинаются
+// заново, так что любой блок разбирается отдельно.
+typedef struct {
+    char name[256];
+    size_t name_length;
+    off_t cursor;
+    int64_t atime;
+    int64_t mtime;
+} EntryCodec;
+
+static void entry_codec_reset(EntryCodec *codec) {
+    codec->name_length = 0;
+    codec->cursor = ARCHIVE_HEADER_SIZE;
+    codec->atime = 0;
+    codec->mtime = 0;
+}
+
+static void encode_entry(ByteBuffer *out, const Catalog *catalog, int i, EntryCodec *codec) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    buffer_u8(out, entry->flags & (ENTRY_DELETED | ENTRY_COMPRESSED | ENTRY_CHUNK | ENTRY_CHUNKED | ENTRY_ERASURE |
+                                   ENTRY_BLOCK_CRCS));
+    if (is_chunk(catalog, i)) {
+        buffer_bytes(out, chunk_digest(catalog, i), CHUNK_DIGEST_SIZE);
+    } else {
+        const char *name = entry_name(catalog, i);
+        size_t length = strnlen(name, sizeof(codec->name) - 1);
+        size_t shared = 0;
+        while (shared < length && shared < codec->name_length && name[shared] == codec->name[shared]) {
+            shared++;
+        }
+        buffer_varint(out, shared);
+        buffer_varint(out, length - shared);
+        buffer_bytes(out, name + shared, length - shared);
+        memcpy(codec->name, name, length);
+        codec->name_length = length;
+
+        buffer_varint(out, entry->mode);
+        buffer_varint(out, entry->uid);
+        buffer_varint(out, entry->gid);
+        buffer_varint(out, zigzag_encode((int64_t)entry->atime - codec->atime));
+        buffer_varint(out, zigzag_encode((int64_t)entry->mtime - codec->mtime));
+        codec->atime = entry->atime;
+        codec->mtime = entry->mtime;
+    }
+    if (entry->flags & ENTRY_COMPRESSED) {
+        buffer_varint(out, entry->codec);
+        buffer_varint(out, entry->raw_size);
+    }
+    if (entry->flags & ENTRY_CHUNKED) {
+        buffer_varint(out, entry->raw_size);
+        buffer_varint(out, entry->chunks);
+    }
+    if (entry->flags & ENTRY_ERASURE) {
+        buffer_varint(out, entry->data_shards);
+        buffer_varint(out, entry->image_size);
+    }
+
+    const FileCopyMeta *copies = entry_copies(catalog, i);
+    int uniform = 1;
+    for (int j = 1; j < entry->copies; j++) {
+        if (copies[j].crc != copies[0].crc || copies[j].size != copies[0].size) {
+            uniform = 0;
+        }
+    }
+    buffer_varint(out, ((uint64_t)entry->copies << 1) | uniform);
+    for (int j = 0; j < entry->copies; j++) {
+        if (j == 0 || !uniform) {
+            buffer_le32(out, copies[j].crc);
+            buffer_varint(out, copies[j].size);
+        }
+        buffer_varint(out, zigzag_encode(copies[j].offset - codec->cursor));
+        codec->cursor = copies[j].offset + copies[j].size;
+    }
+    const uint32_t *refs = entry_chunks(catalog, i);
+    for (uint32_t k = 0; k < entry->chunks; k++) {
+        buffer_varint(out, k == 0 ? refs[0] : zigzag_encode((int64_t)refs[k] - refs[k - 1] - 1));
+    }
+    if (entry->flags & ENTRY_BLOCK_CRCS) {
+        const uint32_t *table = entry_block_crcs(catalog, i, 0);
+        for (size_t b = 0; b < (size_t)entry->blocks * (entry->flags & ENTRY_ERASURE ? entry->copies : 1); b++) {
+            buffer_le32(out, table[b]);
+        }
+    }
+}
+
+// Разбор записи в конец каталога. Возвращает ее номер или -1
+static int decode_entry(ByteReader *in, Catalog *catalog, EntryCodec *codec) {
+    uint8_t flags = reader_u8(in);
+    if ((flags & ~(ENTRY_DELETED | ENTRY_COMPRESSED | ENTRY_CHUNK | ENTRY_CHUNKED | ENTRY_ERASURE |
+                   ENTRY_BLOCK_CRCS)) ||
+        ((flags & ENTRY_CHUNKED) && (flags & (ENTRY_CHUNK | ENTRY_COMPRESSED))) ||
+        ((flags & ENTRY_ERASURE) && (flags & (ENTRY_CHUNK | ENTRY_CHUNKED)))) {
+        return -1;
+    }
+    const uint8_t *digest = NULL;
+    uint64_t mode = 0, uid = 0, gid = 0;
+    if (flags & ENTRY_CHUNK) {
+        digest = reader_bytes(in, CHUNK_DIGEST_SIZE);
+        if (!digest) {
+            return -1;
+        }
+    } else {
+        uint64_t shared = reader_varint(in);
+        uint64_t suffix = reader_varint(in);
+        if (shared > codec->name_length || shared + suffix >= sizeof(codec->name)) {
+            return -1;
+        }
+        const uint8_t *bytes = reader_bytes(in, suffix);
+        if (!bytes) {
+            return -1;
+        }
+        memcpy(codec->name + shared, bytes, suffix);
+        codec->name_length = shared + suffix;
+
+        mode = reader_varint(in);
+        uid = reader_varint(in);
+        gid = reader_varint(in);
+        codec->atime += zigzag_decode(reader_varint(in));
+        codec->mtime += zigzag_decode(reader_varint(in));
+    }
+    uint64_t entry_codec = CODEC_STORED, raw_size = 0, chunks = 0;
+    if (flags & ENTRY_COMPRESSED) {
+        entry_codec = reader_varint(in);
+        raw_size = reader_varint(in);
+        if (entry_codec < CODEC_HUFFMAN || entry_codec > CODEC_RANS || raw_size > INT64_MAX) {
+            return -1;
+        }
+    }
+    if (flags & ENTRY_CHUNKED) {
+        raw_size = reader_varint(in);
+        chunks = reader_varint(in);
+        if (raw_size > INT64_MAX || chunks > UINT32_MAX) {
+            return -1;
+        }
+    }
+    uint64_t data_shards = 0, image_size = 0;
+    if (flags & ENTRY_ERASURE) {
+        data_shards = reader_varint(in);
+        image_size = reader_varint(in);
+    }
+    uint64_t copies = reader_varint(in);
+    int uniform = copies & COPIES_UNIFORM;
+    copies >>= 1;
+    if (in->error || copies > MAX_REDUNDANCY || ((flags & ENTRY_CHUNKED) && copies != 0) ||
+        ((flags & ENTRY_ERASURE) && (data_shards < 1 || data_shards >= copies)) ||
+        ((flags & ENTRY_BLOCK_CRCS) && (copies == 0 || (!uniform && !(flags & ENTRY_ERASURE))))) {
+        return -1;
+    }
+
+    int n = digest ? catalog_add(catalog, (const char *)digest, CHUNK_DIGEST_SIZE, copies)
+                   : catalog_add(catalog, codec->name, codec->name_length, copies);
+    CatalogEntry *entry = &catalog->entries[n];
+    entry->flags = flags;
+    entry->codec = entry_codec;
+    entry->raw_size = raw_size;
+    entry->data_shards = data_shards;
+    entry->image_size = image_size;
+    entry->mode = mode;
+    entry->uid = uid;
+    entry->gid = gid;
+    entry->atime = digest ? 0 : codec->atime;
+    entry->mtime = digest ? 0 : codec->mtime;
+    FileCopyMeta *copy = entry_copies(catalog, n);
+    uint32_t crc = 0;
+    off_t size = 0;
+    for (uint64_t j = 0; j < copies; j++) {
+        if (j == 0 || !uniform) {
+            crc = reader_le32(in);
+            size = reader_varint(in);
+        }
+        copy[j].crc = crc;
+        copy[j].size = size;
+        copy[j].offset = codec->cursor + zigzag_decode(reader_varint(in));
+        codec->cursor = copy[j].offset + size;
+        // Шарды одной длины, образ в них помещается
+        if ((flags & ENTRY_ERASURE) && (copy[j].size != copy[0].size ||
+                                        image_size > (uint64_t)copy[0].size * data_shards)) {
+            in->error = 1;
+        }
+    }
+    // Номера кусков сверяются с каталогом после разбора всех записей
+    uint64_t ref = 0;
+    for (uint64_t k = 0; k < chunks && !in->error; k++) {
+        ref = k == 0 ? reader_varint(in) : ref + 1 + zigzag_decode(reader_varint(in));
+        if (ref > UINT32_MAX) {
+            in->error = 1;
+        }
+        catalog_add_chunk_ref(catalog, n, ref);
+    }
+    // Таблицы CRC блоков должны склеиваться в CRC своих копий
+    if ((flags & ENTRY_BLOCK_CRCS) && !in->error) {
+        uint32_t blocks = crc_block_count(size), tables = flags & ENTRY_ERASURE ? copies : 1;
+        const uint8_t *raw = (uint64_t)size > (uint64_t)UINT32_MAX * CRC_BLOCK_SIZE ? NULL
+                             : reader_bytes(in, (size_t)blocks * tables * 4);
+        uint32_t *table = raw ? catalog_add_block_crcs(catalog, n, blocks) : NULL;
+        for (uint32_t t = 0; table && t < tables; t++) {
+            for (uint32_t b = 0; b < blocks; b++) {
+                table[(size_t)t * blocks + b] = load_le32(raw + ((size_t)t * blocks + b) * 4);
+            }
+            if (crc_of_blocks(table + (size_t)t * blocks, size) != copy[t].crc) {
+                table = NULL;
+            }
+        }
+        if (!table) {
+            in->error = 1;
+        }
+    }
+    if (in->error) {
+        catalog_truncate(catalog, n);
+        return -1;
+    }
+    return n;
+}
+
+// Индекс имен в конце метаданных: хеш-таблица с открытой адресацией,
+// слот - хеш имени и номер записи + 1 (0 - пустой слот), и таблица
+// смещений точек перезапуска, по которой запись с номером n разбирается
+// из своего блока.
+//   "NIDX", число слотов (le32), смещение метаданных (le64),
+//   число блоков, интервал перезапуска (le32),
+//   смещения блоков от начала метаданных (le64, на одно больше числа блоков),
+//   слоты (le32 хеш, le32 номер),
+//   хвост: смещение секции (le64) и "NIDX" - последние 12 байт файла.
+// По хвосту индекс находится без разбора записей; если он относится к
+// другим метаданным (сбой посреди -a или -vacuum), читатели перебирают
+// записи.
+#define NAME_INDEX_MAGIC 0x5844494E // "NIDX"
+#define NAME_INDEX_HEAD_SIZE 24
+#define NAME_INDEX_TAIL_SIZE 12
+#define NAME_INDEX_BATCH 8
+
+// FNV-1a
+static uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const uint8_t *p = (const uint8_t *)name; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static void encode_name_index(ByteBuffer *out, const Catalog *catalog, long meta_offset, size_t footer_start,
+                              const uint64_t *restarts, uint32_t restart_count) {
+    // Заполнение не больше 2/3
+    uint32_t slots = catalog->count + catalog->count / 2 + 1;
+    uint32_t *table = calloc(2 * (size_t)slots, sizeof(uint32_t));
+    for (int i = 0; i < catalog->count; i++) {
+        if (is_tombstone(catalog, i) || is_chunk(catalog, i)) {
+            continue;
+        }
+        uint32_t hash = name_hash(entry_name(catalog, i));
+        uint32_t slot = hash % slots;
+        while (table[2 * slot + 1] != 0) {
+            slot = slot + 1 < slots ? slot + 1 : 0;
+        }
+        table[2 * slot] = hash;
+        table[2 * slot + 1] = i + 1;
+    }
+
+    long index_offset = meta_offset + (out->size - footer_start);
+    buffer_le32(out, NAME_INDEX_MAGIC);
+    buffer_le32(out, slots);
+    buffer_le64(out, meta_offset);
+    buffer_le32(out, restart_count);
+    buffer_le32(out, RESTART_INTERVAL);
+    for (uint32_t r = 0; r <= restart_count; r++) {
+        buffer_le64(out, restarts[r]);
+    }
+    for (uint32_t s = 0; s < 2 * slots; s++) {
+        buffer_le32(out, table[s]);
+    }
+    buffer_le64(out, index_offset);
+    buffer_le32(out, NAME_INDEX_MAGIC);
+    free(table);
+}
+
+// Метаданные v2 целиком для размещения по смещению meta_offset
+void encode_footer(ByteBuffer *out, const Catalog *catalog, const FreeMap *free_map, long meta_offset) {
+    size_t start = out->size;
+    // Магия - самая новая версия формата, которая нужна записям
+    static const uint32_t magics[] = {FOOTER_MAGIC, FOOTER_MAGIC_CODECS, FOOTER_MAGIC_CHUNKS, FOOTER_MAGIC_ERASURE,
+                                      FOOTER_MAGIC_BLOCKS};
+    int version = 0;
+    for (int i = 0; i < catalog->count; i++) {
+        uint16_t flags = catalog->entries[i].flags;
+        int needed = 0;
+        if (flags & ENTRY_BLOCK_CRCS) {
+            needed = 4;
+        } else if (flags & ENTRY_ERASURE) {
+            needed = 3;
+        } else if (flags & (ENTRY_CHUNK | ENTRY_CHUNKED)) {
+            needed = 2;
+        } else if (flags & ENTRY_COMPRESSED) {
+            needed = 1;
+        }
+        version = needed > version ? needed : version;
+    }
+    buffer_le32(out, magics[version]);
+    buffer_le32(out, catalog->count);
+    buffer_le32(out, RESTART_INTERVAL);
+    buffer_le32(out, 0);
+
+    uint32_t restart_count = (catalog->count + RESTART_INTERVAL - 1) / RESTART_INTERVAL;
+    uint64_t *restarts = malloc((restart_count + 1) * sizeof(uint64_t));
+    EntryCodec codec;
+    for (int i = 0; i < catalog->count; i++) {
+        if (i % RESTART_INTERVAL == 0) {
+            restarts[i / RESTART_INTERVAL] = out->size - start;
+            entry_codec_reset(&codec);
+        }
+        encode_entry(out, catalog, i, &codec);
+    }
+    restarts[restart_count] = out->size - start;
+
+    encode_free_map(out, free_map);
+    encode_name_index(out, catalog, meta_offset, start, restarts, restart_count);
+    free(restarts);
+}
+
+// Запись метаданных с текущей позиции файла; возвращает их размер
+long write_footer(FILE *arch, const Catalog *catalog, const FreeMap *free_map) {
+    ByteBuffer out = {0};
+    encode_footer(&out, catalog, free_map, ftell(arch));
+    fwrite(out.data, 1, out.size, arch);
+    free(out.data);
+    return out.size;
+}
+
+// Размер метаданных не зависит от того, где они лягут
+long footer_size(const Catalog *catalog, const FreeMap *free_map) {
+    ByteBuffer out = {0};
+    encode_footer(&out, catalog, free_map, 0);
+    free(out.data);
+    return out.size;
+}
+
+static int decode_footer(const uint8_t *data, size_t size, long meta_offset, int file_count, Catalog *catalog,
+                         FreeMap *free_map, long *entry_offsets) {
+    if (size < FOOTER_HEAD_SIZE || load_le32(data + 8) == 0 || (size_t)file_count > size - FOOTER_HEAD_SIZE) {
+        return -1;
+    }
+    uint32_t interval = load_le32(data + 8);
+    ByteReader in = {data + FOOTER_HEAD_SIZE, data + size, 0};
+    // Имена в среднем короче 64 байт, пул дорастет при необходимости. Запас
+    // не больше размера метаданных: file_count взят с диска
+    size_t names = (size_t)file_count * 64 < size ? (size_t)file_count * 64 : size;
+    size_t copies = (size_t)file_count * 2 < size ? (size_t)file_count * 2 : size;
+    catalog_reserve(catalog, file_count, names, copies);
+    EntryCodec codec;
+    for (int i = 0; i < file_count; i++) {
+        if (i % interval == 0) {
+            entry_codec_reset(&codec);
+        }
+        if (entry_offsets) {
+            entry_offsets[i] = meta_offset + (in.p - data);
+        }
+        if (decode_entry(&in, catalog, &codec) < 0) {
+            return -1;
+        }
+    }
+    // Файлы из кусков ссылаются только на записи кусков
+    for (int i = 0; i < catalog->count; i++) {
+        const uint32_t *refs = entry_chunks(catalog, i);
+        for (uint32_t k = 0; k < catalog->entries[i].chunks; k++) {
+            if (refs[k] >= (uint32_t)catalog->count || !is_chunk(catalog, refs[k])) {
+                return -1;
+            }
+        }
+    }
+    if (free_map) {
+        decode_free_map(&in, free_map);
+    }
+    return 0;
+}
+
+// Разбор всех записей в каталог (и карты свободного места, если free_map
+// не NULL). entry_offsets, если не NULL, получает смещения записей в
+// архиве. Возвращает 0 или -1 при ошибке.
+int read_archive_footer(ArchiveView *view, const ArchiveHeader *header, Catalog *catalog, FreeMap *free_map,
+                        long *entry_offsets) {
+    if (header->version == 2) {
+        size_t size = view->size - header->meta_offset;
+        const uint8_t *data = view->map ? view->map + header->meta_offset : NULL;
+        uint8_t *buffer = NULL;
+        if (!data) {
+            buffer = malloc(size);
+            if (view_read(view, buffer, size, header->meta_offset) != (ssize_t)size) {
+                free(buffer);
+                buffer = NULL;
+            }
+            data = buffer;
+        }
+        int result = data ? decode_footer(data, size, header->meta_offset, header->file_count, catalog,
+                                          free_map, entry_offsets) : -1;
+        free(buffer);
+        if (result != 0) {
+            printf("Ошибка чтения метаданных!\n");
+        }
+        return result;
+    }
+
+    int count = header->file_count;
+    if (count == 0 && !free_map) {
+        return 0;
+    }
+
+    // Переходим к метаданным
+    FILE *meta_file;
+    if (view->map) {
+        meta_file = fmemopen(view->map + header->meta_offset, view->size - header->meta_offset, "rb");
+    } else {
+        meta_file = fdopen(dup(view->fd), "rb");
+        if (meta_file) {
+            fseek(meta_file, header->meta_offset, SEEK_SET);
+        }
+    }
+    if (!meta_file) {
+        perror("Ошибка чтения метаданных");
+        return -1;
+    }
+    int first = catalog->count;
+    if (read_metadata(meta_file, count, catalog) != 0) {
+        printf("Ошибка чтения метаданных!\n");
+        fclose(meta_file);
+        return -1;
+    }
+    if (free_map) {
+        read_free_map(meta_file, free_map);
+    }
+    fclose(meta_file);
+    if (entry_offsets) {
+        long entry_offset = header->meta_offset;
+        for (int i = 0; i < count; i++) {
+            entry_offsets[i] = entry_offset;
+            entry_offset += metadata_size(catalog, first + i);
+        }
+    }
+    return 0;
+}
+
+// Открытие архива на чтение: заголовок и метаданные в каталог.
+// Возвращает 0 или -1 при ошибке.
+int open_archive_view(const char *archive_name, ArchiveView *view, Catalog *catalog, FreeMap *free_map) {
+    ArchiveHeader header;
+    if (open_archive_header(archive_name, view, &header) != 0) {
+        return -1;
+    }
+    if (read_archive_footer(view, &header, catalog, free_map, NULL) != 0) {
+        close_archive_view(view);
+        return -1;
+    }
+    return 0;
+}
+
+// Пометка записи удаленной на месте: в v1 стирается первый байт имени,
+// в v2 взводится флаг в первом байте записи (flags - ее текущие флаги)
+void mark_tombstone(int fd, const ArchiveHeader *header, long entry_offset, uint16_t flags) {
+    if (header->version == 2) {
+        uint8_t byte = flags | ENTRY_DELETED;
+        pwrite_full(fd, &byte, 1, entry_offset);
+    } else {
+        pwrite_full(fd, "", 1, entry_offset + offsetof(FileMeta, name));
+    }
+}
+
+// Запись номер n через таблицу блоков индекса: в block читается и
+// разбирается только ее блок, запись добавляется в каталог.
+// Возвращает ее номер в каталоге или -1.
+static int read_indexed_entry(ArchiveView *view, long meta_offset, off_t restart_table, uint32_t interval,
+                              uint32_t n, ByteBuffer *block, Catalog *catalog, long *entry_offset) {
+    uint8_t bounds[16];
+    if (view_read(view, bounds, sizeof(bounds), restart_table + (off_t)(n / interval) * 8) != sizeof(bounds)) {
+        return -1;
+    }
+    uint64_t start = load_le64(bounds), end = load_le64(bounds + 8);
+    if (start >= end || meta_offset + end > (uint64_t)view->size) {
+        return -1;
+    }
+    block->size = 0;
+    buffer_grow(block, end - start);
+    if (view_read(view, block->data, block->size, meta_offset + start) != (ssize_t)block->size) {
+        return -1;
+    }
+    ByteReader in = {block->data, block->data + block->size, 0};
+    EntryCodec codec;
+    entry_codec_reset(&codec);
+    int first = catalog->count;
+    int result = -1;
+    for (uint32_t i = 0; i <= n % interval; i++) {
+        // Предыдущие записи блока нужны только для разностей
+        catalog_truncate(catalog, first);
+        *entry_offset = meta_offset + end - (in.end - in.p);
+        result = decode_entry(&in, catalog, &codec);
+        if (result < 0) {
+            break;
+        }
+    }
+    return result;
+}
+
+// Поиск живых записей с именем name по индексу: читаются хвост, нужные
+// слоты и блоки найденных записей. Найденные записи добавляются в
+// каталог matches, их смещения - в *entry_offsets, если не NULL.
+// Возвращает число найденных записей или -1, если пригодного индекса нет.
+int find_entries(ArchiveView *view, const ArchiveHeader *header, const char *name, Catalog *matches,
+                 long **entry_offsets) {
+    uint8_t tail[NAME_INDEX_TAIL_SIZE], head[NAME_INDEX_HEAD_SIZE];
+    long meta_offset = header->meta_offset;
+    if (header->version != 2 || view->size < meta_offset + NAME_INDEX_HEAD_SIZE + NAME_INDEX_TAIL_SIZE ||
+        view_read(view, tail, sizeof(tail), view->size - sizeof(tail)) != sizeof(tail) ||
+        load_le32(tail + 8) != NAME_INDEX_MAGIC) {
+        return -1;
+    }
+    uint64_t index_offset = load_le64(tail);
+    if (index_offset < (uint64_t)meta_offset || index_offset + sizeof(head) + sizeof(tail) > (uint64_t)view->size ||
+        view_read(view, head, sizeof(head), index_offset) != sizeof(head) ||
+        load_le32(head) != NAME_INDEX_MAGIC || load_le64(head + 8) != (uint64_t)meta_offset) {
+        return -1;
+    }
+    uint32_t slots = load_le32(head + 4);
+    uint32_t restart_count = load_le32(head + 16);
+    uint32_t interval = load_le32(head + 20);
+    off_t restart_table = index_offset + sizeof(head);
+    off_t slot_table = restart_table + ((off_t)restart_count + 1) * 8;
+    if (slots == 0 || interval == 0 || slot_table + (off_t)slots * 8 + (off_t)sizeof(tail) != view->size) {
+        return -1;
+    }
+
+    int found = 0, capacity = 4;
+    long *offsets = malloc(capacity * sizeof(long));
+    uint32_t hash = name_hash(name);
+    uint32_t slot = hash % slots;
+    uint8_t batch[NAME_INDEX_BATCH * 8];
+    ByteBuffer block = {0};
+    int done = 0;
+    for (uint32_t probed = 0; probed < slots && !done;) {
+        uint32_t count = slots - slot < NAME_INDEX_BATCH ? slots - slot : NAME_INDEX_BATCH;
+        if (view_read(view, batch, count * 8, slot_table + (off_t)slot * 8) != (ssize_t)(count * 8)) {
+            break;
+        }
+        for (uint32_t i = 0; i < count && probed < slots; i++, probed++) {
+            uint32_t number = load_le32(batch + i * 8 + 4);
+            if (number == 0) {
+                done = 1;
+                break;
+            }
+            if (load_le32(batch + i * 8) != hash || number > (uint32_t)header->file_count) {
+                continue;
+            }
+            long offset;
+            int n = read_indexed_entry(view, meta_offset, restart_table, interval, number - 1, &block, matches,
+                                       &offset);
+            if (n < 0) {
+                continue;
+            }
+            if (is_tombstone(matches, n) || strcmp(entry_name(matches, n), name) != 0) {
+                catalog_truncate(matches, n);
+                continue;
+            }
+            if (found == capacity) {
+                capacity *= 2;
+                offsets = realloc(offsets, capacity * sizeof(long));
+            }
+            offsets[found++] = offset;
+        }
+        slot = slot + count < slots ? slot + count : 0;
+    }
+    free(block.data);
+
+    if (entry_offsets) {
+        *entry_offsets = offsets;
+    } else {
+        free(offsets);
+    }
+    return found;
+}
+
+// Заголовок архива, открытого на запись; view читает через его дескриптор
+int read_archive_file_header(FILE *arch, ArchiveView *view, ArchiveHeader *header) {
+    struct stat st;
+    view->fd = fileno(arch);
+    view->map = NULL;
+    view->queue = NULL;
+    view->size = fstat(view->fd, &st) == 0 ? st.st_size : 0;
+    if (read_archive_header(view, header) != 0) {
+        printf("Ошибка чтения заголовка архива!\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Кусок реплики, который проверяет один поток. Если у копии есть таблица
+// CRC блоков, кусок проверяется по блокам: expected - CRC его блоков,
+// damaged - куда отметить поврежденные.
+typedef struct {
+    int file;
+    int copy;
+    off_t offset;
+    off_t length;
+    uint32_t crc;
+    int read_error;
+    const uint32_t *expected;
+    uint8_t *damaged;
+} VerifyTask;
+
+// Общее состояние проверки. Задачи упорядочены как в архиве: файл, копия,
+// кусок, поэтому потоки забирают их по порядку и файлы завершаются примерно
+// в том же порядке, в котором печатаются.
+typedef struct {
+    ArchiveView *view;
+    int queue_depth;
+    VerifyTask *tasks;
+    long task_count;
+    long next_task;
+    int *pending;
+    off_t bytes_done;
+    pthread_mutex_t lock;
+    pthread_cond_t file_done;
+} VerifyJob;
+
+// Число рабочих потоков по умолчанию - по числу процессоров
+int default_workers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+}
+
+static void *verify_worker(void *arg) {
+    VerifyJob *job = (VerifyJob *)arg;
+    uint8_t *buffer = malloc(VERIFY_BUFFER_SIZE);
+    // Своя очередь чтения у каждого потока: вместе они держат в полете
+    // примерно IO_QUEUE_DEPTH чтений
+    ArchiveView view = *job->view;
+    IoQueue queue;
+    if (!view.map) {
+        io_queue_init(&queue, job->queue_depth);
+        view.queue = &queue;
+    }
+
+    for (;;) {
+        long t = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+        if (t >= job->task_count) {
+            break;
+        }
+        VerifyTask *task = &job->tasks[t];
+
+        // С таблицей кусок читается одним потоком и CRC блоков считаются по
+        // ходу; при ошибке чтения ищем, какие блоки не читаются
+        BlockCrcs crcs = {0};
+        if (task->expected && view_scan(&view, task->offset, task->length, buffer, block_crcs_consume, &crcs) == 0) {
+            task->crc = block_crcs_finish(&crcs);
+            for (uint32_t b = 0; b < crcs.blocks; b++) {
+                task->damaged[b] = crcs.table[b] != task->expected[b];
+            }
+        } else {
+            for (off_t pos = 0; task->expected && pos < task->length; pos += CRC_BLOCK_SIZE) {
+                off_t length = task->length - pos < CRC_BLOCK_SIZE ? task->length - pos : CRC_BLOCK_SIZE;
+                uint32_t crc = 0;
+                int failed = view_crc32(&view, task->offset + pos, length, buffer, &crc) != 0;
+                task->read_error |= failed;
+                task->damaged[pos / CRC_BLOCK_SIZE] = failed || crc != task->expected[pos / CRC_BLOCK_SIZE];
+                task->crc = crc32_append_block(task->crc, crc, length);
+            }
+        }
+        free(crcs.table);
+        if (!task->expected && view_crc32(&view, task->offset, task->length, buffer, &task->crc) != 0) {
+            task->read_error = 1;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->bytes_done += task->length;
+        if (--job->pending[task->file] == 0) {
+            pthread_cond_broadcast(&job->file_done);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if (view.queue) {
+        io_queue_free(&queue);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Ожидание конца проверки всех копий записи i
+static void verify_wait(VerifyJob *job, int i) {
+    pthread_mutex_lock(&job->lock);
+    while (job->pending[i] > 0) {
+        pthread_cond_wait(&job->file_done, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Результат проверки копии j записи i: склеенный CRC ее кусков. Возвращает
+// 0 - CRC совпал, 1 - не совпал, -1 - ошибка чтения
+static int verify_copy_result(const VerifyJob *job, const Catalog *catalog, const long *first_task, int i, int j,
+                              uint32_t *crc_out) {
+    uint32_t calculated_crc = 0;
+    int read_error = 0;
+    for (long t = first_task[i]; t < first_task[i + 1]; t++) {
+        if (job->tasks[t].copy == j) {
+            calculated_crc = crc32_combine(calculated_crc, job->tasks[t].crc, job->tasks[t].length);
+            read_error |= job->tasks[t].read_error;
+        }
+    }
+    *crc_out = calculated_crc;
+    return read_error ? -1 : calculated_crc != entry_copies(catalog, i)[j].crc;
+}
+
+// Поврежденные блоки копии j записи i (с таблицами CRC блоков)
+static uint32_t damaged_blocks(const Catalog *catalog, int i, int j, const uint8_t *damaged) {
+    uint32_t count = 0;
+    for (uint32_t b = 0; b < catalog->entries[i].blocks; b++) {
+        count += damaged[(size_t)j * catalog->entries[i].blocks + b];
+    }
+    return count;
+}
+
+// Блоки записи i (с таблицами CRC блоков), которые не собрать: у реплик -
+// поврежденные во всех копиях, у кода k+m - строки, где целых блоков меньше k
+static uint32_t lost_blocks(const Catalog *catalog, int i, const uint8_t *damaged) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    int needed = entry->flags & ENTRY_ERASURE ? entry->data_shards : 1;
+    uint32_t lost = 0;
+    for (uint32_t b = 0; b < entry->blocks; b++) {
+        int intact = 0;
+        for (int j = 0; j < entry->copies; j++) {
+            intact += !damaged[(size_t)j * entry->blocks + b];
+        }
+        lost += intact < needed;
+    }
+    return lost;
+}
+
+// Подпись копии j в отчетах: реплика или, при k > 0, шард кода k+m
+static void copy_label(char *label, size_t size, int k, int j) {
+    if (k == 0) {
+        snprintf(label, size, "Копия %d", j + 1);
+    } else if (j < k) {
+        snprintf(label, size, "Шард данных %d", j + 1);
+    } else {
+        snprintf(label, size, "Шард четности %d", j - k + 1);
+    }
+}
+
+void verify_archive(const char *archive_name, int workers) {
+    ArchiveView view;
+    Catalog catalog = {0};
+    if (open_archive_view(archive_name, &view, &catalog, NULL) != 0) {
+        return;
+    }
+    int file_count = catalog.count;
+
+    // Режем каждую реплику на куски по VERIFY_SEGMENT_SIZE, чтобы даже один
+    // большой файл проверялся всеми потоками
+    VerifyJob job = {0};
+    job.view = &view;
+    job.pending = calloc(file_count > 0 ? file_count : 1, sizeof(int));
+    long *first_task = malloc((file_count + 1) * sizeof(long));
+    long capacity = 0;
+    // Отметки поврежденных блоков: у записи с таблицами - по одной на блок каждой копии
+    size_t *first_damaged = malloc((file_count + 1) * sizeof(size_t)), damaged_count = 0;
+    for (int i = 0; i < file_count; i++) {
+        first_damaged[i] = damaged_count;
+        if (catalog.entries[i].flags & ENTRY_BLOCK_CRCS) {
+            damaged_count += (size_t)catalog.entries[i].blocks * catalog.entries[i].copies;
+        }
+    }
+    uint8_t *damaged = calloc(damaged_count > 0 ? damaged_count : 1, 1);
+    for (int i = 0; i < file_count; i++) {
+        first_task[i] = job.task_count;
+        const FileCopyMeta *copies = entry_copies(&catalog, i);
+        for (int j = 0; j < catalog.entries[i].copies && !is_tombstone(&catalog, i); j++) {
+            off_t size = copies[j].size;
+            off_t pos = 0;
+            do {
+                if (job.task_count == capacity) {
+                    capacity = capacity ? capacity * 2 : 1024;
+                    job.tasks = realloc(job.tasks, capacity * sizeof(VerifyTask));
+                }
+                VerifyTask *task = &job.tasks[job.task_count++];
+                task->file = i;
+                task->copy = j;
+                task->offset = copies[j].offset + pos;
+                task->length = size - pos > VERIFY_SEGMENT_SIZE ? VERIFY_SEGMENT_SIZE : size - pos;
+                task->crc = 0;
+                task->read_error = 0;
+                task->expected = entry_block_crcs(&catalog, i, j);
+                task->damaged = NULL;
+                if (task->expected) {
+                    // Кусок - целое число блоков
+                    task->expected += pos / CRC_BLOCK_SIZE;
+                    task->damaged = damaged + first_damaged[i] + (size_t)j * catalog.entries[i].blocks +
+                                    pos / CRC_BLOCK_SIZE;
+                }
+                pos += task->length;
+                job.pending[i]++;
+            } while (pos < size);
+        }
+    }
+    first_task[file_count] = job.task_count;
+
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    job.queue_depth = IO_QUEUE_DEPTH / workers > 4 ? IO_QUEUE_DEPTH / workers : 4;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.file_done, NULL);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t threads[MAX_WORKERS];
+    for (int w = 0; w < workers; w++) {
+        pthread_create(&threads[w], NULL, verify_worker, &job);
+    }
+
+    // Печатаем результаты в порядке архива по мере готовности файлов.
+    // Копии кусков считаются один раз, на месте своей записи, а ошибки
+    // в них печатаются у каждого файла, который на кусок ссылается.
+    int copies_checked = 0, copies_damaged = 0;
+    for (int i = 0; i < file_count; i++) {
+        verify_wait(&job, i);
+        if (is_tombstone(&catalog, i)) {
+            continue;
+        }
+        const FileCopyMeta *copies = entry_copies(&catalog, i);
+        uint32_t calculated_crc;
+        if (is_chunk(&catalog, i)) {
+            for (int j = 0; j < catalog.entries[i].copies; j++) {
+                copies_checked++;
+                copies_damaged += verify_copy_result(&job, &catalog, first_task, i, j, &calculated_crc) != 0;
+            }
+            continue;
+        }
+        printf("Проверка файла: %s\n", entry_name(&catalog, i));
+        if (catalog.entries[i].flags & ENTRY_CHUNKED) {
+            const uint32_t *refs = entry_chunks(&catalog, i);
+            uint32_t damaged = 0, lost = 0;
+            for (uint32_t k = 0; k < catalog.entries[i].chunks; k++) {
+                int c = refs[k], intact = 0;
+                verify_wait(&job, c);
+                for (int j = 0; j < catalog.entries[c].copies; j++) {
+                    int result = verify_copy_result(&job, &catalog, first_task, c, j, &calculated_crc);
+                    if (result < 0) {
+                        printf("  Кусок %u, копия %d: ОШИБКА чтения\n", k + 1, j + 1);
+                    } else if (result > 0) {
+                        printf("  Кусок %u, копия %d: ОШИБКА (ожидалось: %08x, получено: %08x)\n",
+                               k + 1, j + 1, entry_copies(&catalog, c)[j].crc, calculated_crc);
+                    }
+                    intact += result == 0;
+                }
+                damaged += intact < catalog.entries[c].copies;
+                lost += intact == 0;
+            }
+            if (damaged == 0) {
+                printf("  Кусков: %u, OK\n", catalog.entries[i].chunks);
+            } else {
+                printf("  Кусков: %u, с поврежденными копиями: %u, без целой копии: %u\n",
+                       catalog.entries[i].chunks, damaged, lost);
+            }
+            continue;
+        }
+        // Шарды кода k+m подписываются по группам: данные и четность
+        int k = catalog.entries[i].flags & ENTRY_ERASURE ? catalog.entries[i].data_shards : 0, intact = 0;
+        for (int j = 0; j < catalog.entries[i].copies; j++) {
+            int result = verify_copy_result(&job, &catalog, first_task, i, j, &calculated_crc);
+            char label[32];
+            copy_label(label, sizeof(label), k, j);
+            copies_checked++;
+            if (result < 0) {
+                copies_damaged++;
+                printf("  %s: ОШИБКА чтения\n", label);
+            } else if (result == 0) {
+                intact++;
+                printf("  %s: OK (CRC32: %08x)\n", label, calculated_crc);
+            } else {
+                copies_damaged++;
+                printf("  %s: ОШИБКА (ожидалось: %08x, получено: %08x)\n", label, copies[j].crc, calculated_crc);
+            }
+            if (result != 0 && (catalog.entries[i].flags & ENTRY_BLOCK_CRCS)) {
+                printf("    Поврежденных блоков: %u из %u\n",
+                       damaged_blocks(&catalog, i, j, damaged + first_damaged[i]), catalog.entries[i].blocks);
+            }
+        }
+        // С таблицами CRC блоков файл собирается из целых блоков разных копий
+        uint32_t lost = catalog.entries[i].flags & ENTRY_BLOCK_CRCS
+            ? lost_blocks(&catalog, i, damaged + first_damaged[i]) : 0;
+        if (k > 0 && intact < catalog.entries[i].copies) {
+            printf("  Целых шардов: %d из %d, %s\n", intact, catalog.entries[i].copies,
+                   intact >= k || ((catalog.entries[i].flags & ENTRY_BLOCK_CRCS) && lost == 0)
+                   ? "файл восстановим" : "ОШИБКА: файл не восстановить");
+        } else if (k == 0 && intact == 0 && (catalog.entries[i].flags & ENTRY_BLOCK_CRCS)) {
+            if (lost == 0) {
+                printf("  Целой копии нет, файл собирается по блокам из разных копий\n");
+            } else {
+                printf("  ОШИБКА: блоков, поврежденных во всех копиях: %u из %u\n", lost,
+                       catalog.entries[i].blocks);
+            }
+        }
+    }
+
+    for (int w = 0; w < workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Проверено копий: %d, повреждено: %d, %.1f МБ за %.2f с (%.0f МБ/с, потоков: %d, чтение: %s)\n",
+           copies_checked, copies_damaged, job.bytes_done / 1e6, seconds,
+           seconds > 0 ? job.bytes_done / seconds / 1e6 : 0.0, workers, view.map ? "mmap" : io_engine_name());
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.file_done);
+    free(job.tasks);
+    free(job.pending);
+    free(first_task);
+    free(first_damaged);
+    free(damaged);
+
+    // Освобождаем память
+    catalog_free(&catalog);
+    close_archive_view(&view);
+}
+
+// Исправление архива на месте (-repair): копии каждой записи читаются подряд
+// и проверяются по блокам (по таблицам CRC блоков, без них - целиком).
+// Поврежденный блок реплики переписывается байтами того же блока целой
+// реплики, у кода k+m строка шардов пересчитывается по k целым шардам.
+// Пишутся только поврежденные места, метаданные не меняются. Исправленное
+// по каждой записи сбрасывается на диск (fdatasync) до перехода к
+// следующей, выбрасывается из кеша и перечитывается для проверки.
+// Чтение и запись ограничиваются по скорости (-s), чтобы исправление
+// можно было запускать на рабочей машине.
+typedef struct {
+    double rate;  // байт/с, 0 - без ограничения
+    double bytes;
+    struct timespec start;
+} RateLimit;
+
+// Учет bytes байт ввода-вывода: ждем, пока средняя скорость с начала не
+// опустится до rate
+static void rate_limit(RateLimit *limit, off_t bytes) {
+    if (limit->rate <= 0) {
+        return;
+    }
+    limit->bytes += bytes;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - limit->start.tv_sec) + (now.tv_nsec - limit->start.tv_nsec) / 1e9;
+    double wait = limit->bytes / limit->rate - elapsed;
+    if (wait > 0) {
+        struct timespec pause = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+typedef struct {
+    ArchiveView *view;
+    int fd;
+    uint8_t *buffer;       // VERIFY_BUFFER_SIZE
+    RateLimit limit;
+    off_t scanned;
+    long repaired;         // исправленных блоков (или копий без таблиц)
+    off_t repaired_bytes;
+    long lost;             // не исправленных
+} Repair;
+
+// Проверка участка копии с ожидаемым CRC. 0 - цел
+static int repair_check(Repair *repair, off_t offset, off_t length, uint32_t expected) {
+    uint32_t crc;
+    int status = view_crc32(repair->view, offset, length, repair->buffer, &crc);
+    repair->scanned += length;
+    rate_limit(&repair->limit, length);
+    return status != 0 || crc != expected;
+}
+
+// Перенос length байт архива с from на to
+static int repair_copy(Repair *repair, off_t from, off_t to, off_t length) {
+    for (off_t done = 0; done < length;) {
+        size_t chunk = length - done > VERIFY_BUFFER_SIZE ? VERIFY_BUFFER_SIZE : (size_t)(length - done);
+        if (view_read(repair->view, repair->buffer, chunk, from + done) != (ssize_t)chunk ||
+            pwrite_all(repair->fd, repair->buffer, chunk, to + done) != 0) {
+            return -1;
+        }
+        rate_limit(&repair->limit, 2 * (off_t)chunk);
+        done += chunk;
+    }
+    return 0;
+}
+
+// Строки кода k+m записи i, где есть поврежденные шарды (damaged[j * units +
+// u] == 1): шарды данных восстанавливаются по первым k целым шардам
+// строки, четность считается заново, поврежденные сегменты переписываются
+// и отмечаются 2. Возвращает число строк, которые не исправить.
+static long repair_erasure_rows(Repair *repair, const Catalog *catalog, int i, uint8_t *damaged, uint32_t units) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    const FileCopyMeta *shards = entry_copies(catalog, i);
+    int k = entry->data_shards, m = entry->copies - k;
+    size_t row_size = units > 1 ? CRC_BLOCK_SIZE : ERASURE_SEGMENT_SIZE;
+    uint8_t *rows = malloc((size_t)(k + m + k) * row_size);
+    // Буфер: k выбранных сегментов, m сегментов четности, k восстановленных
+    uint8_t *segment[MAX_REDUNDANCY], *data[MAX_REDUNDANCY], *parity[MAX_REDUNDANCY];
+    for (int j = 0; j < k; j++) {
+        segment[j] = rows + (size_t)j * row_size;
+    }
+    for (int j = 0; j < m; j++) {
+        parity[j] = rows + (size_t)(k + j) * row_size;
+    }
+    uint8_t inverse[MAX_REDUNDANCY * MAX_REDUNDANCY];
+    int chosen[MAX_REDUNDANCY], previous[MAX_REDUNDANCY];
+    for (int r = 0; r < k; r++) {
+        previous[r] = -1;
+    }
+    long lost = 0;
+    for (off_t position = 0; position < shards[0].size; position += row_size) {
+        size_t length = shards[0].size - position > (off_t)row_size ? row_size : (size_t)(shards[0].size - position);
+        uint32_t u = units > 1 ? position / CRC_BLOCK_SIZE : 0;
+        int bad = 0, count = 0;
+        for (int j = 0; j < k + m; j++) {
+            bad += damaged[(size_t)j * units + u] != 0;
+        }
+        if (bad == 0) {
+            continue;
+        }
+        for (int j = 0; j < k + m && count < k; j++) {
+            if (damaged[(size_t)j * units + u] == 0 &&
+                view_read(repair->view, segment[count], length, shards[j].offset + position) == (ssize_t)length) {
+                rate_limit(&repair->limit, length);
+                chosen[count++] = j;
+            }
+        }
+        if (count < k || (memcmp(chosen, previous, k * sizeof(int)) != 0 && erasure_invert(k, chosen, inverse) != 0)) {
+            lost++;
+            continue;
+        }
+        memcpy(previous, chosen, k * sizeof(int));
+        // Целые шарды данных берутся из выбранных, остальные восстанавливаются
+        for (int d = 0; d < k; d++) {
+            data[d] = NULL;
+            for (int r = 0; r < k; r++) {
+                data[d] = chosen[r] == d ? segment[r] : data[d];
+            }
+            if (!data[d]) {
+                data[d] = rows + (size_t)(k + m + d) * row_size;
+                memset(data[d], 0, length);
+                for (int r = 0; r < k; r++) {
+                    gf_engine->kernel(inverse[d * k + r], segment[r], data[d], length);
+                }
+            }
+        }
+        erasure_encode(k, m, data, parity, length);
+        for (int j = 0; j < k + m; j++) {
+            if (damaged[(size_t)j * units + u] == 0) {
+                continue;
+            }
+            if (pwrite_all(repair->fd, j < k ? data[j] : parity[j - k], length, shards[j].offset + position) != 0) {
+                lost++;
+                continue;
+            }
+            rate_limit(&repair->limit, length);
+            repair->repaired_bytes += length;
+            damaged[(size_t)j * units + u] = 2;
+        }
+    }
+    free(rows);
+    return lost;
+}
+
+// Проверка и исправление копий записи i. Возвращает 0 - записи ничего не
+// понадобилось, иначе 1
+static int repair_entry(Repair *repair, const Catalog *catalog, int i) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    const FileCopyMeta *copies = entry_copies(catalog, i);
+    int k = entry->flags & ENTRY_ERASURE ? entry->data_shards : 0;
+    uint32_t units = entry->flags & ENTRY_BLOCK_CRCS ? entry->blocks : 1;
+    off_t unit_size = units > 1 ? CRC_BLOCK_SIZE : copies[0].size;
+    // damaged[j * units + u]: 1 - блок u копии j поврежден, 2 - переписан
+    uint8_t *damaged = calloc((size_t)entry->copies * units, 1);
+    int bad = 0;
+    for (int j = 0; j < entry->copies; j++) {
+        // Проверяется диск, а не кеш
+        posix_fadvise(repair->fd, copies[j].offset, copies[j].size, POSIX_FADV_DONTNEED);
+        const uint32_t *table = entry_block_crcs(catalog, i, j);
+        for (uint32_t u = 0; u < units; u++) {
+            off_t start = (off_t)u * unit_size;
+            off_t length = copies[j].size - start < unit_size ? copies[j].size - start : unit_size;
+            damaged[(size_t)j * units + u] = repair_check(repair, copies[j].offset + start, length,
+                                                          table ? table[u] : copies[j].crc);
+            bad |= damaged[(size_t)j * units + u];
+        }
+    }
+    if (!bad) {
+        free(damaged);
+        return 0;
+    }
+
+    long lost = 0;
+    if (k > 0) {
+        lost = repair_erasure_rows(repair, catalog, i, damaged, units);
+    } else {
+        for (uint32_t u = 0; u < units; u++) {
+            int source = 0;
+            while (source < entry->copies && damaged[(size_t)source * units + u]) {
+                source++;
+            }
+            for (int j = 0; j < entry->copies; j++) {
+                off_t start = (off_t)u * unit_size;
+                off_t length = copies[j].size - start < unit_size ? copies[j].size - start : unit_size;
+                if (damaged[(size_t)j * units + u] == 0) {
+                    continue;
+                }
+                if (source == entry->copies) {
+                    lost++;
+                    break;
+                }
+                if (repair_copy(repair, copies[source].offset + start, copies[j].offset + start, length) != 0) {
+                    perror("Ошибка исправления копии");
+                    continue;
+                }
+                repair->repaired_bytes += length;
+                damaged[(size_t)j * units + u] = 2;
+            }
+        }
+    }
+
+    // Сначала исправленное - на диск, потом перечитываем его с диска
+    if (fdatasync(repair->fd) != 0) {
+        perror("Ошибка сброса архива на диск");
+        exit(EXIT_FAILURE);
+    }
+    if (is_chunk(catalog, i)) {
+        printf("Кусок (запись %d):\n", i + 1);
+    } else {
+        printf("Файл %s:\n", entry_name(catalog, i));
+    }
+    for (int j = 0; j < entry->copies; j++) {
+        const uint32_t *table = entry_block_crcs(catalog, i, j);
+        uint32_t fixed = 0, failed = 0;
+        for (uint32_t u = 0; u < units; u++) {
+            off_t start = (off_t)u * unit_size;
+            off_t length = copies[j].size - start < unit_size ? copies[j].size - start : unit_size;
+            if (damaged[(size_t)j * units + u] != 2) {
+                failed += damaged[(size_t)j * units + u];
+                continue;
+            }
+            posix_fadvise(repair->fd, copies[j].offset + start, length, POSIX_FADV_DONTNEED);
+            if (repair_check(repair, copies[j].offset + start, length, table ? table[u] : copies[j].crc) != 0) {
+                failed++;
+            } else {
+                fixed++;
+            }
+        }
+        char label[32];
+        copy_label(label, sizeof(label), k, j);
+        if (fixed > 0 && units > 1) {
+            printf("  %s: исправлено блоков: %u из %u\n", label, fixed, units);
+        } else if (fixed > 0) {
+            printf("  %s: переписана целиком\n", label);
+        }
+        if (failed > 0) {
+            printf("  %s: ОШИБКА: не исправлено блоков: %u\n", label, failed);
+        }
+        repair->repaired += fixed;
+        repair->lost += failed;
+    }
+    if (lost > 0) {
+        printf("  ОШИБКА: %s без целого источника: %ld\n", k > 0 ? "строк шардов" : "блоков", lost);
+    }
+    free(damaged);
+    return 1;
+}
+
+void repair_archive(const char *archive_name, double rate) {
+    FILE *arch = fopen(archive_name, "r+b");
+    if (!arch) {
+        perror("Ошибка открытия архива");
+        exit(EXIT_FAILURE);
+    }
+    ArchiveView view;
+    ArchiveHeader header;
+    Catalog catalog = {0};
+    if (read_archive_file_header(arch, &view, &header) != 0 ||
+        read_archive_footer(&view, &header, &catalog, NULL, NULL) != 0) {
+        fclose(arch);
+        exit(EXIT_FAILURE);
+    }
+
+    Repair repair = {0};
+    repair.view = &view;
+    repair.fd = fileno(arch);
+    repair.buffer = malloc(VERIFY_BUFFER_SIZE);
+    repair.limit.rate = rate;
+    clock_gettime(CLOCK_MONOTONIC, &repair.limit.start);
+    int touched = 0;
+    for (int i = 0; i < catalog.count; i++) {
+        if (!is_tombstone(&catalog, i) && catalog.entries[i].copies > 0) {
+            touched += repair_entry(&repair, &catalog, i);
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - repair.limit.start.tv_sec) + (now.tv_nsec - repair.limit.start.tv_nsec) / 1e9;
+    printf("Проверено %.1f МБ за %.2f с, записей с повреждениями: %d, исправлено блоков: %ld (%.1f МБ), "
+           "не исправлено: %ld\n", repair.scanned / 1e6, seconds, touched, repair.repaired,
+           repair.repaired_bytes / 1e6, repair.lost);
+
+    free(repair.buffer);
+    catalog_free(&catalog);
+    fclose(arch);
+}
+
+// Создание всех родительских директорий пути (как mkdir -p)
+void make_parent_dirs(const char *path) {
+    char *dir_path = strdup(path);
+    for (char *p = dir_path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir_path, 0777); // Создаем директорию с правами 0777
+            *p = '/';
+        }
+    }
+    free(dir_path);
+}
+
+// Восстановление атрибутов извлеченного файла
+static void restore_attributes(const char *path, const CatalogEntry *entry) {
+    chmod(path, entry->mode);
+    chown(path, entry->uid, entry->gid);
+    struct utimbuf times = {entry->atime, entry->mtime};
+    utime(path, &times);
+}
+
+// Сборка файла из кусков в out: каждый кусок пишется по своему смещению из
+// первой копии с верным CRC, так что поврежденные места разных реплик
+// восполняют друг друга. Возвращает 0, -1 при ошибке записи или номер
+// куска (с 1), у которого повреждены все копии.
+static long extract_chunks(ArchiveView *view, const Catalog *catalog, int i, int out, uint8_t *buffer) {
+    const uint32_t *refs = entry_chunks(catalog, i);
+    off_t position = 0;
+    for (uint32_t k = 0; k < catalog->entries[i].chunks; k++) {
+        const CatalogEntry *chunk = &catalog->entries[refs[k]];
+        const FileCopyMeta *copies = entry_copies(catalog, refs[k]);
+        int j = 0;
+        for (; j < chunk->copies; j++) {
+            uint32_t actual_crc;
+            if (view_crc32(view, copies[j].offset, copies[j].size, buffer, &actual_crc) == 0 &&
+                actual_crc == copies[j].crc) {
+                break;
+            }
+        }
+        if (j == chunk->copies) {
+            return k + 1;
+        }
+        int status = chunk->flags & ENTRY_COMPRESSED
+            ? view_unpack_out(view, copies[j].offset, copies[j].size, chunk->raw_size, out, position)
+            : view_copy_out(view, copies[j].offset, copies[j].size, out, position, buffer);
+        if (status != 0) {
+            return -1;
+        }
+        position += chunk->flags & ENTRY_COMPRESSED ? chunk->raw_size : copies[j].size;
+    }
+    return ftruncate(out, position) == 0 ? 0 : -1;
+}
+
+// Промежуточный файл для сжатых образов: безымянный, рядом с архивом
+// (или извлекаемым файлом) через O_TMPFILE, иначе tmpfile(). Возвращает
+// дескриптор или -1.
+static int open_staging(const char *archive_name) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", archive_name);
+    char *slash = strrchr(dir, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+    } else {
+        slash[slash == dir] = '\0';
+    }
+    int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd < 0) {
+        FILE *file = tmpfile();
+        if (file) {
+            fd = dup(fileno(file));
+            fclose(file);
+        }
+    }
+    return fd;
+}
+
+// Режим -direct: исходные файлы читаются с POSIX_FADV_SEQUENTIAL и
+// прочитанное сразу выбрасывается из кэша страниц, реплики пишутся через
+// второй дескриптор архива с O_DIRECT. Так пишутся только целые страницы
+// одной копии (копии выравниваются на DIRECT_ALIGN), хвосты копий и
+// метаданные идут через кэш и выбрасываются из него после фиксации.
+#define DIRECT_ALIGN 4096
+
+static int open_source(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0 && bulk_direct) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return fd;
+}
+
+// Прочитанный диапазон источника больше не нужен (length 0 - до конца)
+static void drop_source(int fd, off_t offset, off_t length) {
+    if (bulk_direct) {
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void close_source(int fd) {
+    drop_source(fd, 0, 0);
+    close(fd);
+}
+
+// Дескриптор архива для записи с O_DIRECT или -1 (режим выключен или ФС
+// его не поддерживает - тогда все пишется через кэш)
+static int open_direct(const char *archive_name) {
+    if (!bulk_direct) {
+        return -1;
+    }
+    int fd = open(archive_name, O_WRONLY | O_DIRECT);
+    if (fd < 0) {
+        printf("Предупреждение: O_DIRECT недоступен (%s), запись идет через кэш\n", strerror(errno));
+    }
+    return fd;
+}
+
+// После фиксации заголовка все страницы архива чистые - выбрасываем их
+static void drop_archive_cache(FILE *arch) {
+    if (bulk_direct) {
+        posix_fadvise(fileno(arch), 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+// Сборка образа записи i с кодом k+m в out с нулевого смещения по строкам:
+// строка - сегменты шардов с одной позиции. В строке берутся первые k целых
+// сегментов (шарды данных идут первыми), недостающие сегменты данных
+// восстанавливаются по обратной матрице. С таблицами CRC блоков строка -
+// блок CRC, целость сегмента проверяется по таблице, и в каждой строке
+// может работать свой набор шардов; без них шарды заранее проверяются
+// целиком, строка - ERASURE_SEGMENT_SIZE. Возвращает число шардов данных,
+// в которых что-то восстановлено, -1 при ошибке чтения или записи, -2 -
+// целых шардов (в какой-то строке) меньше k.
+static int erasure_read(ArchiveView *view, const Catalog *catalog, int i, int out, uint8_t *buffer) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    const FileCopyMeta *shards = entry_copies(catalog, i);
+    int k = entry->data_shards, intact[MAX_REDUNDANCY] = {0}, count = 0;
+    int blocks = (entry->flags & ENTRY_BLOCK_CRCS) != 0;
+    for (int j = 0; j < entry->copies && (blocks || count < k); j++) {
+        uint32_t actual_crc;
+        intact[j] = blocks || (view_crc32(view, shards[j].offset, shards[j].size, buffer, &actual_crc) == 0 &&
+                               actual_crc == shards[j].crc);
+        count += intact[j];
+    }
+    if (count < k) {
+        return -2;
+    }
+
+    off_t shard_size = shards[0].size, image_size = entry->image_size;
+    size_t row_size = blocks ? CRC_BLOCK_SIZE : ERASURE_SEGMENT_SIZE;
+    uint8_t *segments = malloc((size_t)(k + 1) * row_size);
+    uint8_t *missing = segments + (size_t)k * row_size;
+    uint8_t inverse[MAX_REDUNDANCY * MAX_REDUNDANCY];
+    // source[d] - номер среди выбранных целого сегмента данных d или -1
+    int chosen[MAX_REDUNDANCY], previous[MAX_REDUNDANCY], source[MAX_REDUNDANCY], rebuilt = 0, status = 0;
+    for (int r = 0; r < k; r++) {
+        previous[r] = -1;
+    }
+    for (off_t position = 0; status == 0 && position < shard_size; position += row_size) {
+        size_t length = shard_size - position > (off_t)row_size ? row_size : (size_t)(shard_size - position);
+        count = 0;
+        for (int j = 0; j < entry->copies && count < k && status == 0; j++) {
+            uint8_t *segment = segments + (size_t)count * row_size;
+            if (!intact[j]) {
+                continue;
+            }
+            if (view_read(view, segment, length, shards[j].offset + position) != (ssize_t)length) {
+                // Без таблиц шард уже признан целым: это ошибка чтения
+                status = blocks ? 0 : -1;
+                continue;
+            }
+            if (blocks && crc32_update(0, segment, length) !=
+                              entry_block_crcs(catalog, i, j)[position / CRC_BLOCK_SIZE]) {
+                continue;
+            }
+            chosen[count++] = j;
+        }
+        if (status == 0 && count < k) {
+            status = -2;
+        }
+        if (status == 0 && memcmp(chosen, previous, k * sizeof(int)) != 0) {
+            if (erasure_invert(k, chosen, inverse) != 0) {
+                status = -2;
+                break;
+            }
+            memcpy(previous, chosen, k * sizeof(int));
+            for (int d = 0; d < k; d++) {
+                source[d] = -1;
+            }
+            for (int r = 0; r < k; r++) {
+                if (chosen[r] < k) {
+                    source[chosen[r]] = r;
+                }
+            }
+        }
+        for (int d = 0; d < k && status == 0; d++) {
+            off_t start = d * shard_size + position;
+            if (start >= image_size) {
+                break;
+            }
+            const uint8_t *data = segments + (size_t)source[d] * row_size;
+            if (source[d] < 0) {
+                memset(missing, 0, length);
+                for (int r = 0; r < k; r++) {
+                    gf_engine->kernel(inverse[d * k + r], segments + (size_t)r * row_size, missing, length);
+                }
+                data = missing;
+                rebuilt |= 1 << d;
+            }
+            size_t want = image_size - start < (off_t)length ? (size_t)(image_size - start) : length;
+            status = pwrite_all(out, data, want, start);
+        }
+    }
+    free(segments);
+    if (status == 0 && ftruncate(out, image_size) != 0) {
+        status = -1;
+    }
+    return status != 0 ? status : __builtin_popcount(rebuilt);
+}
+
+// Извлечение записи i с кодом k+m в файл path (out): несжатый образ
+// собирается прямо в файл, сжатый - во временный файл рядом и
+// распаковывается оттуда. Результат - как у erasure_read.
+static int extract_erasure(ArchiveView *view, const Catalog *catalog, int i, const char *path, int out,
+                           uint8_t *buffer) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    if (!(entry->flags & ENTRY_COMPRESSED)) {
+        return erasure_read(view, catalog, i, out, buffer);
+    }
+    ArchiveView image = {.fd = open_staging(path), .map = NULL, .size = entry->image_size, .queue = NULL};
+    if (image.fd < 0) {
+        return -1;
+    }
+    int rebuilt = erasure_read(view, catalog, i, image.fd, buffer);
+    if (rebuilt >= 0 && view_unpack_out(&image, 0, entry->image_size, entry->raw_size, out, 0) != 0) {
+        rebuilt = -1;
+    }
+    close(image.fd);
+    return rebuilt;
+}
+
+// Выбор блоков записи i с таблицей CRC блоков: owner[b] - первая копия, у
+// которой блок b цел. Первая копия проверяется целиком (одним потоком
+// чтения), каждая следующая - только в блоках, поврежденных во всех
+// предыдущих. Возвращает 0 или номер блока (с 1), поврежденного во всех копиях.
+static long select_blocks(ArchiveView *view, const Catalog *catalog, int i, int *owner, uint8_t *buffer) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    const FileCopyMeta *copies = entry_copies(catalog, i);
+    const uint32_t *table = entry_block_crcs(catalog, i, 0);
+    off_t size = copies[0].size;
+    uint32_t missing = entry->blocks;
+    for (uint32_t b = 0; b < entry->blocks; b++) {
+        owner[b] = -1;
+    }
+    for (int j = 0; j < entry->copies && missing > 0; j++) {
+        if (missing == entry->blocks) {
+            BlockCrcs crcs = {0};
+            if (view_scan(view, copies[j].offset, size, buffer, block_crcs_consume, &crcs) == 0) {
+                block_crcs_finish(&crcs);
+                for (uint32_t b = 0; b < entry->blocks && b < crcs.blocks; b++) {
+                    if (crcs.table[b] == table[b]) {
+                        owner[b] = j;
+                        missing--;
+                    }
+                }
+                free(crcs.table);
+                continue;
+            }
+            // Ошибка чтения: копия проверяется по блокам
+            free(crcs.table);
+        }
+        for (uint32_t b = 0; b < entry->blocks; b++) {
+            off_t start = (off_t)b * CRC_BLOCK_SIZE;
+            off_t length = size - start < CRC_BLOCK_SIZE ? size - start : CRC_BLOCK_SIZE;
+            uint32_t crc;
+            if (owner[b] < 0 && view_crc32(view, copies[j].offset + start, length, buffer, &crc) == 0 &&
+                crc == table[b]) {
+                owner[b] = j;
+                missing--;
+            }
+        }
+    }
+    for (uint32_t b = 0; b < entry->blocks; b++) {
+        if (owner[b] < 0) {
+            return b + 1;
+        }
+    }
+    return 0;
+}
+
+// Образ записи i в out с нулевого смещения из блоков копий owner: подряд
+// идущие блоки одной копии копируются одним куском
+static int assemble_blocks(ArchiveView *view, const Catalog *catalog, int i, const int *owner, int out,
+                           uint8_t *buffer) {
+    const FileCopyMeta *copies = entry_copies(catalog, i);
+    uint32_t blocks = catalog->entries[i].blocks, run;
+    for (uint32_t b = 0; b < blocks; b = run) {
+        for (run = b + 1; run < blocks && owner[run] == owner[b]; run++) {
+        }
+        off_t start = (off_t)b * CRC_BLOCK_SIZE, end = run < blocks ? (off_t)run * CRC_BLOCK_SIZE : copies[0].size;
+        if (view_copy_out(view, copies[owner[b]].offset + start, end - start, out, start, buffer) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Извлечение записи i с таблицей CRC блоков в файл path (out): образ
+// собирается из целых блоков копий, сжатый, если он не целиком из одной
+// копии, - во временном файле рядом, откуда распаковывается. Возвращает
+// номер копии (с 1), если весь образ взят из нее, 0 - образ собран из
+// блоков разных копий, -1 - ошибка записи, -2 - блок *lost поврежден во
+// всех копиях.
+static int extract_blocks(ArchiveView *view, const Catalog *catalog, int i, const char *path, int out,
+                          uint8_t *buffer, long *lost) {
+    const CatalogEntry *entry = &catalog->entries[i];
+    const FileCopyMeta *copies = entry_copies(catalog, i);
+    int *owner = malloc(entry->blocks * sizeof(int));
+    *lost = select_blocks(view, catalog, i, owner, buffer);
+    int source = owner[0] + 1, status = 0;
+    for (uint32_t b = 1; b < entry->blocks; b++) {
+        source = owner[b] == owner[0] ? source : 0;
+    }
+    if (*lost != 0) {
+        status = -2;
+    } else if (!(entry->flags & ENTRY_COMPRESSED)) {
+        status = assemble_blocks(view, catalog, i, owner, out, buffer);
+    } else if (source > 0) {
+        status = view_unpack_out(view, copies[source - 1].offset, copies[0].size, entry->raw_size, out, 0);
+    } else {
+        ArchiveView image = {.fd = open_staging(path), .map = NULL, .size = copies[0].size, .queue = NULL};
+        if (image.fd < 0 || assemble_blocks(view, catalog, i, owner, image.fd, buffer) != 0 ||
+            view_unpack_out(&image, 0, image.size, entry->raw_size, out, 0) != 0) {
+            status = -1;
+        }
+        if (image.fd >= 0) {
+            close(image.fd);
+        }
+    }
+    free(owner);
+    return status == 0 ? source : status == -2 ? -2 : -1;
+}
+
+void extract_archive(const char *archive_name, const char *output_dir, const char *file_to_extract) {
+    ArchiveView view;
+    ArchiveHeader header;
+    if (open_archive_header(archive_name, &view, &header) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Один файл ищем по индексу имен, без разбора всех метаданных. Файлу
+    // из кусков нужны записи кусков - тогда читаем весь каталог
+    Catalog catalog = {0};
+    int found = file_to_extract ? find_entries(&view, &header, file_to_extract, &catalog, NULL) : -1;
+    for (int i = 0; i < found; i++) {
+        if (catalog.entries[i].flags & ENTRY_CHUNKED) {
+            catalog_free(&catalog);
+            found = -1;
+        }
+    }
+    if (found < 0 && read_archive_footer(&view, &header, &catalog, NULL, NULL) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Буфер и очередь чтения нужны только без отображения: копии
+    // проверяются потоком чтений на всю глубину очереди
+    uint8_t *buffer = view.map ? NULL : malloc(VERIFY_BUFFER_SIZE);
+    IoQueue queue;
+    if (!view.map) {
+        io_queue_init(&queue, IO_QUEUE_DEPTH);
+        view.queue = &queue;
+    }
+
+    // Восстанавливаем файлы
+    int c, matched = 0;
+    for (int i = 0; i < catalog.count; i++) {
+        const CatalogEntry *entry = &catalog.entries[i];
+        const FileCopyMeta *copies = entry_copies(&catalog, i);
+
+        // Если указан конкретный файл, пропускаем остальные
+        if (is_tombstone(&catalog, i) || is_chunk(&catalog, i) ||
+            (file_to_extract && strcmp(entry_name(&catalog, i), file_to_extract) != 0)) {
+            continue;
+        }
+        matched++;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", output_dir, entry_name(&catalog, i));
+
+        // Проверяем, существует ли файл
+        if (access(path, F_OK) == 0) {
+            printf("Файл %s уже существует. Перезаписать? [y/N] ", path);
+            c = getchar();
+            // Очищаем буфер ввода (до конца строки или EOF)
+            for (int ch = c; ch != '\n' && ch != EOF; ch = getchar());
+            if (c != 'y' && c != 'Y') {
+                continue; // Пропускаем файл, если пользователь не хочет перезаписывать
+            }
+        }
+	
+        if (entry->flags & ENTRY_CHUNKED) {
+            make_parent_dirs(path);
+            int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (out < 0) {
+                perror("Ошибка создания файла");
+                continue;
+            }
+            long damaged = extract_chunks(&view, &catalog, i, out, buffer);
+            close(out);
+            if (damaged != 0) {
+                // Недособранный файл не оставляем
+                unlink(path);
+                if (damaged < 0) {
+                    perror("Ошибка записи файла");
+                } else {
+                    printf("ОШИБКА: Все копии куска %ld файла %s повреждены!\n", damaged, path);
+                }
+                continue;
+            }
+            restore_attributes(path, entry);
+            printf("Файл %s восстановлен из %u кусков\n", path, entry->chunks);
+            continue;
+        }
+
+        if (entry->flags & ENTRY_ERASURE) {
+            make_parent_dirs(path);
+            int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (out < 0) {
+                perror("Ошибка создания файла");
+                continue;
+            }
+            int rebuilt = extract_erasure(&view, &catalog, i, path, out, buffer);
+            close(out);
+            if (rebuilt < 0) {
+                unlink(path);
+                if (rebuilt == -1) {
+                    perror("Ошибка записи файла");
+                } else {
+                    printf("ОШИБКА: У файла %s меньше %d целых шардов!\n", path, entry->data_shards);
+                }
+                continue;
+            }
+            restore_attributes(path, entry);
+            if (rebuilt > 0) {
+                printf("Файл %s восстановлен по коду %d+%d, шардов данных восстановлено: %d\n", path,
+                       entry->data_shards, entry->copies - entry->data_shards, rebuilt);
+            } else {
+                printf("Файл %s восстановлен из шардов данных\n", path);
+            }
+            continue;
+        }
+
+        if (entry->flags & ENTRY_BLOCK_CRCS) {
+            make_parent_dirs(path);
+            int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (out < 0) {
+                perror("Ошибка создания файла");
+                continue;
+            }
+            long lost;
+            int source = extract_blocks(&view, &catalog, i, path, out, buffer, &lost);
+            close(out);
+            if (source < 0) {
+                unlink(path);
+                if (source == -1) {
+                    perror("Ошибка записи файла");
+                } else {
+                    printf("ОШИБКА: Блок %ld файла %s поврежден во всех копиях!\n", lost, path);
+                }
+                continue;
+            }
+            restore_attributes(path, entry);
+            if (source > 0) {
+                printf("Файл %s восстановлен из копии %d\n", path, source);
+            } else {
+                printf("Файл %s собран по блокам из разных копий\n", path);
+            }
+            continue;
+        }
+
+        int extracted = 0;
+        for (int j = 0; j < entry->copies && !extracted; j++) {
+            // Проверяем CRC32 до записи: поврежденная копия не должна попасть в файл
+            uint32_t actual_crc;
+            if (view_crc32(&view, copies[j].offset, copies[j].size, buffer, &actual_crc) != 0 ||
+                actual_crc != copies[j].crc) {
+                continue;
+            }
+
+            // Создаем директории, если они не существуют
+            make_parent_dirs(path);
+
+            // Записываем данные в файл
+            int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (out < 0) {
+                perror("Ошибка создания файла");
+                continue;
+            }
+            int status = entry->flags & ENTRY_COMPRESSED
+                ? view_unpack_out(&view, copies[j].offset, copies[j].size, entry->raw_size, out, 0)
+                : view_copy_out(&view, copies[j].offset, copies[j].size, out, 0, buffer);
+            if (status != 0) {
+                perror("Ошибка записи файла");
+                close(out);
+                continue;
+            }
+            close(out);
+
+            // Восстанавливаем метаданные
+            restore_attributes(path, entry);
+
+            extracted = 1;
+            printf("Файл %s восстановлен из копии %d\n", path, j + 1);
+        }
+        if (!extracted) {
+            printf("ОШИБКА: Все копии файла %s повреждены!\n", path);
+        }
+    }
+    if (file_to_extract && matched == 0) {
+        printf("Файл '%s' не найден в архиве!\n", file_to_extract);
+    }
+
+    // Освобождаем память
+    if (view.queue) {
+        io_queue_free(&queue);
+    }
+    free(buffer);
+    catalog_free(&catalog);
+    close_archive_view(&view);
+}
+
+void list_archive(const char *archive_name) {
+    ArchiveView view;
+    Catalog catalog = {0};
+    FreeMap free_map = {0};
+    if (open_archive_view(archive_name, &view, &catalog, &free_map) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    int file_count = catalog.count;
+
+    int tombstones = 0, chunks = 0;
+    off_t chunk_bytes = 0;
+    for (int i = 0; i < file_count; i++) {
+        tombstones += is_tombstone(&catalog, i);
+        if (is_chunk(&catalog, i) && !is_tombstone(&catalog, i)) {
+            chunks++;
+            chunk_bytes += catalog.entries[i].copies > 0 ? entry_copies(&catalog, i)[0].size : 0;
+        }
+    }
+
+    // Выводим информацию
+    printf("Архив: %s\n", archive_name);
+    printf("Файлов: %d\n", file_count - tombstones - chunks);
+    if (tombstones > 0) {
+        printf("Удаленных записей: %d\n", tombstones);
+    }
+    if (chunks > 0) {
+        printf("Уникальных кусков: %d, %ld байт в каждой реплике\n", chunks, (long)chunk_bytes);
+    }
+    if (free_map.count > 0) {
+        off_t free_bytes = 0;
+        for (int i = 0; i < free_map.count; i++) {
+            free_bytes += free_map.extents[i].size;
+        }
+        printf("Свободно: %ld байт в %d промежутках\n", (long)free_bytes, free_map.count);
+    }
+    free_free_map(&free_map);
+    for (int i = 0; i < file_count; i++) {
+        if (is_tombstone(&catalog, i) || is_chunk(&catalog, i)) {
+            continue;
+        }
+        const FileCopyMeta *copies = entry_copies(&catalog, i);
+        printf("Файл: %s\n", entry_name(&catalog, i));
+        if (catalog.entries[i].flags & ENTRY_CHUNKED) {
+            printf("Кусков: %u, размер=%ld\n", catalog.entries[i].chunks, (long)catalog.entries[i].raw_size);
+            continue;
+        }
+        if (catalog.entries[i].flags & ENTRY_COMPRESSED) {
+            static const char *codec_names[] = {"none", "huffman", "lz", "rans"};
+            printf("Сжатие: %s, исходный размер=%ld\n", codec_names[catalog.entries[i].codec],
+                   (long)catalog.entries[i].raw_size);
+        }
+        if (catalog.entries[i].flags & ENTRY_BLOCK_CRCS) {
+            printf("Блоков CRC: %u по %d КБ%s\n", catalog.entries[i].blocks, CRC_BLOCK_SIZE / 1024,
+                   catalog.entries[i].flags & ENTRY_ERASURE ? " в каждом шарде" : "");
+        }
+        if (catalog.entries[i].flags & ENTRY_ERASURE) {
+            int k = catalog.entries[i].data_shards;
+            printf("Код Рида-Соломона: %d+%d, размер образа=%ld\n", k, catalog.entries[i].copies - k,
+                   (long)catalog.entries[i].image_size);
+            for (int j = 0; j < catalog.entries[i].copies; j++) {
+                printf("  Шард %s %d: CRC32=%08x, Размер=%ld, Смещение=%ld\n", j < k ? "данных" : "четности",
+                       j < k ? j + 1 : j - k + 1, copies[j].crc, (long)copies[j].size, (long)copies[j].offset);
+            }
+            continue;
+        }
+        printf("Копий: %d\n", catalog.entries[i].copies);
+        for (int j = 0; j < catalog.entries[i].copies; j++) {
+            printf("  Копия %d: CRC32=%08x, Размер=%ld, Смещение=%ld\n",
+                   j + 1, copies[j].crc, (long)copies[j].size, (long)copies[j].offset);
+        }
+    }
+
+    close_archive_view(&view);
+    catalog_free(&catalog);
+}
+
+// Файл, подготовленный к упаковке
+typedef struct {
+    char *path;
+    struct stat st;
+} InputFile;
+
+// Список файлов для упаковки
+typedef struct {
+    InputFile *files;
+    int count;
+    int capacity;
+} InputList;
+
+// Запись каталога в формате getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void input_list_add(InputList *list, const char *path, const struct stat *st) {
+    if (strlen(path) > 255) {
+        printf("Пропуск %s: имя длиннее 255 символов\n", path);
+        return;
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->files = realloc(list->files, list->capacity * sizeof(InputFile));
+    }
+    list->files[list->count].path = strdup(path);
+    list->files[list->count].st = *st;
+    list->count++;
+}
+
+void free_input_list(InputList *list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->files[i].path);
+    }
+    free(list->files);
+    list->files = NULL;
+    list->count = list->capacity = 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Рекурсивный обход каталога. Записи читаются пачками через getdents64,
+// метаданные - через fstatat относительно дескриптора каталога
+void walk_directory(const char *dir_path, InputList *list) {
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        perror(dir_path);
+        return;
+    }
+
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+    char **names = NULL;
+    int name_count = 0, name_capacity = 0;
+    long nread;
+    while ((nread = syscall(SYS_getdents64, dir_fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buffer + pos);
+            pos += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                continue;
+            }
+            // Как find -type f: берем только обычные файлы и каталоги
+            if (d->d_type != DT_REG && d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            if (name_count == name_capacity) {
+                name_capacity = name_capacity ? name_capacity * 2 : 64;
+                names = realloc(names, name_capacity * sizeof(char *));
+            }
+            names[name_count++] = strdup(d->d_name);
+        }
+    }
+    if (nread < 0) {
+        perror(dir_path);
+    }
+    free(buffer);
+
+    // Порядок getdents зависит от ФС, сортируем для воспроизводимости архива
+    qsort(names, name_count, sizeof(char *), compare_names);
+
+    size_t dir_len = strlen(dir_path);
+    while (dir_len > 1 && dir_path[dir_len - 1] == '/') {
+        dir_len--;
+    }
+    for (int i = 0; i < name_count; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%.*s/%s", (int)dir_len, dir_path, names[i]);
+
+        struct stat st;
+        if (fstatat(dir_fd, names[i], &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            perror(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            walk_directory(path, list);
+        } else if (S_ISREG(st.st_mode)) {
+            input_list_add(list, path, &st);
+        }
+        free(names[i]);
+    }
+    free(names);
+    close(dir_fd);
+}
+
+// Добавление пути из командной строки или из списка: каталоги обходятся рекурсивно
+void collect_path(const char *path, InputList *list) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        walk_directory(path, list);
+    } else {
+        input_list_add(list, path, &st);
+    }
+}
+
+// Чтение списка путей со стандартного ввода. Разделитель - '\0' или '\n',
+// так что подходит вывод и find -print, и find -print0
+void read_file_list(FILE *input, InputList *list) {
+    size_t capacity = 1 << 16, length = 0, bytes_read;
+    char *data = malloc(capacity);
+    while ((bytes_read = fread(data + length, 1, capacity - length, input)) > 0) {
+        length += bytes_read;
+        if (length == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i <= length; i++) {
+        if (i == length || data[i] == '\0' || data[i] == '\n') {
+            if (i > start) {
+                data[i] = '\0';
+                collect_path(data + start, list);
+            }
+            start = i + 1;
+        }
+    }
+    free(data);
+}
+
+// Сбор всех файлов для упаковки: аргумент "-" означает список путей на stdin
+void collect_input_files(int arg_count, char *args[], InputList *list) {
+    for (int i = 0; i < arg_count; i++) {
+        if (strcmp(args[i], "-") == 0) {
+            read_file_list(stdin, list);
+        } else {
+            collect_path(args[i], list);
+        }
+    }
+}
+
+// Заполнение метаданных файла по результату stat
+int catalog_add_input(Catalog *catalog, const InputFile *input, int redundancy) {
+    int n = catalog_add(catalog, input->path, strnlen(input->path, 255), redundancy);
+    CatalogEntry *entry = &catalog->entries[n];
+    entry->mode = input->st.st_mode;
+    entry->uid = input->st.st_uid;
+    entry->gid = input->st.st_gid;
+    entry->atime = input->st.st_atime;
+    entry->mtime = input->st.st_mtime;
+    return n;
+}
+
+// Оценка по выборке, стоит ли сжимать файл: до ENTROPY_SAMPLES окон по
+// ENTROPY_WINDOW байт равномерно по файлу (маленький файл - целиком), по их
+// гистограмме - размер кодов Хаффмана плюс заголовки блоков. Сжимаем, если
+// выигрыш больше 1/32 размера.
+#define ENTROPY_SAMPLES 16
+#define ENTROPY_WINDOW 4096
+
+static int sample_worth_compressing(const uint8_t *sample, size_t sampled, off_t size) {
+    uint64_t frequencies[256] = {0};
+    uint8_t lengths[256];
+    huffman_count(sample, sampled, frequencies);
+    off_t blocks = (size + HUFFMAN_BLOCK_SIZE - 1) / HUFFMAN_BLOCK_SIZE;
+    double estimate;
+    if (frequencies[sample[0]] == sampled) {
+        estimate = blocks * 6.0;
+    } else {
+        huffman_code_lengths(frequencies, 256, lengths, HUFFMAN_MAX_BITS);
+        uint64_t bits = 0;
+        for (int s = 0; s < 256; s++) {
+            bits += frequencies[s] * lengths[s];
+        }
+        estimate = (double)bits / 8 / sampled * size + blocks * (4.0 + 129);
+    }
+    return estimate < size - size / 32;
+}
+
+static int worth_compressing(int fd, off_t size, uint8_t *buffer) {
+    if (size == 0) {
+        return 0;
+    }
+    size_t sampled = 0;
+    if (size <= ENTROPY_SAMPLES * ENTROPY_WINDOW) {
+        sampled = pread(fd, buffer, size, 0) == size ? size : 0;
+    } else {
+        for (int i = 0; i < ENTROPY_SAMPLES; i++) {
+            off_t offset = (size - ENTROPY_WINDOW) / (ENTROPY_SAMPLES - 1) * i;
+            if (pread(fd, buffer + sampled, ENTROPY_WINDOW, offset) != ENTROPY_WINDOW) {
+                return 0;
+            }
+            sampled += ENTROPY_WINDOW;
+        }
+    }
+    return sampled > 0 && sample_worth_compressing(buffer, sampled, size);
+}
+
+// Сжатие файла в промежуточный файл: образ из planned_size байт fd (или
+// меньше, если файл укоротился) по смещению stage_offset, блоки уровня level
+// с энтропийным кодером entropy.
+// Файл больше одного блока сжимается на пуле потоков, как -p (тогда читается
+// до конца), иначе в buffer (INGEST_BUFFER_SIZE) - блок и его сжатый вид.
+// Возвращает размер образа и прочитанный размер, CRC образа и его блоков
+// накапливаются в crcs.
+static off_t compress_entry(int fd, off_t planned_size, int stage_fd, off_t stage_offset, int level, int entropy,
+                            uint8_t *buffer, BlockCrcs *crcs, off_t *raw_out) {
+    uint8_t *block = buffer, *packed = buffer + HUFFMAN_BLOCK_SIZE;
+    off_t raw = 0, stored = 0;
+    off_t blocks = (planned_size + HUFFMAN_BLOCK_SIZE - 1) / HUFFMAN_BLOCK_SIZE;
+    int workers = default_workers() < blocks ? default_workers() : (int)blocks;
+    FILE *input = workers > 1 ? fdopen(dup(fd), "rb") : NULL;
+    if (input) {
+        CodecJob job = {0};
+        job.input = input;
+        job.level = level;
+        job.entropy = entropy;
+        job.block_size = HUFFMAN_BLOCK_SIZE;
+        job.end_block = LONG_MAX;
+        pthread_t threads[MAX_WORKERS];
+        codec_job_start(&job, workers, threads);
+        CodecSlot *slot;
+        for (long b = 0; (slot = codec_job_wait(&job, b)) != NULL; b++) {
+            uint8_t head[4];
+            store_le32(head, slot->out_length);
+            block_crcs_update(crcs, head, sizeof(head));
+            block_crcs_update(crcs, slot->out, slot->out_length);
+            pwrite_full(stage_fd, head, sizeof(head), stage_offset + stored);
+            pwrite_full(stage_fd, slot->out, slot->out_length, stage_offset + stored + sizeof(head));
+            stored += sizeof(head) + slot->out_length;
+            raw += slot->in_length;
+            codec_job_release(&job, slot);
+        }
+        codec_job_finish(&job, workers, threads);
+        fclose(input);
+        planned_size = 0;
+    }
+    while (raw < planned_size) {
+        size_t want = planned_size - raw > HUFFMAN_BLOCK_SIZE ? HUFFMAN_BLOCK_SIZE : (size_t)(planned_size - raw);
+        size_t got = 0;
+        while (got < want) {
+            ssize_t bytes_read = read(fd, block + got, want - got);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                break;
+            }
+            got += bytes_read;
+        }
+        if (got == 0) {
+            break;
+        }
+        size_t length = huffman_pack_block(block, got, packed + 4, level, entropy);
+        store_le32(packed, length);
+        block_crcs_update(crcs, packed, length + 4);
+        pwrite_full(stage_fd, packed, length + 4, stage_offset + stored);
+        stored += length + 4;
+        raw += got;
+        if (got < want) {
+            break;
+        }
+    }
+    *raw_out = raw;
+    return stored;
+}
+
+// Подготовка записи к упаковке со сжатием: если оценка обещает выигрыш,
+// файл сжимается в промежуточный файл по смещению stage_offset, в записи
+// взводится ENTRY_COMPRESSED. Возвращает размер образа (CRC образа и его
+// блоков - в crcs), 0 - файл хранится как есть (образ не сжался), -1 - файл
+// не открылся.
+static off_t stage_entry(const char *path, off_t size, int stage_fd, off_t stage_offset, uint8_t *buffer,
+                         CatalogEntry *entry, BlockCrcs *crcs) {
+    int fd = open_source(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    off_t stored = 0, raw = 0;
+    if (worth_compressing(fd, size, buffer)) {
+        stored = compress_entry(fd, size, stage_fd, stage_offset, archive_codec == CODEC_LZ ? archive_level : 0,
+                                archive_codec == CODEC_RANS ? ENTROPY_RANS : ENTROPY_HUFFMAN, buffer, crcs, &raw);
+    }
+    close_source(fd);
+    if (stored == 0 || stored >= raw) {
+        return 0;
+    }
+    if (raw != size) {
+        printf("Предупреждение: файл %s прочитан не полностью\n", path);
+    }
+    entry->flags |= ENTRY_COMPRESSED;
+    entry->codec = archive_codec;
+    entry->raw_size = raw;
+    return stored;
+}
+
+// Дедупликация (опция -D): файл режется на куски по содержимому (chunk_cut),
+// каждый уникальный кусок - отдельная запись ENTRY_CHUNK со своими репликами,
+// файл - запись ENTRY_CHUNKED со списком кусков. Куски ищутся по SHA-256 в
+// хеш-таблице с открытой адресацией: слот - номер записи куска + 1, 0 - пусто.
+// Повторная упаковка похожего дерева пишет только новые куски.
+typedef struct {
+    uint32_t *slots;
+    uint32_t slot_count;    // степень двойки
+    uint32_t used;
+    uint8_t *packed;        // сжатый образ куска
+    long new_chunks, shared_chunks, upgraded_chunks;
+    off_t new_bytes, shared_bytes;
+} ChunkStore;
+
+static void chunk_store_put(ChunkStore *store, const Catalog *catalog, int n) {
+    // Заполнение не больше 2/3
+    if (3 * ((uint64_t)store->used + 1) > 2 * (uint64_t)store->slot_count) {
+        uint32_t *old = store->slots, old_count = store->slot_count;
+        store->slot_count = old_count ? old_count * 2 : 1024;
+        store->slots = calloc(store->slot_count, sizeof(uint32_t));
+        store->used = 0;
+        for (uint32_t slot = 0; slot < old_count; slot++) {
+            if (old[slot] != 0) {
+                chunk_store_put(store, catalog, old[slot] - 1);
+            }
+        }
+        free(old);
+    }
+    uint32_t slot = load_le32(chunk_digest(catalog, n)) & (store->slot_count - 1);
+    while (store->slots[slot] != 0) {
+        slot = (slot + 1) & (store->slot_count - 1);
+    }
+    store->slots[slot] = n + 1;
+    store->used++;
+}
+
+// Слот куска с этим SHA-256 или -1
+static int64_t chunk_store_slot(const ChunkStore *store, const Catalog *catalog, const uint8_t *digest) {
+    if (store->slot_count == 0) {
+        return -1;
+    }
+    for (uint32_t slot = load_le32(digest) & (store->slot_count - 1); store->slots[slot] != 0;
+         slot = (slot + 1) & (store->slot_count - 1)) {
+        if (memcmp(chunk_digest(catalog, store->slots[slot] - 1), digest, CHUNK_DIGEST_SIZE) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Номер записи куска с этим SHA-256 или -1
+static int chunk_store_find(const ChunkStore *store, const Catalog *catalog, const uint8_t *digest) {
+    int64_t slot = chunk_store_slot(store, catalog, digest);
+    return slot < 0 ? -1 : (int)store->slots[slot] - 1;
+}
+
+// Индекс живых кусков каталога
+static void chunk_store_init(ChunkStore *store, const Catalog *catalog) {
+    memset(store, 0, sizeof(*store));
+    store->packed = malloc(4 + HUFFMAN_BLOCK_BOUND(CHUNK_MAX_SIZE));
+    for (int i = 0; i < catalog->count; i++) {
+        if (is_chunk(catalog, i) && !is_tombstone(catalog, i)) {
+            chunk_store_put(store, catalog, i);
+        }
+    }
+}
+
+static void chunk_store_free(ChunkStore *store) {
+    if (store->new_chunks + store->shared_chunks > 0) {
+        printf("Дедупликация: новых кусков %ld (%ld байт), повторных %ld (%ld байт)\n", store->new_chunks,
+               (long)store->new_bytes, store->shared_chunks, (long)store->shared_bytes);
+    }
+    if (store->upgraded_chunks > 0) {
+        printf("Дедупликация: кусков, переписанных с большим числом копий: %ld\n", store->upgraded_chunks);
+    }
+    free(store->slots);
+    free(store->packed);
+}
+
+// Кусок файла n: ссылка на уже известный или новая запись куска с
+// redundancy копиями. Образ нового куска (сжатый, как блок образа
+// CODEC_*, если так меньше) пишется в промежуточный файл по *stage_end,
+// копиям задаются размер и CRC, смещения - у вызывающего. Известный кусок
+// с меньшим числом копий, чем redundancy, пишется заново новой записью;
+// старую запись и ссылки на нее меняет потом chunk_store_repoint.
+static void dedup_chunk(ChunkStore *store, Catalog *catalog, int n, const uint8_t *data, size_t length,
+                        int redundancy, int stage_fd, off_t *stage_end) {
+    uint8_t digest[CHUNK_DIGEST_SIZE];
+    sha256(data, length, digest);
+    int64_t slot = chunk_store_slot(store, catalog, digest);
+    int c = slot < 0 ? -1 : (int)store->slots[slot] - 1;
+    if (c >= 0 && catalog->entries[c].copies >= redundancy) {
+        store->shared_chunks++;
+        store->shared_bytes += length;
+        catalog_add_chunk_ref(catalog, n, c);
+        return;
+    }
+    if (c >= 0) {
+        store->upgraded_chunks++;
+    }
+
+    c = catalog_add(catalog, (const char *)digest, CHUNK_DIGEST_SIZE, redundancy);
+    CatalogEntry *chunk = &catalog->entries[c];
+    chunk->flags = ENTRY_CHUNK;
+    const uint8_t *image = data;
+    size_t image_size = length;
+    if (archive_codec != CODEC_STORED && sample_worth_compressing(data, length, length)) {
+        size_t packed = huffman_pack_block(data, length, store->packed + 4,
+                                           archive_codec == CODEC_LZ ? archive_level : 0,
+                                           archive_codec == CODEC_RANS ? ENTROPY_RANS : ENTROPY_HUFFMAN);
+        if (packed + 4 < length) {
+            store_le32(store->packed, packed);
+            image = store->packed;
+            image_size = packed + 4;
+            chunk->flags |= ENTRY_COMPRESSED;
+            chunk->codec = archive_codec;
+            chunk->raw_size = length;
+        }
+    }
+    uint32_t crc = crc32_update(0, image, image_size);
+    FileCopyMeta *copies = entry_copies(catalog, c);
+    for (int j = 0; j < redundancy; j++) {
+        copies[j].crc = crc;
+        copies[j].size = image_size;
+    }
+    pwrite_full(stage_fd, image, image_size, *stage_end);
+    *stage_end += image_size;
+    if (slot >= 0) {
+        store->slots[slot] = c + 1;
+    } else {
+        chunk_store_put(store, catalog, c);
+    }
+    store->new_chunks++;
+    store->new_bytes += length;
+    catalog_add_chunk_ref(catalog, n, c);
+}
+
+// Куски записей до first, переписанные dedup_chunk с большим числом копий:
+// ссылки файлов переводятся на новые записи (номер first и дальше), старые
+// записи становятся надгробиями. У -a вызывается только после фиксации
+// перенесенной копии старых метаданных - она пишется из неизмененных записей.
+static void chunk_store_repoint(const ChunkStore *store, Catalog *catalog, int first) {
+    if (store->upgraded_chunks == 0) {
+        return;
+    }
+    for (int i = 0; i < first; i++) {
+        if (is_tombstone(catalog, i)) {
+            continue;
+        }
+        if (catalog->entries[i].flags & ENTRY_CHUNKED) {
+            uint32_t *refs = entry_chunks(catalog, i);
+            for (uint32_t k = 0; k < catalog->entries[i].chunks; k++) {
+                int c = chunk_store_find(store, catalog, chunk_digest(catalog, refs[k]));
+                if (c >= first) {
+                    refs[k] = c;
+                }
+            }
+        } else if (is_chunk(catalog, i) && chunk_store_find(store, catalog, chunk_digest(catalog, i)) >= first) {
+            catalog->entries[i].flags |= ENTRY_DELETED;
+        }
+    }
+}
+
+// Дедупликация файла в запись n: чтение кусками по INGEST_BUFFER_SIZE,
+// нарезка на куски, новые куски - в промежуточный файл подряд, в порядке их
+// записей. Возвращает прочитанный размер или -1, если файл не открылся.
+static off_t dedup_entry(ChunkStore *store, Catalog *catalog, int n, const char *path, off_t size, int redundancy,
+                         int stage_fd, off_t *stage_end, uint8_t *buffer) {
+    int fd = open_source(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    catalog->entries[n].flags |= ENTRY_CHUNKED;
+    off_t done = 0;
+    size_t filled = 0;
+    int eof = 0;
+    while (!eof || filled > 0) {
+        while (!eof && filled < INGEST_BUFFER_SIZE) {
+            size_t want = size - done < (off_t)(INGEST_BUFFER_SIZE - filled) ? (size_t)(size - done)
+                                                                              : INGEST_BUFFER_SIZE - filled;
+            ssize_t bytes_read = want > 0 ? read(fd, buffer + filled, want) : 0;
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                if (bytes_read < 0) {
+                    perror(path);
+                }
+                eof = 1;
+                break;
+            }
+            filled += bytes_read;
+            done += bytes_read;
+        }
+        // Режем, пока в буфере помещается самый длинный кусок (в конце
+        // файла - до конца), остаток переносим в начало и дочитываем
+        size_t position = 0;
+        while (filled - position >= CHUNK_MAX_SIZE || (eof && position < filled)) {
+            size_t length = chunk_cut(buffer + position, filled - position);
+            dedup_chunk(store, catalog, n, buffer + position, length, redundancy, stage_fd, stage_end);
+            position += length;
+        }
+        memmove(buffer, buffer + position, filled - position);
+        filled -= position;
+    }
+    close_source(fd);
+
+    if (done != size) {
+        printf("Предупреждение: файл %s прочитан не полностью\n", path);
+    }
+    catalog->entries[n].raw_size = done;
+    return done;
+}
+
+// Запись куска реплики: с direct_fd >= 0 выровненная часть пишется мимо
+// кэша (data и offset должны быть выровнены на DIRECT_ALIGN), остаток -
+// через arch_fd
+static void pwrite_replica(int arch_fd, int direct_fd, const uint8_t *data, size_t length, off_t offset) {
+    size_t body = direct_fd >= 0 && offset % DIRECT_ALIGN == 0 && (uintptr_t)data % DIRECT_ALIGN == 0
+                      ? length / DIRECT_ALIGN * DIRECT_ALIGN
+                      : 0;
+    if (body > 0) {
+        pwrite_full(direct_fd, data, body, offset);
+    }
+    if (body < length) {
+        pwrite_full(arch_fd, data + body, length - body, offset + body);
+    }
+}
+
+// Потоковое копирование length байт src_fd с src_offset во все реплики
+// через очередь: чтения кусками по IO_BUFFER_SIZE идут вперед на всю
+// глубину очереди, прочитанный кусок (по порядку - ради CRC) пишется во все
+// реплики по их смещениям, и буфер освобождается, когда закончатся все его
+// записи. CRC и таблица CRC блоков считаются в crcs, если он не NULL.
+// С direct_fd >= 0 выровненная часть куска пишется мимо кэша, остаток -
+// через arch_fd. Возвращает число скопированных байт: меньше length, если
+// источник кончился раньше; ошибки чтения сообщаются от имени name.
+static off_t replicate_range(int src_fd, off_t src_offset, off_t length, const char *name, int arch_fd,
+                             int direct_fd, const FileCopyMeta *copies, int copy_count, BlockCrcs *crcs,
+                             IoQueue *queue) {
+    off_t start[IO_QUEUE_DEPTH];
+    ssize_t got[IO_QUEUE_DEPTH];
+    int writes[IO_QUEUE_DEPTH];
+    int state[IO_QUEUE_DEPTH] = {0};  // 0 - свободен, 1 - читается, 2 - прочитан, 3 - пишется
+    off_t next = 0, done = 0;
+    int eof = 0;
+    for (;;) {
+        for (int b = 0; b < queue->depth && next < length && !eof; b++) {
+            if (state[b] == 0) {
+                size_t to_read = length - next > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : (size_t)(length - next);
+                io_queue_submit(queue, src_fd, 0, b, to_read, src_offset + next, b);
+                start[b] = next;
+                state[b] = 1;
+                next += to_read;
+            }
+        }
+        if (queue->inflight == 0) {
+            break;
+        }
+        IoCompletion completion;
+        io_queue_wait(queue, &completion);
+        int b = completion.tag;
+        if (state[b] == 1) {
+            got[b] = completion.result;
+            state[b] = 2;
+        } else {
+            if (completion.result < 0) {
+                errno = -completion.result;
+                perror("Ошибка записи архива");
+                exit(EXIT_FAILURE);
+            }
+            if (--writes[b] == 0) {
+                state[b] = 0;
+            }
+        }
+
+        // Прочитанные куски уходят в реплики по порядку. Куски за концом
+        // источника (файл укоротился после stat) остаются непрочитанными
+        for (b = 0; b < queue->depth && !eof; b++) {
+            if (state[b] != 2 || start[b] != done) {
+                continue;
+            }
+            size_t expected = length - done > IO_BUFFER_SIZE ? IO_BUFFER_SIZE : (size_t)(length - done);
+            if (got[b] < 0) {
+                errno = -got[b];
+                perror(name);
+                got[b] = 0;
+            }
+            eof = got[b] < (ssize_t)expected;
+            state[b] = 0;
+            writes[b] = 0;
+            if (got[b] > 0) {
+                uint8_t *data = io_buffer(queue, b);
+                if (crcs) {
+                    block_crcs_update(crcs, data, got[b]);
+                }
+                drop_source(src_fd, src_offset + done, got[b]);
+                for (int j = 0; j < copy_count; j++) {
+                    off_t offset = copies[j].offset + done;
+                    size_t body = direct_fd >= 0 && offset % DIRECT_ALIGN == 0 ? got[b] / DIRECT_ALIGN * DIRECT_ALIGN
+                                                                              : 0;
+                    if (body > 0) {
+                        io_queue_submit(queue, direct_fd, 1, b, body, offset, b);
+                        writes[b]++;
+                    }
+                    if (body < (size_t)got[b]) {
+                        if (body > 0) {
+                            pwrite_full(arch_fd, data + body, got[b] - body, offset + body);
+                        } else {
+                            io_queue_submit(queue, arch_fd, 1, b, got[b], offset, b);
+                            writes[b]++;
+                        }
+                    }
+                }
+                state[b] = writes[b] > 0 ? 3 : 0;
+            }
+            done += got[b];
+            b = -1;
+        }
+    }
+    return done;
+}
+
+// Потоковая упаковка файла path во все реплики (см. replicate_range).
+// Смещения реплик уже заданы в copies. Возвращает число записанных байт или
+// -1, если файл не открылся.
+off_t ingest_file(int arch_fd, int direct_fd, FileCopyMeta *copies, int copy_count, const char *path,
+                  off_t planned_size, BlockCrcs *crcs, IoQueue *queue) {
+    int fd = open_source(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    off_t done = replicate_range(fd, 0, planned_size, path, arch_fd, direct_fd, copies, copy_count, crcs, queue);
+    close_source(fd);
+
+    if (done != planned_size) {
+        // Файл изменился после stat: сохраняем то, что удалось прочитать
+        printf("Предупреждение: файл %s прочитан не полностью\n", path);
+    }
+    uint32_t crc = block_crcs_finish(crcs);
+    for (int j = 0; j < copy_count; j++) {
+        copies[j].size = done;
+        copies[j].crc = crc;
+    }
+    return done;
+}
+
+// Запись n - код k+m (k = archive_data_shards) вместо реплик: все копии -
+// шарды длиной ceil(image_size / k), смещения задает вызывающий
+static void erasure_prepare(Catalog *catalog, int n, off_t image_size) {
+    CatalogEntry *entry = &catalog->entries[n];
+    entry->flags |= ENTRY_ERASURE;
+    entry->data_shards = archive_data_shards;
+    entry->image_size = image_size;
+    FileCopyMeta *shards = entry_copies(catalog, n);
+    for (int j = 0; j < entry->copies; j++) {
+        shards[j].size = (image_size + archive_data_shards - 1) / archive_data_shards;
+        shards[j].crc = 0;
+    }
+}
+
+// Запись образа в шарды кода k+m по их смещениям: шард данных d - байты
+// образа [d * S, (d + 1) * S), S - длина шарда, хвост последнего
+// дополняется нулями. Образ читается из source с source_offset сегментами
+// по ERASURE_SEGMENT_SIZE из каждого шарда, четность считается по
+// сегментам. Задает CRC шардов, заполняет их таблицы CRC блоков tables
+// (если не NULL) и возвращает прочитанную длину образа (меньше image_size,
+// если источник укоротился). С direct_fd >= 0 шарды пишутся мимо кэша.
+static off_t erasure_write(int arch_fd, int direct_fd, FileCopyMeta *shards, int k, int m, ArchiveView *source,
+                           off_t source_offset, off_t image_size, uint32_t *tables) {
+    off_t shard_size = shards[0].size, done = 0;
+    uint8_t *buffer = NULL;
+    if (posix_memalign((void **)&buffer, DIRECT_ALIGN, (size_t)(k + m) * ERASURE_SEGMENT_SIZE) != 0) {
+        perror("Ошибка выделения памяти");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *segment[MAX_REDUNDANCY];
+    for (int j = 0; j < k + m; j++) {
+        segment[j] = buffer + (size_t)j * ERASURE_SEGMENT_SIZE;
+        shards[j].crc = 0;
+    }
+    for (off_t position = 0; position < shard_size; position += ERASURE_SEGMENT_SIZE) {
+        size_t length = shard_size - position > ERASURE_SEGMENT_SIZE ? ERASURE_SEGMENT_SIZE
+                                                                     : (size_t)(shard_size - position);
+        for (int d = 0; d < k; d++) {
+            off_t start = d * shard_size + position;
+            size_t want = start >= image_size ? 0 : image_size - start < (off_t)length ? (size_t)(image_size - start)
+                                                                                         : length;
+            ssize_t got = want > 0 ? view_read(source, segment[d], want, source_offset + start) : 0;
+            if (got < 0) {
+                got = 0;
+            }
+            memset(segment[d] + got, 0, length - got);
+            done += got;
+        }
+        erasure_encode(k, m, segment, segment + k, length);
+        // Сегмент - целое число блоков CRC
+        for (int j = 0; j < k + m; j++) {
+            for (size_t b = 0; b < length; b += CRC_BLOCK_SIZE) {
+                size_t piece = length - b < CRC_BLOCK_SIZE ? length - b : CRC_BLOCK_SIZE;
+                uint32_t crc = crc32_update(0, segment[j] + b, piece);
+                if (tables) {
+                    tables[j * crc_block_count(shard_size) + (position + b) / CRC_BLOCK_SIZE] = crc;
+                }
+                shards[j].crc = crc32_append_block(shards[j].crc, crc, piece);
+            }
+            pwrite_replica(arch_fd, direct_fd, segment[j], length, shards[j].offset + position);
+        }
+    }
+    free(buffer);
+    return done;
+}
+
+// Данные записи n с кодом k+m: образ - image_size байт промежуточного
+// файла stage_fd с stage_offset (сжатая запись) или, если stage_fd < 0,
+// сам файл path. Возвращает прочитанную длину образа или -1, если файл не
+// открылся.
+static off_t erasure_entry(int arch_fd, int direct_fd, Catalog *catalog, int n, const char *path, int stage_fd,
+                           off_t stage_offset) {
+    CatalogEntry *entry = &catalog->entries[n];
+    ArchiveView source = {.fd = stage_fd, .map = NULL, .size = stage_offset + entry->image_size, .queue = NULL};
+    if (stage_fd < 0) {
+        source.fd = open_source(path);
+        if (source.fd < 0) {
+            perror(path);
+            return -1;
+        }
+        stage_offset = 0;
+        source.size = entry->image_size;
+    }
+    uint32_t *tables = catalog_add_block_crcs(catalog, n, crc_block_count(entry_copies(catalog, n)[0].size));
+    off_t done = erasure_write(arch_fd, direct_fd, entry_copies(catalog, n), entry->data_shards,
+                               entry->copies - entry->data_shards, &source, stage_offset, entry->image_size, tables);
+    if (stage_fd < 0) {
+        close_source(source.fd);
+        if (done != entry->image_size) {
+            printf("Предупреждение: файл %s прочитан не полностью\n", path);
+        }
+    }
+    entry->image_size = done;
+    return done;
+}
+
+// Новые записи -c и -a от подготовки до записи данных: смещения их образов
+// в промежуточном файле
+typedef struct {
+    int first;        // номер первой новой записи
+    off_t *images;    // смещение образа записи first + i или -1 - образа нет
+    size_t capacity;
+    off_t stage_end;  // конец занятой части промежуточного файла
+} StagedEntries;
+
+static void staged_set(StagedEntries *staged, int n, off_t image) {
+    size_t index = n - staged->first;
+    if (index >= staged->capacity) {
+        staged->capacity = grow_capacity(staged->capacity, index + 1);
+        staged->images = realloc(staged->images, staged->capacity * sizeof(off_t));
+    }
+    staged->images[index] = image;
+}
+
+// Подготовка файла input к упаковке: новая запись (и новые куски при
+// дедупликации), сжатие или нарезка на куски в промежуточный файл, размеры
+// и CRC образа у копий, при коде k+m - размеры шардов. Смещения копий
+// остаются нулевыми - копии еще не размещены. Возвращает 0 или -1, если
+// файл не открылся (записи нет).
+static int prepare_entry(Catalog *catalog, const InputFile *input, int redundancy, ChunkStore *store, int stage_fd,
+                         StagedEntries *staged, uint8_t *buffer) {
+    int n = catalog_add_input(catalog, input, archive_dedup ? 0 : redundancy);
+    off_t size = input->st.st_size, image = -1;
+    BlockCrcs crcs = {0};
+    if (archive_dedup) {
+        image = staged->stage_end;
+        if (dedup_entry(store, catalog, n, input->path, size, redundancy, stage_fd, &staged->stage_end, buffer) < 0) {
+            catalog_truncate(catalog, n);
+            return -1;
+        }
+        // Образы новых кусков лежат подряд в порядке их записей
+        staged_set(staged, n, -1);
+        for (int c = n + 1; c < catalog->count; c++) {
+            staged_set(staged, c, image);
+            image += entry_copies(catalog, c)[0].size;
+        }
+        return 0;
+    }
+    if (stage_fd >= 0) {
+        off_t stored = stage_entry(input->path, size, stage_fd, staged->stage_end, buffer, &catalog->entries[n],
+                                   &crcs);
+        if (stored < 0) {
+            free(crcs.table);
+            catalog_truncate(catalog, n);
+            return -1;
+        }
+        if (stored > 0) {
+            image = staged->stage_end;
+            staged->stage_end += stored;
+            size = stored;
+        }
+    }
+    staged_set(staged, n, image);
+    if (archive_data_shards > 0) {
+        // Таблицы шардов появятся при их записи
+        free(crcs.table);
+        erasure_prepare(catalog, n, size);
+        return 0;
+    }
+    // Несжатому файлу таблица посчитается при записи, сжатому - уже готова
+    uint32_t crc = block_crcs_finish(&crcs);
+    uint32_t *table = image >= 0 ? catalog_add_block_crcs(catalog, n, crcs.blocks) : NULL;
+    if (table) {
+        memcpy(table, crcs.table, crcs.blocks * sizeof(uint32_t));
+    }
+    free(crcs.table);
+    FileCopyMeta *copies = entry_copies(catalog, n);
+    for (int j = 0; j < redundancy; j++) {
+        copies[j].crc = crc;
+        copies[j].size = size;
+    }
+    return 0;
+}
+
+// Раскладка неразмещенных копий (смещение 0, там заголовок архива) записей
+// first.. в хвост с data_end по полосам: полоса j - копии j всех этих
+// записей подряд. Реплики (шарды) одного файла разнесены на длину полосы,
+// и одна испорченная область архива не задевает сразу все. Короткая полоса
+// (пачка из одного маленького файла) добивается до длины самой большой своей
+// копии плюс replica_distance от нее: добивка остается дырой в файле и уходит в
+// карту свободного места free_map, ее займут следующие -a. Пустые копии
+// места не занимают и ставятся в начало данных. В режиме -direct каждая
+// копия начинается с границы DIRECT_ALIGN. Возвращает новый конец данных.
+static off_t place_in_lanes(Catalog *catalog, int first, off_t data_end, FreeMap *free_map) {
+    off_t lane[MAX_REDUNDANCY] = {0}, largest[MAX_REDUNDANCY] = {0}, align = bulk_direct ? DIRECT_ALIGN : 1;
+    int lanes = 0;
+    data_end = (data_end + align - 1) / align * align;
+    for (int n = first; n < catalog->count; n++) {
+        const FileCopyMeta *copies = entry_copies(catalog, n);
+        for (int j = 0; j < catalog->entries[n].copies; j++) {
+            if (copies[j].offset == 0 && copies[j].size > 0) {
+                lane[j] += (copies[j].size + align - 1) / align * align;
+                largest[j] = copies[j].size > largest[j] ? copies[j].size : largest[j];
+                lanes = j + 1 > lanes ? j + 1 : lanes;
+            }
+        }
+    }
+    // Длины полос - в их начала, за последней полосой добивки нет
+    for (int j = 0; j < lanes; j++) {
+        off_t length = lane[j], stride = length;
+        off_t padded = largest[j] + replica_distance(largest[j]);
+        if (j + 1 < lanes && padded > stride) {
+            stride = (padded + align - 1) / align * align;
+            free_map_add(free_map, data_end + length, stride - length);
+        }
+        lane[j] = data_end;
+        data_end += stride;
+    }
+    for (int n = first; n < catalog->count; n++) {
+        FileCopyMeta *copies = entry_copies(catalog, n);
+        for (int j = 0; j < catalog->entries[n].copies; j++) {
+            if (copies[j].offset == 0 && copies[j].size == 0) {
+                copies[j].offset = ARCHIVE_HEADER_SIZE;
+            } else if (copies[j].offset == 0) {
+                copies[j].offset = lane[j];
+                lane[j] += (copies[j].size + align - 1) / align * align;
+            }
+        }
+    }
+    return data_end;
+}
+
+// Данные записей first.. по размещенным смещениям: образ из промежуточного
+// файла копируется в каждую реплику, при коде k+m режется на шарды,
+// остальные файлы читаются потоково. Запись файла, который не открылся,
+// становится надгробием - ее место освободят -a и -vacuum.
+static void write_entries(int arch_fd, int direct_fd, Catalog *catalog, int first, const StagedEntries *staged,
+                          int stage_fd, uint8_t *buffer, IoQueue *queue) {
+    for (int i = first; i < catalog->count; i++) {
+        CatalogEntry *entry = &catalog->entries[i];
+        FileCopyMeta *copies = entry_copies(catalog, i);
+        off_t image = staged->images[i - staged->first], result = 0;
+        if (entry->flags & ENTRY_CHUNKED) {
+            continue;
+        }
+        if (entry->flags & ENTRY_ERASURE) {
+            result = erasure_entry(arch_fd, direct_fd, catalog, i, entry_name(catalog, i),
+                                   image >= 0 ? stage_fd : -1, image >= 0 ? image : 0);
+        } else if (image >= 0 && direct_fd >= 0) {
+            // -direct: сжатый образ и куски -D идут в реплики тем же путем, что и файлы
+            if (replicate_range(stage_fd, image, copies[0].size, "Промежуточный файл", arch_fd, direct_fd, copies,
+                                entry->copies, NULL, queue) != copies[0].size) {
+                printf("Ошибка чтения промежуточного файла\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (image >= 0) {
+            for (int j = 0; j < entry->copies; j++) {
+                if (copy_range(stage_fd, image, arch_fd, copies[j].offset, copies[j].size, buffer) != 0) {
+                    perror("Ошибка записи архива");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        } else {
+            BlockCrcs crcs = {0};
+            result = ingest_file(arch_fd, direct_fd, copies, entry->copies, entry_name(catalog, i), copies[0].size,
+                                 &crcs, queue);
+            uint32_t *table = result > 0 ? catalog_add_block_crcs(catalog, i, crcs.blocks) : NULL;
+            if (table) {
+                memcpy(table, crcs.table, crcs.blocks * sizeof(uint32_t));
+            }
+            free(crcs.table);
+        }
+        if (result < 0) {
+            entry->flags |= ENTRY_DELETED;
+        }
+    }
+}
+
+// -c пишет данные пачками: пачка закрывается, когда ее полоса дорастает до
+// PLACEMENT_LANE_SIZE, так что промежуточный файл не растет больше пачки, а
+// реплики файла отстоят друг от друга на длину полосы пачки.
+#define PLACEMENT_LANE_SIZE (64 * 1024 * 1024)
+
+void create_archive(const char *archive_name, const InputList *inputs, int redundancy) {
+    FILE *arch = fopen(archive_name, "wb");
+    if (!arch) {
+        perror("Ошибка открытия архива");
+        exit(EXIT_FAILURE);
+    }
+
+    // Заголовок пока нулевой: до фиксации архив не читается
+    uint8_t header[ARCHIVE_HEADER_SIZE] = {0};
+    fwrite(header, 1, sizeof(header), arch);
+    fflush(arch);
+
+    // Все метаданные собираются в памяти и записываются один раз в конце.
+    // Данные идут через один буфер фиксированного размера на весь архив.
+    // Сжимаемый файл сначала сжимается в промежуточный файл, потом образ
+    // копируется в реплики; так же при дедупликации - новые куски файла.
+    // При коде k+m образ (или сам файл) режется на шарды. Несжатые файлы
+    // идут через очередь асинхронного ввода-вывода.
+    uint8_t *buffer = malloc(INGEST_BUFFER_SIZE);
+    IoQueue queue;
+    io_queue_init(&queue, IO_QUEUE_DEPTH);
+    int direct_fd = open_direct(archive_name);
+    int stage_fd = archive_codec != CODEC_STORED || archive_dedup ? open_staging(archive_name) : -1;
+    if (archive_dedup && stage_fd < 0) {
+        perror("Ошибка создания промежуточного файла");
+        exit(EXIT_FAILURE);
+    }
+    off_t data_end = ARCHIVE_HEADER_SIZE, lane = 0;
+    Catalog catalog = {0};
+    FreeMap free_map = {0};  // добивка между полосами
+    ChunkStore store;
+    chunk_store_init(&store, &catalog);
+    StagedEntries staged = {0};
+    catalog_reserve(&catalog, inputs->count, 0, (size_t)inputs->count * redundancy);
+    for (int i = 0; i < inputs->count; i++) {
+        int n = catalog.count;
+        if (prepare_entry(&catalog, &inputs->files[i], redundancy, &store, stage_fd, &staged, buffer) == 0) {
+            for (; n < catalog.count; n++) {
+                lane += catalog.entries[n].copies > 0 ? entry_copies(&catalog, n)[0].size : 0;
+            }
+        }
+        if (lane >= PLACEMENT_LANE_SIZE || i == inputs->count - 1) {
+            data_end = place_in_lanes(&catalog, staged.first, data_end, &free_map);
+            write_entries(fileno(arch), direct_fd, &catalog, staged.first, &staged, stage_fd, buffer, &queue);
+            staged.first = catalog.count;
+            staged.stage_end = 0;
+            lane = 0;
         }
     }
-    free(meta);
-}
-
-FileMeta* read_metadata(FILE *arch, int file_count) {
-    FileMeta *meta_array = malloc(file_count * sizeof(FileMeta));
-    for (int i = 0; i < file_count; i++) {
-        fread(&meta_array[i], offsetof(FileMeta, copy_meta), 1, arch);
-        meta_array[i].copy_meta = malloc(meta_array[i].copies * sizeof(FileCopyMeta));
-        fread(meta_array[i].copy_meta, sizeof(FileCopyMeta), meta_array[i].copies, arch);
+    io_queue_free(&queue);
+    if (direct_fd >= 0) {
+        close(direct_fd);
     }
-    return meta_array;
-}
-
-// Запись метаданных
-void write_metadata(FILE *arch, FileMeta *meta_array, int file_count) {
-    for (int i = 0; i < file_count; i++) {
-        fwrite(&meta_array[i], offsetof(FileMeta, copy_meta), 1, arch);
-        fwrite(meta_array[i].copy_meta, sizeof(FileCopyMeta), meta_array[i].copies, arch);
+    free(buffer);
+    free(staged.images);
+    chunk_store_free(&store);
+    if (stage_fd >= 0) {
+        close(stage_fd);
     }
+
+    // Записываем метаданные сразу за данными
+    fseek(arch, data_end, SEEK_SET);
+    write_footer(arch, &catalog, &free_map);
+
+    // Обновляем смещение метаданных в начале файла
+    commit_header(arch, data_end);
+    drop_archive_cache(arch);
+
+    free_free_map(&free_map);
+    catalog_free(&catalog);
+    fclose(arch);
 }
 
-void verify_archive(const char *archive_name) {
-    FILE *arch = fopen(archive_name, "rb");
+// Удаление файла из архива за O(1) по данным: запись в метаданных
+// помечается надгробием (стирается первый байт имени), место ее реплик
+// возвращается ФС через FALLOC_FL_PUNCH_HOLE. Сжатие архива - отдельная
+// команда -vacuum.
+void delete_from_archive(const char *archive_name, const char *file_to_delete) {
+    FILE *arch = fopen(archive_name, "r+b");
     if (!arch) {
         perror("Ошибка открытия архива");
-        return;
+        exit(EXIT_FAILURE);
     }
 
-    // Читаем смещение метаданных из начала файла
-    long meta_offset;
-    if (fread(&meta_offset, sizeof(long), 1, arch) != 1) {
-        printf("Ошибка чтения смещения метаданных!\n");
+    // Читаем заголовок
+    ArchiveView view;
+    ArchiveHeader header;
+    if (read_archive_file_header(arch, &view, &header) != 0) {
         fclose(arch);
-        return;
+        exit(EXIT_FAILURE);
     }
-
-    // Читаем количество файлов
-    int file_count;
-    if (fread(&file_count, sizeof(int), 1, arch) != 1) {
-        printf("Ошибка чтения количества файлов!\n");
-        fclose(arch);
-        return;
+    int fd = view.fd;
+
+    // Записи с этим именем ищем по индексу; без индекса - перебором. Для
+    // файла из кусков нужен весь каталог: удаляются и куски, на которые
+    // больше никто не ссылается
+    Catalog matches = {0};
+    long *entry_offsets;
+    int found = find_entries(&view, &header, file_to_delete, &matches, &entry_offsets);
+    for (int i = 0; i < found; i++) {
+        if (matches.entries[i].flags & ENTRY_CHUNKED) {
+            free(entry_offsets);
+            catalog_free(&matches);
+            found = -1;
+        }
+    }
+    if (found < 0) {
+        int total_files = header.file_count;
+        entry_offsets = malloc((total_files > 0 ? total_files : 1) * sizeof(long));
+        if (read_archive_footer(&view, &header, &matches, NULL, entry_offsets) != 0) {
+            free(entry_offsets);
+            fclose(arch);
+            exit(EXIT_FAILURE);
+        }
+        // Ссылки на куски от файлов, которые остаются; кусок удаляемого
+        // файла без таких ссылок помечается -1
+        int *references = calloc(matches.count > 0 ? matches.count : 1, sizeof(int));
+        for (int pass = 0; pass < 2; pass++) {
+            for (int i = 0; i < matches.count; i++) {
+                if (is_tombstone(&matches, i) || !(matches.entries[i].flags & ENTRY_CHUNKED) ||
+                    (strcmp(entry_name(&matches, i), file_to_delete) == 0) != pass) {
+                    continue;
+                }
+                const uint32_t *refs = entry_chunks(&matches, i);
+                for (uint32_t k = 0; k < matches.entries[i].chunks; k++) {
+                    if (pass == 0) {
+                        references[refs[k]]++;
+                    } else if (references[refs[k]] == 0) {
+                        references[refs[k]] = -1;
+                    }
+                }
+            }
+        }
+        // Оставляем в каталоге только живые записи с этим именем и их куски
+        found = 0;
+        for (int i = 0; i < matches.count; i++) {
+            if (is_tombstone(&matches, i)) {
+                continue;
+            }
+            if (is_chunk(&matches, i) ? references[i] < 0 : strcmp(entry_name(&matches, i), file_to_delete) == 0) {
+                matches.entries[found] = matches.entries[i];
+                entry_offsets[found++] = entry_offsets[i];
+            }
+        }
+        matches.count = found;
+        free(references);
     }
 
-    // Переходим к метаданным
-    fseek(arch, meta_offset, SEEK_SET);
-
-    // Читаем метаданные
-    FileMeta *meta_array = read_metadata(arch, file_count);
-    if (!meta_array) {
-        printf("Ошибка чтения метаданных!\n");
+    if (found == 0) {
+        printf("Файл '%s' не найден в архиве!\n", file_to_delete);
+        free(entry_offsets);
+        catalog_free(&matches);
         fclose(arch);
         return;
     }
 
-    // Проверяем каждый файл
-    for (int i = 0; i < file_count; i++) {
-        printf("Проверка файла: %s\n", meta_array[i].name);
-
-        for (int j = 0; j < meta_array[i].copies; j++) {
-            // Переходим к данным копии файла
-            fseek(arch, meta_array[i].copy_meta[j].offset, SEEK_SET);
+    // Помечаем надгробием все живые записи с этим именем
+    printf("Файл '%s' найден для удаления.\n", file_to_delete);
+    for (int i = 0; i < found; i++) {
+        mark_tombstone(fd, &header, entry_offsets[i], matches.entries[i].flags);
+    }
 
-            // Читаем данные
-            uint8_t *data = malloc(meta_array[i].copy_meta[j].size);
-            if (!data) {
-                perror("Ошибка выделения памяти");
+    // Сначала на диск уходит надгробие, только потом освобождается место
+    fsync(fd);
+    int punch_supported = 1;
+    for (int i = 0; i < found && punch_supported; i++) {
+        const FileCopyMeta *copies = entry_copies(&matches, i);
+        for (int j = 0; j < matches.entries[i].copies; j++) {
+            if (copies[j].size == 0) {
                 continue;
             }
-            fread(data, 1, meta_array[i].copy_meta[j].size, arch);
-
-            // Вычисляем CRC32 для данных
-            uint32_t calculated_crc = calculate_crc32_buffer(data, meta_array[i].copy_meta[j].size);
-
-            // Сравниваем с CRC32 из метаданных
-            if (calculated_crc == meta_array[i].copy_meta[j].crc) {
-                printf("  Копия %d: OK (CRC32: %08x)\n", j + 1, calculated_crc);
-            } else {
-                printf("  Копия %d: ОШИБКА (ожидалось: %08x, получено: %08x)\n",
-                       j + 1, meta_array[i].copy_meta[j].crc, calculated_crc);
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, copies[j].offset, copies[j].size) != 0) {
+                if (errno == EOPNOTSUPP) {
+                    printf("ФС не поддерживает освобождение места, используйте -vacuum\n");
+                    punch_supported = 0;
+                    break;
+                }
+                perror("Ошибка освобождения места");
             }
-
-            free(data);
         }
     }
 
     // Освобождаем память
-    free_metadata(meta_array, file_count);
+    free(entry_offsets);
+    catalog_free(&matches);
     fclose(arch);
-}
-
-void extract_archive(const char *archive_name, const char *output_dir, const char *file_to_extract) {
-    FILE *arch = fopen(archive_name, "rb");
-    if (!arch) {
-        perror("Ошибка открытия архива");
-        exit(EXIT_FAILURE);
-    }
 
-    // Читаем смещение метаданных
-    long meta_offset;
-    fread(&meta_offset, sizeof(long), 1, arch);
-
-    // Читаем количество файлов
-    int file_count;
-    fread(&file_count, sizeof(int), 1, arch);
-
-    // Переходим к метаданным
-    fseek(arch, meta_offset, SEEK_SET);
-    FileMeta *meta_array = read_metadata(arch, file_count);
+    printf("Файл '%s' успешно удален из архива.\n", file_to_delete);
+}
 
-    // Восстанавливаем файлы
-    int c;
-    for (int i = 0; i < file_count; i++) {
-        FileMeta *meta = &meta_array[i];
+static int compare_copy_offset(const void *a, const void *b) {
+    off_t x = (*(FileCopyMeta *const *)a)->offset, y = (*(FileCopyMeta *const *)b)->offset;
+    return (x > y) - (x < y);
+}
 
-        // Если указан конкретный файл, пропускаем остальные
-        if (file_to_extract && strcmp(meta->name, file_to_extract) != 0) {
-            continue;
+// Карта свободных промежутков между репликами (live отсортирован по
+// смещению) в области данных [start, end)
+void free_map_from_live(FileCopyMeta **live, int live_count, off_t start, off_t end, FreeMap *map) {
+    map->count = 0;
+    off_t position = start;
+    for (int i = 0; i <= live_count; i++) {
+        off_t next = i < live_count ? live[i]->offset : end;
+        if (next > position) {
+            free_map_add(map, position, next - position);
         }
+        if (i < live_count && live[i]->offset + live[i]->size > position) {
+            position = live[i]->offset + live[i]->size;
+        }
+    }
+    free_map_normalize(map);
+}
 
-        char path[512];
-        snprintf(path, sizeof(path), "%s/%s", output_dir, meta->name);
-
-        // Проверяем, существует ли файл
-        if (access(path, F_OK) == 0) {
-            printf("Файл %s уже существует. Перезаписать? [y/N] ", path);
-            //c = getchar();
-            while (getchar() != '\n');
-            //if (c == 'y' || c != 'Y' || c != 'n' || c != 'N')
-            if (c != 'y' && c != 'Y') {
-                continue; // Пропускаем файл, если пользователь не хочет перезаписывать
-            }
+// Конец области данных: последний байт живых реплик
+static off_t live_data_end(FileCopyMeta **live, int live_count, off_t data_start) {
+    off_t data_end = data_start;
+    for (int r = 0; r < live_count; r++) {
+        if (live[r]->offset + live[r]->size > data_end) {
+            data_end = live[r]->offset + live[r]->size;
         }
-	
-        int extracted = 0;
-        for (int j = 0; j < meta->copies && !extracted; j++) {
-            // Переходим к данным файла
-            fseek(arch, meta->copy_meta[j].offset, SEEK_SET);
-
-            // Выделяем память для данных
-            uint8_t *data = malloc(meta->copy_meta[j].size);
-            if (!data) {
-                perror("Ошибка выделения памяти");
+    }
+    return data_end;
+}
+
+// Проход сжатия: свободные промежутки в [data_start, limit), реплики с конца
+// переносятся в самый нижний подходящий промежуток не ближе replica_distance
+// к другим копиям той же записи. Внутри промежутка пробуется и место сразу
+// за зазором от соседней копии, иначе копия никогда не попадет в большой
+// промежуток, начало которого лежит рядом с ее соседкой. Освобожденное
+// переносом место в этом проходе не используется. При fd < 0 данные не
+// копируются - меняются только смещения (оценка для порога). Возвращает
+// число перенесенных реплик.
+static int vacuum_pass(Catalog *catalog, FileCopyMeta **live, int live_count, const int *copy_entry,
+                       off_t data_start, off_t limit, off_t block, int fd, uint8_t *buffer, off_t *moved_bytes,
+                       FreeMap *free_map) {
+    qsort(live, live_count, sizeof(FileCopyMeta *), compare_copy_offset);
+    free_map_from_live(live, live_count, data_start, limit, free_map);
+    Extent *extents = free_map->extents;
+    int extent_count = free_map->count;
+
+    int moved = 0;
+    for (int r = live_count - 1; r >= 0; r--) {
+        FileCopyMeta *copy = live[r];
+        const CatalogEntry *entry = &catalog->entries[copy_entry[copy - catalog->copies]];
+        const FileCopyMeta *siblings = catalog->copies + entry->first_copy;
+        int self = copy - siblings;
+        for (int e = 0; e < extent_count && extents[e].offset < copy->offset; e++) {
+            off_t extent_end = extents[e].offset + extents[e].size;
+            off_t target = apart_offset(extents[e].offset, extent_end, copy->size, siblings, entry->copies, self);
+            if (target < 0 || target >= copy->offset) {
                 continue;
             }
-
-            // Читаем данные
-            fread(data, 1, meta->copy_meta[j].size, arch);
-
-            // Проверяем CRC32
-            uint32_t actual_crc = calculate_crc32_buffer(data, meta->copy_meta[j].size);
-            if (actual_crc == meta->copy_meta[j].crc) {
-                // Создаем директорию, если она не существует
-                char *dir_path = strdup(path);
-                char *last_slash = strrchr(dir_path, '/');
-                if (last_slash) {
-                    *last_slash = '\0'; // Отделяем путь к директории
-                    mkdir(dir_path, 0777); // Создаем директорию с правами 0777
-                }
-                free(dir_path);
-
-                // Записываем данные в файл
-                FILE *out = fopen(path, "wb");
-                if (!out) {
-                    perror("Ошибка создания файла");
-                    free(data);
-                    continue;
+            if (copy->size >= REFLINK_MIN_SIZE && !reflink_disabled) {
+                // То же смещение внутри блока, что и у копии, - для reflink;
+                // если не помещается, переносим как есть
+                off_t aligned = target + ((copy->offset - target) % block + block) % block;
+                if (aligned + copy->size <= extent_end && aligned < copy->offset &&
+                    copies_apart(aligned, copy->size, siblings, entry->copies, self)) {
+                    target = aligned;
                 }
-                fwrite(data, 1, meta->copy_meta[j].size, out);
-                fclose(out);
-
-                // Восстанавливаем метаданные
-                chmod(path, meta->mode);
-                chown(path, meta->uid, meta->gid);
-                struct utimbuf times = {meta->atime, meta->mtime};
-                utime(path, &times);
-
-                extracted = 1;
-                printf("Файл %s восстановлен из копии %d\n", path, j + 1);
             }
-            free(data);
-        }
-        if (!extracted) {
-            printf("ОШИБКА: Все копии файла %s повреждены!\n", path);
+            if (fd >= 0 && copy_range(fd, copy->offset, fd, target, copy->size, buffer) != 0) {
+                perror("Ошибка переноса реплики");
+                break;
+            }
+            extents[e].offset = target + copy->size;
+            extents[e].size = extent_end - extents[e].offset;
+            copy->offset = target;
+            if (moved_bytes) {
+                *moved_bytes += copy->size;
+            }
+            moved++;
+            break;
         }
     }
+    return moved;
+}
 
-    // Освобождаем память
-    for (int i = 0; i < file_count; i++) {
-        free(meta_array[i].copy_meta);
+// Перенос метаданных вплотную к данным. Сначала новые метаданные
+// фиксируются в конце файла, если новое место пересекается с действующими
+// метаданными или если в этом проходе переносились реплики: зафиксированные
+// метаданные еще ссылаются на их старые места, а те могут лежать за data_end.
+static void commit_compact_footer(FILE *arch, const Catalog *catalog, const FreeMap *free_map,
+                                  off_t data_end, int moved, long *meta_offset, off_t *file_end) {
+    long size = footer_size(catalog, free_map);
+    if (moved > 0 || data_end + size > *meta_offset) {
+        fseek(arch, *file_end, SEEK_SET);
+        write_footer(arch, catalog, free_map);
+        commit_header(arch, *file_end);
+        *meta_offset = *file_end;
     }
-    free(meta_array);
-    fclose(arch);
+    fseek(arch, data_end, SEEK_SET);
+    write_footer(arch, catalog, free_map);
+    commit_header(arch, data_end);
+    if (ftruncate(fileno(arch), data_end + size) != 0) {
+        perror("Ошибка усечения архива");
+    }
+    *meta_offset = data_end;
+    *file_end = data_end + size;
 }
 
-void list_archive(const char *archive_name) {
-    FILE *arch = fopen(archive_name, "rb");
+// Сжатие архива на месте: реплики переносятся в свободные промежутки ниже
+// себя, начиная с самых дальних, надгробия удаляются из метаданных, хвост
+// файла обрезается. Реплика пишется только в место, на которое не ссылаются
+// зафиксированные метаданные, и после каждого прохода метаданные
+// фиксируются, поэтому сбой в любой момент оставляет архив целым.
+void vacuum_archive(const char *archive_name, int threshold) {
+    FILE *arch = fopen(archive_name, "r+b");
     if (!arch) {
         perror("Ошибка открытия архива");
         exit(EXIT_FAILURE);
     }
 
-    // Читаем смещение метаданных
-    long meta_offset;
-    fread(&meta_offset, sizeof(long), 1, arch);
-
-    // Читаем количество файлов
-    int file_count;
-    fread(&file_count, sizeof(int), 1, arch);
-
-    // Переходим к метаданным
-    fseek(arch, meta_offset, SEEK_SET);
-    FileMeta *meta_array = read_metadata(arch, file_count);
-
-    // Выводим информацию
-    printf("Архив: %s\n", archive_name);
-    printf("Файлов: %d\n", file_count);
-    for (int i = 0; i < file_count; i++) {
-        printf("Файл: %s\n", meta_array[i].name);
-        printf("Копий: %d\n", meta_array[i].copies);
-        for (int j = 0; j < meta_array[i].copies; j++) {
-            printf("  Копия %d: CRC32=%08x, Размер=%ld, Смещение=%ld\n",
-                   j + 1, meta_array[i].copy_meta[j].crc,
-                   (long)meta_array[i].copy_meta[j].size,
-                   (long)meta_array[i].copy_meta[j].offset);
-        }
+    ArchiveView view;
+    ArchiveHeader header;
+    if (read_archive_file_header(arch, &view, &header) != 0) {
+        fclose(arch);
+        exit(EXIT_FAILURE);
     }
-
-    fclose(arch);
-    free_metadata(meta_array, file_count);
-}
-void create_archive(const char *archive_name, int file_count, char *files[], int redundancy) {
-    FILE *arch = fopen(archive_name, "wb");
-    if (!arch) {
-        perror("Ошибка открытия архива");
+    Catalog catalog = {0};
+    if (read_archive_footer(&view, &header, &catalog, NULL, NULL) != 0) {
+        fclose(arch);
         exit(EXIT_FAILURE);
     }
-
-    // Записываем временное значение смещения метаданных (0)
-    long meta_offset = 0;
-    fwrite(&meta_offset, sizeof(long), 1, arch);
-
-    // Записываем количество файлов
-    fwrite(&file_count, sizeof(int), 1, arch);
-
-    FileMeta *meta_array = malloc(file_count * sizeof(FileMeta));
+    long meta_offset = header.meta_offset;
+    int total_files = header.file_count;
+    struct stat st;
+    fstat(fileno(arch), &st);
+    off_t file_end = st.st_size;
+
+    // Убираем надгробия, собираем живые реплики: после этого копии живых
+    // записей лежат в каталоге подряд
+    catalog_drop_tombstones(&catalog);
+    int file_count = catalog.count;
+    FileCopyMeta **live = malloc((catalog.copy_count > 0 ? catalog.copy_count : 1) * sizeof(FileCopyMeta *));
+    int live_count = 0;
+    off_t live_bytes = 0;
+    off_t data_start = ARCHIVE_HEADER_SIZE;
+    // Запись каждой копии: перенос сверяется с остальными ее копиями
+    int *copy_entry = malloc((catalog.copy_count > 0 ? catalog.copy_count : 1) * sizeof(int));
     for (int i = 0; i < file_count; i++) {
-        struct stat st;
-        lstat(files[i], &st);
-        strncpy(meta_array[i].name, files[i], 255);
-        meta_array[i].mode = st.st_mode;
-        meta_array[i].uid = st.st_uid;
-        meta_array[i].gid = st.st_gid;
-        meta_array[i].atime = st.st_atime;
-        meta_array[i].mtime = st.st_mtime;
-        meta_array[i].copies = redundancy;
-        meta_array[i].copy_meta = malloc(redundancy * sizeof(FileCopyMeta));
-
-        FILE *file = fopen(files[i], "rb");
-        fseek(file, 0, SEEK_END);
-        off_t file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        uint8_t *file_data = malloc(file_size);
-        fread(file_data, 1, file_size, file);
-        fclose(file);
-
-        for (int j = 0; j < redundancy; j++) {
-            meta_array[i].copy_meta[j].offset = ftell(arch);
-            meta_array[i].copy_meta[j].size = file_size;
-            meta_array[i].copy_meta[j].crc = calculate_crc32_buffer(file_data, file_size);
-            fwrite(file_data, 1, file_size, arch);
-        }
-        free(file_data);
-    }
-
-    // Записываем метаданные
-    meta_offset = ftell(arch); // Текущая позиция — это начало метаданных
-    write_metadata(arch, meta_array, file_count);
-
-    // Обновляем смещение метаданных в начале файла
-    fseek(arch, 0, SEEK_SET);
-    fwrite(&meta_offset, sizeof(long), 1, arch);
-
-    free_metadata(meta_array, file_count);
-    fclose(arch);
-}
-
-void delete_from_archive(const char *archive_name, const char *file_to_delete) {
-    FILE *src_arch = fopen(archive_name, "rb");
-    if (!src_arch) {
-        perror("Ошибка открытия архива");
-        exit(EXIT_FAILURE);
+        for (int j = 0; j < catalog.entries[i].copies; j++) {
+            copy_entry[catalog.entries[i].first_copy + j] = i;
+        }
     }
-
-    // Читаем смещение метаданных
-    long meta_offset;
-    fread(&meta_offset, sizeof(long), 1, src_arch);
-
-    // Читаем количество файлов
-    int total_files;
-    fread(&total_files, sizeof(int), 1, src_arch);
-
-    // Переходим к метаданным
-    fseek(src_arch, meta_offset, SEEK_SET);
-    FileMeta *orig_meta = read_metadata(src_arch, total_files);
-    fclose(src_arch);
-
-    // Фильтруем файлы для сохранения
-    FileMeta *new_meta = malloc(total_files * sizeof(FileMeta));
-    int new_count = 0;
-    int found = 0;
-
-    for (int i = 0; i < total_files; i++) {
-        // Сравниваем имена файлов
-        if (strcmp(orig_meta[i].name, file_to_delete) == 0) {
-            printf("Файл '%s' найден для удаления.\n", file_to_delete);
-            free(orig_meta[i].copy_meta); // Освобождаем память для копий
-            found = 1;
+    for (size_t c = 0; c < catalog.copy_count; c++) {
+        if (catalog.copies[c].size > 0) {
+            live[live_count++] = &catalog.copies[c];
+            live_bytes += catalog.copies[c].size;
         } else {
-            // Копируем метаданные в новый массив
-            new_meta[new_count] = orig_meta[i];
-            new_meta[new_count].copy_meta = malloc(orig_meta[i].copies * sizeof(FileCopyMeta));
-            memcpy(new_meta[new_count].copy_meta, orig_meta[i].copy_meta, orig_meta[i].copies * sizeof(FileCopyMeta));
-            new_count++;
+            // Пустые копии не переносятся: ставим их в начало данных, иначе
+            // после усечения архива они окажутся за его концом
+            catalog.copies[c].offset = data_start;
         }
     }
 
-    if (!found) {
-        printf("Файл '%s' не найден в архиве!\n", file_to_delete);
-        free_metadata(orig_meta, total_files);
-        free(new_meta);
+    // Порог сравнивается с тем, что сжатие действительно вернет: добивка
+    // полос и промежутки, нужные для зазора между копиями, остаются. Для
+    // оценки проходы выполняются без переноса данных.
+    int fd = fileno(arch);
+    off_t block = st.st_blksize > 0 ? st.st_blksize : 4096;
+    FreeMap free_map = {0};
+    off_t *planned = malloc((catalog.copy_count > 0 ? catalog.copy_count : 1) * sizeof(off_t));
+    for (size_t c = 0; c < catalog.copy_count; c++) {
+        planned[c] = catalog.copies[c].offset;
+    }
+    off_t compact_end = meta_offset;
+    while (vacuum_pass(&catalog, live, live_count, copy_entry, data_start, compact_end, block, -1, NULL, NULL,
+                       &free_map) > 0) {
+        compact_end = live_data_end(live, live_count, data_start);
+    }
+    compact_end = live_data_end(live, live_count, data_start);
+    for (size_t c = 0; c < catalog.copy_count; c++) {
+        catalog.copies[c].offset = planned[c];
+    }
+    free(planned);
+
+    off_t data_area = meta_offset - data_start;
+    off_t dead = data_area - live_bytes, reclaimable = meta_offset - compact_end;
+    printf("Данные: %.1f МБ, из них свободно %.1f МБ, сжатие вернет %.1f МБ (%.1f%%), удаленных записей: %d\n",
+           data_area / 1e6, dead / 1e6, reclaimable / 1e6, data_area > 0 ? reclaimable * 100.0 / data_area : 0.0,
+           total_files - file_count);
+    if (reclaimable * 100 < (off_t)threshold * data_area || (reclaimable <= 0 && total_files == file_count)) {
+        printf("Фрагментация ниже порога %d%%, сжатие не требуется\n", threshold);
+        free_free_map(&free_map);
+        free(live);
+        free(copy_entry);
+        catalog_free(&catalog);
+        fclose(arch);
         return;
     }
 
-    // Создаем временный архив
-    char tmp_name[] = "temp_archXXXXXX";
-    int tmp_fd = mkstemp(tmp_name);
-    FILE *tmp_arch = fdopen(tmp_fd, "wb");
-
-    // Записываем временное значение смещения метаданных (0)
-    long new_meta_offset = 0;
-    fwrite(&new_meta_offset, sizeof(long), 1, tmp_arch);
-
-    // Записываем новое количество файлов
-    fwrite(&new_count, sizeof(int), 1, tmp_arch);
-
-    // Копируем данные с обновлением смещений
-    for (int i = 0; i < new_count; i++) {
-        FILE *src = fopen(archive_name, "rb");
-        for (int copy_num = 0; copy_num < new_meta[i].copies; copy_num++) {
-            off_t orig_offset = new_meta[i].copy_meta[copy_num].offset;
-            off_t size = new_meta[i].copy_meta[copy_num].size;
-
-            // Обновляем смещение в новых метаданных
-            new_meta[i].copy_meta[copy_num].offset = ftell(tmp_arch);
-
-            // Копируем данные из исходного архива
-            fseek(src, orig_offset, SEEK_SET);
-            uint8_t buffer[BUFFER_SIZE];
-            off_t remaining = size;
-            while (remaining > 0) {
-                size_t to_read = remaining > BUFFER_SIZE ? BUFFER_SIZE : remaining;
-                size_t bytes_read = fread(buffer, 1, to_read, src);
-                fwrite(buffer, 1, bytes_read, tmp_arch);
-                remaining -= bytes_read;
-            }
+    uint8_t *buffer = malloc(VERIFY_BUFFER_SIZE);
+    off_t moved_bytes = 0;
+    for (;;) {
+        // Свободные промежутки считаем относительно зафиксированных метаданных
+        int moved = vacuum_pass(&catalog, live, live_count, copy_entry, data_start, meta_offset, block, fd, buffer,
+                                &moved_bytes, &free_map);
+
+        // Оставшиеся промежутки внутри данных попадают в карту свободного места
+        off_t data_end = live_data_end(live, live_count, data_start);
+        qsort(live, live_count, sizeof(FileCopyMeta *), compare_copy_offset);
+        free_map_from_live(live, live_count, data_start, data_end, &free_map);
+        commit_compact_footer(arch, &catalog, &free_map, data_end, moved, &meta_offset, &file_end);
+        if (moved == 0) {
+            break;
         }
-        fclose(src);
     }
+    free_free_map(&free_map);
 
-    // Записываем новые метаданные
-    new_meta_offset = ftell(tmp_arch);
-    write_metadata(tmp_arch, new_meta, new_count);
-
-    // Обновляем смещение метаданных в начале файла
-    fseek(tmp_arch, 0, SEEK_SET);
-    fwrite(&new_meta_offset, sizeof(long), 1, tmp_arch);
-
-    // Финализируем операции
-    fclose(tmp_arch);
-    remove(archive_name);
-    rename(tmp_name, archive_name);
-
-    // Освобождаем память
-    //free_metadata(orig_meta, total_files);
-    //free_metadata(new_meta, new_count);
-
-    printf("Файл '%s' успешно удален из архива.\n", file_to_delete);
+    printf("Перенесено %.1f МБ, новый размер архива: %.1f МБ\n", moved_bytes / 1e6, file_end / 1e6);
+    free(buffer);
+    free(live);
+    free(copy_entry);
+    catalog_free(&catalog);
+    fclose(arch);
 }
 
 
-void add_to_archive(const char *archive_name, int new_file_count, char *new_files[], int redundancy) {
-    FILE *old_arch = fopen(archive_name, "rb");
-    if (!old_arch) {
+void add_to_archive(const char *archive_name, const InputList *inputs, int redundancy) {
+    FILE *arch = fopen(archive_name, "r+b");
+    if (!arch) {
         perror("Ошибка открытия архива");
         exit(EXIT_FAILURE);
     }
 
-    // Читаем смещение метаданных
-    long old_meta_offset;
-    fread(&old_meta_offset, sizeof(long), 1, old_arch);
-
-    // Читаем количество файлов
-    int old_file_count;
-    fread(&old_file_count, sizeof(int), 1, old_arch);
-
-    // Читаем старые метаданные
-    fseek(old_arch, old_meta_offset, SEEK_SET);
-    FileMeta *old_meta = read_metadata(old_arch, old_file_count);
-    fclose(old_arch);
-
-    // Создаем временный архив
-    char tmp_name[] = "temp_archXXXXXX";
-    int tmp_fd = mkstemp(tmp_name);
-    FILE *new_arch = fdopen(tmp_fd, "wb");
-
-    // Записываем временное значение смещения метаданных (0)
-    long new_meta_offset = 0;
-    fwrite(&new_meta_offset, sizeof(long), 1, new_arch);
+    // Читаем заголовок, старые метаданные и карту свободного места
+    ArchiveView view;
+    ArchiveHeader header;
+    if (read_archive_file_header(arch, &view, &header) != 0) {
+        fclose(arch);
+        exit(EXIT_FAILURE);
+    }
+    FreeMap free_map = {0};
+    Catalog catalog = {0};
+    if (read_archive_footer(&view, &header, &catalog, &free_map, NULL) != 0) {
+        fclose(arch);
+        exit(EXIT_FAILURE);
+    }
+    long old_meta_offset = header.meta_offset;
+    off_t old_end = view.size;
 
-    // Записываем новое количество файлов
-    int new_total = old_file_count + new_file_count;
-    fwrite(&new_total, sizeof(int), 1, new_arch);
+    if (inputs->count == 0) {
+        free_free_map(&free_map);
+        catalog_free(&catalog);
+        fclose(arch);
+        return;
+    }
 
-    // Копируем данные старых файлов с новыми смещениями
-    for (int i = 0; i < old_file_count; i++) {
-        FILE *src_arch = fopen(archive_name, "rb");
-        for (int j = 0; j < old_meta[i].copies; j++) {
-            off_t orig_offset = old_meta[i].copy_meta[j].offset;
-            off_t size = old_meta[i].copy_meta[j].size;
+    // Место удаленных файлов переходит в карту свободного места
+    reclaim_tombstones(&catalog, &free_map);
+    int live_count = catalog.count;
+    catalog_reserve(&catalog, inputs->count, 0, (size_t)inputs->count * redundancy);
+
+    // Свободный промежуток вплотную к старым метаданным присоединяем к хвосту
+    off_t data_end = old_meta_offset;
+    if (free_map.count > 0 &&
+        free_map.extents[free_map.count - 1].offset + free_map.extents[free_map.count - 1].size == data_end) {
+        data_end = free_map.extents[free_map.count - 1].offset;
+        bucket_remove(&free_map, free_map.count - 1);
+        free_map.count--;
+    }
 
-            old_meta[i].copy_meta[j].offset = ftell(new_arch);
+    // Снимок карты до выделения - для перенесенной копии старых метаданных
+    FreeMap old_map = {0};
+    for (int i = 0; i < free_map.count; i++) {
+        free_map_add(&old_map, free_map.extents[i].offset, free_map.extents[i].size);
+    }
 
-            fseek(src_arch, orig_offset, SEEK_SET);
-            uint8_t buffer[BUFFER_SIZE];
-            off_t remaining = size;
-            while (remaining > 0) {
-                size_t to_read = remaining > BUFFER_SIZE ? BUFFER_SIZE : remaining;
-                size_t bytes_read = fread(buffer, 1, to_read, src_arch);
-                fwrite(buffer, 1, bytes_read, new_arch);
-                remaining -= bytes_read;
+    // Сжимаемые файлы сжимаем заранее в промежуточный файл, туда же при
+    // дедупликации идут новые куски: место выделяется под размер образа.
+    uint8_t *buffer = malloc(INGEST_BUFFER_SIZE);
+    int stage_fd = archive_codec != CODEC_STORED || archive_dedup ? open_staging(archive_name) : -1;
+    if (archive_dedup && stage_fd < 0) {
+        perror("Ошибка создания промежуточного файла");
+        exit(EXIT_FAILURE);
+    }
+    ChunkStore store = {0};
+    if (archive_dedup) {
+        chunk_store_init(&store, &catalog);
+    }
+    StagedEntries staged = {0};
+    staged.first = live_count;
+    for (int i = 0; i < inputs->count; i++) {
+        prepare_entry(&catalog, &inputs->files[i], redundancy, &store, stage_fd, &staged, buffer);
+    }
+    int new_total = catalog.count;
+
+    // Раскладываем реплики новых записей: в наименьшие подходящие свободные
+    // промежутки, не ближе replica_distance друг к другу, - если так
+    // помещаются все копии записи; иначе запись целиком идет в хвост по
+    // полосам, начиная с места старых метаданных. Существующие реплики не
+    // трогаем.
+    off_t reused = 0;
+    for (int n = live_count; n < new_total; n++) {
+        FileCopyMeta *copies = entry_copies(&catalog, n);
+        int placed = 0;
+        while (placed < catalog.entries[n].copies) {
+            off_t offset = free_map_alloc(&free_map, copies[placed].size, copies, placed);
+            if (offset < 0) {
+                break;
             }
+            copies[placed++].offset = offset;
         }
-        fclose(src_arch);
-    }
-
-    // Добавляем новые файлы
-    FileMeta *new_meta = malloc(new_file_count * sizeof(FileMeta));
-    for (int i = 0; i < new_file_count; i++) {
-        struct stat st;
-        if (lstat(new_files[i], &st) != 0) {
-            perror("Ошибка получения метаданных");
+        if (placed < catalog.entries[n].copies) {
+            // Место возвращается в карту; соседние куски сольются при чтении
+            for (int j = 0; j < placed; j++) {
+                free_map_add(&free_map, copies[j].offset, copies[j].size);
+                copies[j].offset = 0;
+            }
             continue;
         }
-
-        strncpy(new_meta[i].name, new_files[i], 255);
-        new_meta[i].mode = st.st_mode;
-        new_meta[i].uid = st.st_uid;
-        new_meta[i].gid = st.st_gid;
-        new_meta[i].atime = st.st_atime;
-        new_meta[i].mtime = st.st_mtime;
-        new_meta[i].copies = redundancy;
-        new_meta[i].copy_meta = malloc(redundancy * sizeof(FileCopyMeta));
-
-        FILE *file = fopen(new_files[i], "rb");
-        fseek(file, 0, SEEK_END);
-        off_t file_size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        uint8_t *file_data = malloc(file_size);
-        fread(file_data, 1, file_size, file);
-        fclose(file);
-
-        for (int j = 0; j < redundancy; j++) {
-            new_meta[i].copy_meta[j].offset = ftell(new_arch);
-            new_meta[i].copy_meta[j].size = file_size;
-            new_meta[i].copy_meta[j].crc = calculate_crc32_buffer(file_data, file_size);
-            fwrite(file_data, 1, file_size, new_arch);
+        for (int j = 0; j < placed; j++) {
+            reused += copies[j].size;
         }
-        free(file_data);
+    }
+    data_end = place_in_lanes(&catalog, live_count, data_end, &free_map);
+
+    // Новые метаданные лягут сразу за данными. Копию старых метаданных
+    // переносим за конец новых и за конец файла, чтобы она не пересекалась
+    // ни с оригиналом, ни с новыми данными.
+    long new_meta_offset = data_end;
+    long new_end = new_meta_offset + footer_size(&catalog, &free_map);
+    long relocated_offset = new_end > old_end ? new_end : old_end;
+
+    // Шаг 1: копия старых метаданных и переключение заголовка на нее.
+    // После этого область старых метаданных свободна.
+    // Копия описывает только старые записи: новые временно скрываем
+    fseek(arch, relocated_offset, SEEK_SET);
+    catalog.count = live_count;
+    long relocated_end = relocated_offset + write_footer(arch, &catalog, &old_map);
+    catalog.count = new_total;
+    commit_header(arch, relocated_offset);
+    free_free_map(&old_map);
+    chunk_store_repoint(&store, &catalog, live_count);
+
+    // Шаг 2: данные новых файлов
+    IoQueue queue;
+    io_queue_init(&queue, IO_QUEUE_DEPTH);
+    int direct_fd = open_direct(archive_name);
+    write_entries(fileno(arch), direct_fd, &catalog, live_count, &staged, stage_fd, buffer, &queue);
+    io_queue_free(&queue);
+    if (direct_fd >= 0) {
+        close(direct_fd);
+    }
+    free(buffer);
+    free(staged.images);
+    chunk_store_free(&store);
+    if (stage_fd >= 0) {
+        close(stage_fd);
     }
 
-    // Объединяем метаданные
-    FileMeta *combined_meta = malloc(new_total * sizeof(FileMeta));
-    memcpy(combined_meta, old_meta, old_file_count * sizeof(FileMeta));
-    memcpy(&combined_meta[old_file_count], new_meta, new_file_count * sizeof(FileMeta));
-
-    // Записываем новые метаданные
-    new_meta_offset = ftell(new_arch);
-    write_metadata(new_arch, combined_meta, new_total);
-
-    // Обновляем смещение метаданных в начале файла
-    fseek(new_arch, 0, SEEK_SET);
-    fwrite(&new_meta_offset, sizeof(long), 1, new_arch);
-
-    // Финализируем операции
-    fclose(new_arch);
-    remove(archive_name);
-    rename(tmp_name, archive_name);
+    // Шаг 3: новые метаданные и фиксация заголовка. Длина метаданных v2
+    // зависит от итоговых размеров копий, разностей смещений (varint) и
+    // таблиц CRC блоков, известных только после записи данных, а не только
+    // от файлов, которые не прочитались. Поэтому проверка безусловная: если
+    // метаданные выросли и не помещаются до перенесенной копии, кладем их за нее.
+    if (new_meta_offset + footer_size(&catalog, &free_map) > relocated_offset) {
+        new_meta_offset = relocated_end;
+    }
+    fseek(arch, new_meta_offset, SEEK_SET);
+    new_end = new_meta_offset + write_footer(arch, &catalog, &free_map);
+    commit_header(arch, new_meta_offset);
+    drop_archive_cache(arch);
+
+    // Шаг 4: отрезаем перенесенную копию старых метаданных
+    if (ftruncate(fileno(arch), new_end) != 0) {
+        perror("Ошибка усечения архива");
+    }
 
-    free_metadata(old_meta, old_file_count);
-    free_metadata(new_meta, new_file_count);
-    free(combined_meta);
+    if (reused > 0) {
+        printf("Повторно использовано свободного места: %ld байт\n", (long)reused);
+    }
+    free_free_map(&free_map);
+    catalog_free(&catalog);
+    fclose(arch);
 }
 
 void extract_metadata(const char *archive_name, const char *output_meta_file) {
-    FILE *arch = fopen(archive_name, "rb");
-    if (!arch) {
-        perror("Ошибка открытия архива");
+    ArchiveView view;
+    Catalog catalog = {0};
+    if (open_archive_view(archive_name, &view, &catalog, NULL) != 0) {
         exit(EXIT_FAILURE);
     }
-
-    // Читаем смещение метаданных из начала файла
-    long meta_offset;
-    fread(&meta_offset, sizeof(long), 1, arch);
-
-    // Читаем количество файлов
-    int file_count;
-    fread(&file_count, sizeof(int), 1, arch);
-
-    // Переходим к метаданным
-    fseek(arch, meta_offset, SEEK_SET);
-    FileMeta *meta_array = read_metadata(arch, file_count);
+    // В формате v1 нет полей сжатия и кусков
+    for (int i = 0; i < catalog.count; i++) {
+        if (catalog.entries[i].flags & (ENTRY_COMPRESSED | ENTRY_CHUNK | ENTRY_CHUNKED | ENTRY_ERASURE)) {
+            printf("В архиве есть сжатые, разбитые на куски или шарды записи, метаданные v1 их не описывают\n");
+            close_archive_view(&view);
+            catalog_free(&catalog);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Записываем метаданные в файл
     FILE *meta_file = fopen(output_meta_file, "wb");
     if (!meta_file) {
         perror("Ошибка создания файла метаданных");
-        fclose(arch);
-        free_metadata(meta_array, file_count);
+        close_archive_view(&view);
+        catalog_free(&catalog);
         exit(EXIT_FAILURE);
     }
 
     // Записываем количество файлов
-    fwrite(&file_count, sizeof(int), 1, meta_file);
+    fwrite(&catalog.count, sizeof(int), 1, meta_file);
 
     // Записываем метаданные
-    write_metadata(meta_file, meta_array, file_count);
+    write_metadata(meta_file, &catalog);
 
     fclose(meta_file);
-    fclose(arch);
-    free_metadata(meta_array, file_count);
+    close_archive_view(&view);
+    catalog_free(&catalog);
 
     printf("Метаданные успешно извлечены в файл: %s\n", output_meta_file);
 }
@@ -909,12 +7459,12 @@ void load_metadata(const char *archive_name, const char *input_meta_file) {
     }
 
     // Читаем текущее смещение метаданных
-    long old_meta_offset;
-    fread(&old_meta_offset, sizeof(long), 1, arch);
-
-    // Читаем количество файлов
-    int old_file_count;
-    fread(&old_file_count, sizeof(int), 1, arch);
+    ArchiveView view;
+    ArchiveHeader header;
+    if (read_archive_file_header(arch, &view, &header) != 0) {
+        fclose(arch);
+        exit(EXIT_FAILURE);
+    }
 
     // Открываем файл метаданных для чтения
     FILE *meta_file = fopen(input_meta_file, "rb");
@@ -929,43 +7479,124 @@ void load_metadata(const char *archive_name, const char *input_meta_file) {
     fread(&new_file_count, sizeof(int), 1, meta_file);
 
     // Читаем новые метаданные
-    FileMeta *new_meta_array = read_metadata(meta_file, new_file_count);
+    Catalog catalog = {0};
+    if (read_metadata(meta_file, new_file_count, &catalog) != 0) {
+        printf("Ошибка чтения метаданных!\n");
+        fclose(meta_file);
+        fclose(arch);
+        catalog_free(&catalog);
+        exit(EXIT_FAILURE);
+    }
     fclose(meta_file);
 
     // Переходим к месту, где начинаются метаданные
-    fseek(arch, old_meta_offset, SEEK_SET);
-
-    // Записываем новые метаданные
-    long new_meta_offset = ftell(arch);
-    write_metadata(arch, new_meta_array, new_file_count);
+    long new_meta_offset = header.meta_offset;
+    fseek(arch, new_meta_offset, SEEK_SET);
+
+    // Записываем новые метаданные; карта свободного места относится к
+    // прежним и не переносится
+    FreeMap free_map = {0};
+    long new_end = new_meta_offset + write_footer(arch, &catalog, &free_map);
+    if (ftruncate(fileno(arch), new_end) != 0) {
+        perror("Ошибка усечения архива");
+    }
 
     // Обновляем смещение метаданных в начале файла
-    fseek(arch, 0, SEEK_SET);
-    fwrite(&new_meta_offset, sizeof(long), 1, arch);
+    commit_header(arch, new_meta_offset);
 
     fclose(arch);
-    free_metadata(new_meta_array, new_file_count);
+    catalog_free(&catalog);
 
     printf("Метаданные успешно загружены из файла: %s\n", input_meta_file);
 }
 
+// Избыточность -b: число реплик или k+m - код Рида-Соломона из k шардов
+// данных и m шардов четности. Возвращает число копий записи или -1
+static int parse_redundancy(const char *arg) {
+    int copies = atoi(arg);
+    const char *plus = strchr(arg, '+');
+    if (plus) {
+        int parity = atoi(plus + 1);
+        if (copies < 1 || parity < 1) {
+            return -1;
+        }
+        archive_data_shards = copies;
+        copies += parity;
+    }
+    return copies >= 1 && copies <= MAX_REDUNDANCY ? copies : -1;
+}
+
 int main(int argc, char *argv[]) {
     init_crc32_table();
+    init_block_crcs();
+    init_sha256();
+    init_gear_table();
+    init_erasure();
+
+    // Общие опции можно указать в любом месте командной строки
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-M") == 0) {
+            use_mmap = 1;
+        } else if (strcmp(argv[i], "-D") == 0) {
+            archive_dedup = 1;
+        } else if (strcmp(argv[i], "-direct") == 0) {
+            bulk_direct = 1;
+        } else if (strcmp(argv[i], "-io") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "uring") == 0 || strcmp(argv[i], "threads") == 0) {
+                io_force_threads = argv[i][0] == 't';
+            } else {
+                printf("Неизвестный движок ввода-вывода: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "none") == 0) {
+                archive_codec = CODEC_STORED;
+            } else if (strcmp(argv[i], "huffman") == 0) {
+                archive_codec = CODEC_HUFFMAN;
+            } else if (strcmp(argv[i], "rans") == 0) {
+                archive_codec = CODEC_RANS;
+            } else if (strncmp(argv[i], "lz", 2) == 0 && (argv[i][2] == '\0' ||
+                       (argv[i][2] >= '1' && argv[i][2] <= '0' + LZ_MAX_LEVEL && argv[i][3] == '\0'))) {
+                archive_codec = CODEC_LZ;
+                archive_level = argv[i][2] ? argv[i][2] - '0' : LZ_DEFAULT_LEVEL;
+            } else {
+                printf("Неизвестный кодек: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = NULL;
+
     if (argc < 3) {
         printf("Использование:\n");
-        printf("Упаковка: %s -c <архив> -b <избыточность> <файлы...>\n", argv[0]);
+        printf("Упаковка: %s -c <архив> -b <избыточность|k+m> <файлы|каталоги|-...>\n", argv[0]);
         printf("Удаление: %s -d <архив> <файл>\n", argv[0]);
-        printf("Верификация: %s -v <архив>\n", argv[0]);
-        printf("Добавление: %s -a <архив> -b <избыточность> <файлы...>\n", argv[0]);
+        printf("Сжатие архива: %s -vacuum <архив> [-t <порог_%%>]\n", argv[0]);
+        printf("Верификация: %s -v <архив> [-j <потоков>]\n", argv[0]);
+        printf("Исправление: %s -repair <архив> [-s <МБ/с>]\n", argv[0]);
+        printf("Добавление: %s -a <архив> -b <избыточность|k+m> <файлы|каталоги|-...>\n", argv[0]);
         printf("Распаковка: %s -x <архив> <директория> [-f <файл>]\n", argv[0]);
         printf("Список: %s -l <архив>\n", argv[0]);
+        printf("Опции: -M - читать архив через mmap (-l, -v, -x, -mx)\n");
+        printf("       -z <none|huffman|rans|lz|lz1..lz9> - сжатие записей при -c и -a (по умолчанию lz6)\n");
+        printf("       -D - дедупликация при -c и -a: одинаковые куски файлов хранятся один раз\n");
+        printf("       -direct - -c и -a мимо кэша страниц: реплики через O_DIRECT, прочитанное выбрасывается\n");
+        printf("       -io <uring|threads> - асинхронный ввод-вывод -c, -a, -x, -v (по умолчанию io_uring)\n");
         printf("\n");
         printf("Tests funtions:\n");
         printf("Извлечение метаданных: %s -mx <архив> <выходной_файл_метаданных>\n", argv[0]);
         printf("Загрузка метаданных: %s -ma <архив> <входной_файл_метаданных>\n", argv[0]);
+        printf("Проверка ядер CRC32: %s -crc <файл>\n", argv[0]);
         printf("\n");
-        printf("Сжатие: %s -p <входной_файл> <выходной_файл>\n", argv[0]);
-        printf("Распаковка: %s -u <входной_файл> <выходной_файл>\n", argv[0]);
+        printf("Сжатие: %s -p <входной_файл> <выходной_файл> [-j <потоков>] [-L <уровень 0-9>] [-e <huffman|rans>]\n",
+               argv[0]);
+        printf("Распаковка: %s -u <входной_файл> <выходной_файл> [-j <потоков>] [-r <смещение> <длина>]\n", argv[0]);
         return 0;
     }
     
@@ -974,27 +7605,57 @@ int main(int argc, char *argv[]) {
             printf("Ошибка: Укажите избыточность через -b\n");
             return 1;
         }
-        int redundancy = atoi(argv[4]);
-        if (redundancy < 1 || redundancy > MAX_REDUNDANCY) {
-            printf("Некорректная избыточность (1-%d)\n", MAX_REDUNDANCY);
+        int redundancy = parse_redundancy(argv[4]);
+        if (redundancy < 0) {
+            printf("Некорректная избыточность (1-%d или k+m, k + m <= %d)\n", MAX_REDUNDANCY, MAX_REDUNDANCY);
+            return 1;
+        }
+        if (archive_data_shards > 0 && archive_dedup) {
+            printf("Дедупликация (-D) не сочетается с кодом k+m\n");
             return 1;
         }
-        create_archive(argv[2], argc - 5, &argv[5], redundancy);
+        InputList inputs = {0};
+        collect_input_files(argc - 5, &argv[5], &inputs);
+        create_archive(argv[2], &inputs, redundancy);
+        free_input_list(&inputs);
     } else if (strcmp(argv[1], "-d") == 0) {
         delete_from_archive(argv[2], argv[3]);
+    } else if (strcmp(argv[1], "-vacuum") == 0) {
+        int threshold = 10;
+        if (argc > 4 && strcmp(argv[3], "-t") == 0) {
+            threshold = atoi(argv[4]);
+        }
+        vacuum_archive(argv[2], threshold);
     } else if (strcmp(argv[1], "-v") == 0) {
-        verify_archive(argv[2]);
+        int workers = default_workers();
+        if (argc > 4 && strcmp(argv[3], "-j") == 0) {
+            workers = atoi(argv[4]);
+        }
+        verify_archive(argv[2], workers);
+    } else if (strcmp(argv[1], "-repair") == 0) {
+        double rate = 0;
+        if (argc > 4 && strcmp(argv[3], "-s") == 0) {
+            rate = atof(argv[4]) * 1e6;
+        }
+        repair_archive(argv[2], rate);
     } else if (strcmp(argv[1], "-a") == 0) {
         if (argc < 5 || strcmp(argv[3], "-b") != 0) {
             printf("Ошибка: Укажите избыточность через -b\n");
             return 1;
         }
-        int redundancy = atoi(argv[4]);
-        if (redundancy < 1 || redundancy > MAX_REDUNDANCY) {
-            printf("Некорректная избыточность (1-%d)\n", MAX_REDUNDANCY);
+        int redundancy = parse_redundancy(argv[4]);
+        if (redundancy < 0) {
+            printf("Некорректная избыточность (1-%d или k+m, k + m <= %d)\n", MAX_REDUNDANCY, MAX_REDUNDANCY);
             return 1;
         }
-        add_to_archive(argv[2], argc - 5, &argv[5], redundancy);
+        if (archive_data_shards > 0 && archive_dedup) {
+            printf("Дедупликация (-D) не сочетается с кодом k+m\n");
+            return 1;
+        }
+        InputList inputs = {0};
+        collect_input_files(argc - 5, &argv[5], &inputs);
+        add_to_archive(argv[2], &inputs, redundancy);
+        free_input_list(&inputs);
     } else if (strcmp(argv[1], "-x") == 0) {
         if (argc < 4) {
             printf("Укажите выходную директорию\n");
@@ -1019,10 +7680,48 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         load_metadata(argv[2], argv[3]);
-    }else if (strcmp(argv[1], "-p") == 0) {
-        compress_file(argv[2], argv[3]);
-    } else if (strcmp(argv[1], "-u") == 0) {
-        decompress_file(argv[2], argv[3]);
+    } else if (strcmp(argv[1], "-crc") == 0) {
+        test_crc32(argv[2]);
+    } else if (strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "-u") == 0) {
+        if (argc < 4) {
+            printf("Укажите входной и выходной файлы\n");
+            return 1;
+        }
+        int workers = default_workers(), level = LZ_DEFAULT_LEVEL, entropy = ENTROPY_HUFFMAN;
+        long long range_offset = 0, range_length = -1;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                workers = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+                level = atoi(argv[++i]);
+                if (level < 0 || level > LZ_MAX_LEVEL) {
+                    printf("Некорректный уровень (0-%d)\n", LZ_MAX_LEVEL);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+                i++;
+                if (strcmp(argv[i], "huffman") == 0) {
+                    entropy = ENTROPY_HUFFMAN;
+                } else if (strcmp(argv[i], "rans") == 0) {
+                    entropy = ENTROPY_RANS;
+                } else {
+                    printf("Неизвестный кодер: %s\n", argv[i]);
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "-r") == 0 && i + 2 < argc) {
+                range_offset = atoll(argv[++i]);
+                range_length = atoll(argv[++i]);
+                if (range_offset < 0 || range_length < 0) {
+                    printf("Некорректный диапазон\n");
+                    return 1;
+                }
+            }
+        }
+        if (argv[1][1] == 'p') {
+            compress_file(argv[2], argv[3], workers, level, entropy);
+        } else {
+            decompress_file(argv[2], argv[3], workers, range_offset, range_length);
+        }
     } else {
         printf("Неизвестная команда\n");
     }
@@ -25,3 +25,30 @@ done
 
 rm -rf del/*
 ./ooo -x out.ooo del
+
+# -a -D с большей избыточностью, прерванный на каждом fsync: архив должен
+# читаться, а файл - извлекаться (в том числе сразу после шага 1)
+cat >del/killfsync.c <<'SRC'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+static int calls;
+int fsync(int fd) {
+    const char *at = getenv("KILL_AT_FSYNC");
+    if (at && ++calls == atoi(at)) kill(getpid(), SIGKILL);
+    return ((int (*)(int))dlsym(RTLD_NEXT, "fsync"))(fd);
+}
+SRC
+gcc -shared -fPIC del/killfsync.c -o del/killfsync.so -ldl
+head -c 300k </dev/urandom >del/crash.dat
+for (( n=1; n<=6; n++ ))
+do
+  rm -rf crash.ooo del/out
+  ./ooo -c crash.ooo -b 1 -D del/crash.dat >/dev/null
+  KILL_AT_FSYNC=$n LD_PRELOAD=$PWD/del/killfsync.so ./ooo -a crash.ooo -b 2 -D del/crash.dat >/dev/null 2>&1
+  mkdir -p del/out
+  ./ooo -x crash.ooo del/out >/dev/null </dev/null
+  cmp del/crash.dat del/out/del/crash.dat || echo "ОШИБКА: архив не читается после остановки на fsync $n"
+done